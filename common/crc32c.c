@@ -0,0 +1,69 @@
+/*
+ * Part of Jari Komppa's zx spectrum next suite
+ * https://github.com/jarikomppa/specnext
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
+ */
+
+// CRC-32C (Castagnoli), as used by the .nex header checksum.
+//
+// Slice-by-8: eight 256-entry tables let the inner loop consume 8 bytes
+// per iteration, so multi-megabyte images checksum at memory speed.
+// Call crc32c_update() repeatedly to checksum a stream; start with
+// crc = 0.
+//
+// The .nex checksum covers the file from offset 512 to the end,
+// followed by header bytes 0..507 (everything but the CRC field itself).
+
+static unsigned int crc32c_table[8][256];
+static int crc32c_ready = 0;
+
+static void crc32c_init()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        unsigned int c = i;
+        for (int j = 0; j < 8; j++)
+            c = (c >> 1) ^ ((c & 1) ? 0x82f63b78 : 0);
+        crc32c_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        unsigned int c = crc32c_table[0][i];
+        for (int j = 1; j < 8; j++)
+        {
+            c = (c >> 8) ^ crc32c_table[0][c & 0xff];
+            crc32c_table[j][i] = c;
+        }
+    }
+    crc32c_ready = 1;
+}
+
+unsigned int crc32c_update(unsigned int aCrc, const unsigned char * aData, size_t aLen)
+{
+    if (!crc32c_ready)
+        crc32c_init();
+    unsigned int c = ~aCrc;
+    while (aLen >= 8)
+    {
+        // little-endian assembly so this works the same on any host
+        unsigned int lo = c ^ (aData[0] | (aData[1] << 8) | (aData[2] << 16) | ((unsigned int)aData[3] << 24));
+        unsigned int hi = aData[4] | (aData[5] << 8) | (aData[6] << 16) | ((unsigned int)aData[7] << 24);
+        c = crc32c_table[7][lo & 0xff] ^
+            crc32c_table[6][(lo >> 8) & 0xff] ^
+            crc32c_table[5][(lo >> 16) & 0xff] ^
+            crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][hi & 0xff] ^
+            crc32c_table[2][(hi >> 8) & 0xff] ^
+            crc32c_table[1][(hi >> 16) & 0xff] ^
+            crc32c_table[0][hi >> 24];
+        aData += 8;
+        aLen -= 8;
+    }
+    while (aLen)
+    {
+        c = (c >> 8) ^ crc32c_table[0][(c ^ *aData++) & 0xff];
+        aLen--;
+    }
+    return ~c;
+}
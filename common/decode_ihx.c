@@ -1,92 +1,227 @@
 /*
- * Part of Jari Komppa's zx spectrum next suite 
+ * Part of Jari Komppa's zx spectrum next suite
  * https://github.com/jarikomppa/specnext
- * released under the unlicense, see http://unlicense.org 
- * (practically public domain) 
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
  */
 
+// Intel HEX decoder.
+//
+// decode_ihx_ex() decodes in a single pass with a nibble lookup table,
+// never allocates and never exits; errors are returned as IHX_ERR_*
+// codes along with the 1-based line and column where they were found.
+// Record types 00 (data), 01 (eof), 02 (extended segment address),
+// 03 (start segment address, ignored), 04 (extended linear address)
+// and 05 (start linear address, ignored) are supported, so images
+// larger than 64K decode into a caller-supplied buffer of any size.
+//
+// decode_ihx_window() stores only the bytes that fall in a given address
+// window and skips the rest, so a large image can be produced one bank at
+// a time without a full-size intermediate buffer.
+//
+// decode_ihx() is the old 64K interface; it prints the error and
+// returns -1 instead of decoding.
 
-int decode_ihx(unsigned char *src, int len, unsigned char *data, int &start, int &end)
-{    
-    start = 0x10000;
-    end = 0;
-    int line = 0;
+enum
+{
+    IHX_OK = 0,
+    IHX_ERR_NOCOLON,    // record doesn't start with ':'
+    IHX_ERR_HEXDIGIT,   // non-hex character inside a record
+    IHX_ERR_TRUNCATED,  // input ends in the middle of a record
+    IHX_ERR_CHECKSUM,   // record checksum mismatch
+    IHX_ERR_RECORDTYPE, // unknown record type
+    IHX_ERR_RECORDLEN,  // record type 02/04 with byte count other than 2
+    IHX_ERR_RANGE       // data outside the output buffer
+};
+
+struct ihx_result
+{
+    int error;  // IHX_OK or IHX_ERR_*
+    int line;   // line of the error (1-based)
+    int column; // column of the error (1-based)
+    int start;  // lowest address written
+    int end;    // highest address written (inclusive), start-1 if nothing was written
+};
+
+static const unsigned char ihx_nibble[256] =
+{
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+    0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff
+};
+
+const char * ihx_error_string(int aError)
+{
+    switch (aError)
+    {
+        case IHX_OK: return "No error";
+        case IHX_ERR_NOCOLON: return "Record does not start with ':'";
+        case IHX_ERR_HEXDIGIT: return "Invalid hex digit";
+        case IHX_ERR_TRUNCATED: return "Truncated record";
+        case IHX_ERR_CHECKSUM: return "Checksum failure";
+        case IHX_ERR_RECORDTYPE: return "Unsupported record type";
+        case IHX_ERR_RECORDLEN: return "Bad address record length";
+        case IHX_ERR_RANGE: return "Address outside output buffer";
+    }
+    return "Unknown error";
+}
+
+// Decodes ihx text src (len bytes, need not be zero terminated). Bytes at
+// addresses lo..hi-1 are stored to data[address - lo]; others are an error
+// unless aClip is set, in which case they're skipped. start/end in r cover
+// all data records regardless of the window.
+int decode_ihx_range(const unsigned char *src, int len, unsigned char *data, int lo, int hi, int aClip, ihx_result &r)
+{
     int idx = 0;
-    while (src[idx])
+    int linestart = 0;
+    int base = 0;
+    int segment = 0;
+    int start = 0x7fffffff;
+    int end = -1;
+    r.line = 0;
+    r.column = 0;
+
+#define IHX_FAIL(err, at) { r.error = (err); r.column = (at) - linestart + 1; r.start = start; r.end = end; return (err); }
+// Reads one hex byte at src[p] into v; p+2 must be <= len.
+#define IHX_BYTE(v, p) { int nh = ihx_nibble[src[(p)]], nl = ihx_nibble[src[(p) + 1]]; if ((nh | nl) & 0xf0) IHX_FAIL(IHX_ERR_HEXDIGIT, ((nh & 0xf0) ? (p) : (p) + 1)); v = (nh << 4) | nl; }
+
+    while (idx < len && src[idx])
     {
-        line++;
-        int sum = 0;
-        char tmp[8];
+        r.line++;
+        linestart = idx;
         if (src[idx] != ':')
-        {
-            printf("Parse error near line %d? (previous chars:\"%c%c%c%c%c%c\")\n", line,
-                (idx < 5) ? '?' : (src[idx - 5] < 32) ? '?' : src[idx - 5],
-                (idx < 4) ? '?' : (src[idx - 4] < 32) ? '?' : src[idx - 4],
-                (idx < 3) ? '?' : (src[idx - 3] < 32) ? '?' : src[idx - 3],
-                (idx < 2) ? '?' : (src[idx - 2] < 32) ? '?' : src[idx - 2],
-                (idx < 1) ? '?' : (src[idx - 1] < 32) ? '?' : src[idx - 1],
-                (idx < 0) ? '?' : (src[idx - 0] < 32) ? '?' : src[idx - 0]);
-            exit(0);
-        }
+            IHX_FAIL(IHX_ERR_NOCOLON, idx);
         idx++;
-        tmp[0] = '0';
-        tmp[1] = 'x';
-        tmp[2] = src[idx]; idx++;
-        tmp[3] = src[idx]; idx++;
-        tmp[4] = 0;
-        int bytecount = strtol(tmp, 0, 16);
-        sum += bytecount;
-        tmp[2] = src[idx]; idx++;
-        tmp[3] = src[idx]; idx++;
-        tmp[4] = src[idx]; idx++;
-        tmp[5] = src[idx]; idx++;
-        tmp[6] = 0;
-        int address = strtol(tmp, 0, 16);
-        sum += (address >> 8) & 0xff;
-        sum += (address & 0xff);
-        tmp[2] = src[idx]; idx++;
-        tmp[3] = src[idx]; idx++;
-        tmp[4] = 0;
-        int recordtype = strtol(tmp, 0, 16);
-        sum += recordtype;
+        // Fixed part of record: count(2) address(4) type(2) checksum(2)
+        if (idx + 10 > len)
+            IHX_FAIL(IHX_ERR_TRUNCATED, len);
+        int bytecount, ah, al, recordtype, byte;
+        IHX_BYTE(bytecount, idx);
+        IHX_BYTE(ah, idx + 2);
+        IHX_BYTE(al, idx + 4);
+        IHX_BYTE(recordtype, idx + 6);
+        idx += 8;
+        if (idx + bytecount * 2 + 2 > len)
+            IHX_FAIL(IHX_ERR_TRUNCATED, len);
+        int sum = bytecount + ah + al + recordtype;
+        int address = (ah << 8) | al;
         switch (recordtype)
         {
-            case 0:
-            case 1:
+            case 0: // data
+            {
+                // Under a segment base the offset wraps at 64K, so a
+                // record can come in two pieces.
+                int at = idx - 6;
+                int off = address;
+                while (bytecount)
+                {
+                    int piece = bytecount;
+                    if (segment && off + piece > 0x10000)
+                        piece = 0x10000 - off;
+                    address = base + off;
+                    if (!aClip && (address < lo || address + piece > hi))
+                        IHX_FAIL(IHX_ERR_RANGE, at);
+                    if (start > address)
+                        start = address;
+                    if (end < address + piece - 1)
+                        end = address + piece - 1;
+                    bytecount -= piece;
+                    off = (off + piece) & 0xffff;
+                    while (piece)
+                    {
+                        IHX_BYTE(byte, idx);
+                        idx += 2;
+                        sum += byte;
+                        if (address >= lo && address < hi)
+                            data[address - lo] = byte;
+                        address++;
+                        piece--;
+                    }
+                }
                 break;
-            default:
-                printf("Unsupported record type %d\n", recordtype);
-                exit(0);
+            }
+            case 2: // extended segment address
+            case 4: // extended linear address
+                if (bytecount != 2)
+                    IHX_FAIL(IHX_ERR_RECORDLEN, idx - 8);
+                IHX_BYTE(ah, idx);
+                IHX_BYTE(al, idx + 2);
+                idx += 4;
+                sum += ah + al;
+                segment = recordtype == 2;
+                base = segment ? (((ah << 8) | al) << 4) : (((ah << 8) | al) << 16);
                 break;
+            case 1: // end of file
+            case 3: // start segment address
+            case 5: // start linear address
+                while (bytecount)
+                {
+                    IHX_BYTE(byte, idx);
+                    idx += 2;
+                    sum += byte;
+                    bytecount--;
+                }
+                break;
+            default:
+                IHX_FAIL(IHX_ERR_RECORDTYPE, idx - 2);
         }
-        //printf("%d bytes from %d, record %d\n", bytecount, address, recordtype);
-        while (bytecount)
-        {
-            tmp[2] = src[idx]; idx++;
-            tmp[3] = src[idx]; idx++;
-            tmp[4] = 0;
-            int byte = strtol(tmp,0,16);
-            sum += byte;
-            data[address] = byte;
-            if (start > address)
-                start = address;
-            if (end < address)
-                end = address;
-            address++;
-            bytecount--;
-        }
-        tmp[2] = src[idx]; idx++;
-        tmp[3] = src[idx]; idx++;
-        tmp[4] = 0;
-        int checksum = strtol(tmp,0,16);
-        sum = (sum ^ 0xff) + 1;
-        if (checksum != (sum & 0xff))
-        {
-            printf("Checksum failure %02x, expected %02x\n", sum & 0xff, checksum);
-            exit(0);
-        }
+        int checksum;
+        IHX_BYTE(checksum, idx);
+        if (((sum + checksum) & 0xff) != 0)
+            IHX_FAIL(IHX_ERR_CHECKSUM, idx);
+        idx += 2;
+
+        while (idx < len && (src[idx] == '\n' || src[idx] == '\r')) idx++;
+
+        if (recordtype == 1)
+            break;
+    }
+#undef IHX_BYTE
+#undef IHX_FAIL
+
+    if (end < 0)
+        start = 0;
+    r.error = IHX_OK;
+    r.start = start;
+    r.end = end;
+    return IHX_OK;
+}
+
+// Decodes into data, which holds datasize bytes from address 0 up.
+int decode_ihx_ex(const unsigned char *src, int len, unsigned char *data, int datasize, ihx_result &r)
+{
+    return decode_ihx_range(src, len, data, 0, datasize, 0, r);
+}
 
-        while (src[idx] == '\n' || src[idx] == '\r') idx++;         
-    }    
+// Decodes only addresses lo..hi-1 into data, skipping everything else.
+int decode_ihx_window(const unsigned char *src, int len, unsigned char *data, int lo, int hi, ihx_result &r)
+{
+    return decode_ihx_range(src, len, data, lo, hi, 1, r);
+}
+
+// Old interface: decodes into a 64K buffer, prints errors and returns -1 on failure.
+int decode_ihx(unsigned char *src, int len, unsigned char *data, int &start, int &end)
+{
+    ihx_result r;
+    if (decode_ihx_ex(src, len, data, 0x10000, r) != IHX_OK)
+    {
+        printf("%s near line %d, column %d\n", ihx_error_string(r.error), r.line, r.column);
+        return -1;
+    }
+    start = r.start;
+    end = r.end;
     return end - start + 1;
 }
@@ -0,0 +1,75 @@
+; zxnDMA bulk copies for the sjasmplus programs, INCLUDE as is. The init
+; and copy sequence are those of common/dma.s, which the sdcc programs
+; link; the two toolchains can't share a source.
+;
+; dma_init programs the port modes once, after which a memory copy is
+; just WR0 + WR4 + load + enable. Continuous mode holds the cpu until the
+; block is done, so every copy is synchronous and overlapping copies
+; behave like ldir. Short copies use ldir; break-even is 12 bytes.
+
+DMA_PORT EQU 0x6b
+
+dma_init:
+    ld hl, .initdata
+    ld bc, DMA_PORT | (.datasize<<8)
+    otir
+    ret
+.initdata:
+    db  $C3,$C3,$C3,$C3,$C3,$C3 ; reset DMA from any possible state (6x reset command)
+    db  %10'0'0'0010            ; WR5 = stop on end of block, /CE only
+    db  %1'0'000000             ; WR3 = all extra features [of real chip] disabled
+    db  %0'1'01'0'100           ; WR1 = A address ++, memory
+    db  2                       ; + custom 2T timing
+    db  %0'1'01'0'000           ; WR2 = B address ++, memory
+    db  2                       ; + custom 2T timing
+.datasize: EQU $ - .initdata
+
+; ------------------------------------------------------------------------
+
+; de dest (returns advanced by +bc)
+; hl src (returns advanced by +bc)
+; bc bytes (is preserved)
+; LDIR cost is 52 + 21*bc @3.5MHz ; 62 + 24*bc @28MHz (+read_wait)
+; DMA cost is 233 + 4*bc @3.5MHz ; 279 + 5*bc @28MHz (+read_wait)
+dma_memcpy:
+    ; check BC against break-even point (LDIR vs DMA)
+    ld a, 12 ; break-even is 12 @28MHz, 11 @3.5MHz
+    cp c
+    sbc a, a                    ; 00 for C <0..12>, FF for C <13..FF>
+    or b                        ; non-zero for BC > 12
+    jr nz, .dma
+    push bc
+    ldir
+    pop bc
+    ret
+.dma:
+    ; this code style using `out (n),a` is actually reasonably fast and preserves HL,DE,BC for free
+    ld a, 0b01111101; // R0-Transfer mode, A -> B, write adress + block length
+    out (DMA_PORT), a
+    ld a, l ; source
+    out (DMA_PORT), a
+    ld a, h ; source
+    out (DMA_PORT), a
+    ld a, c ; count
+    out (DMA_PORT), a
+    ld a, b ; count
+    out (DMA_PORT), a
+    ld a, 0b10101101; // R4-Continuous mode (use this for block transfer), write dest adress
+    out (DMA_PORT), a
+    ld a, e ; dest
+    out (DMA_PORT), a
+    ld a, d ; dest
+    out (DMA_PORT), a
+    ld a, 0b11001111; // R6-Load
+    out (DMA_PORT), a
+    ld a, 0x87;       // R6-Enable DMA
+    ; playflx's PERF_GRIND times the decoders without moving the bytes
+    IFNDEF PERF_GRIND
+    out (DMA_PORT), a
+    ENDIF
+    ; advance HL,DE the same way how LDIR would, but BC is preserved
+    add hl, bc
+    ex de, hl
+    add hl, bc
+    ex de, hl
+    ret
@@ -0,0 +1,102 @@
+	.module dma
+	.globl _dma_init
+	.globl _dma_memcpy
+	.globl _dma_memset
+	.area _CODE
+
+; zxnDMA bulk copies for the sdcc programs, set up the same way as the
+; blitters in playflx: dma_init programs the port modes once, after which
+; a memory copy is just WR0 + WR4 + load + enable. Continuous mode holds
+; the cpu until the block is done, so every call is synchronous and
+; overlapping copies behave like ldir (memset relies on that).
+; Short copies use ldir; break-even is 12 bytes. common/dma.asm has the
+; same init and copy sequence for sjasmplus programs (playflx), as they
+; can't link sdcc modules.
+
+DMA_PORT = 0x6b
+
+;extern void dma_init()
+_dma_init::
+    ld  hl, #dma_initdata
+    ld  b, #dma_initend - dma_initdata
+    ld  c, #DMA_PORT
+    otir
+    ret
+dma_initdata:
+    .db 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3 ; reset from any possible state
+    .db 0x82 ; WR5 = stop on end of block, /CE only
+    .db 0x80 ; WR3 = all extra features disabled
+    .db 0x54 ; WR1 = A address ++, memory
+    .db 2    ; + custom 2T timing
+    .db 0x50 ; WR2 = B address ++, memory
+    .db 2    ; + custom 2T timing
+dma_initend:
+
+; hl = source, de = dest, bc = count (0 is ok)
+dma_copy:
+    ld  a, #12
+    cp  c
+    sbc a, a      ; 0xff for c > 12
+    or  b         ; non-zero for bc > 12
+    jr  nz, dma_copy_dma
+    or  c
+    ret z
+    ldir
+    ret
+; as above, no length check; hl, de, bc preserved
+dma_copy_dma:
+    ld  a, #0x7d  ; WR0 = transfer A -> B, A address + block length follow
+    out (DMA_PORT), a
+    ld  a, l
+    out (DMA_PORT), a
+    ld  a, h
+    out (DMA_PORT), a
+    ld  a, c
+    out (DMA_PORT), a
+    ld  a, b
+    out (DMA_PORT), a
+    ld  a, #0xad  ; WR4 = continuous mode, B address follows
+    out (DMA_PORT), a
+    ld  a, e
+    out (DMA_PORT), a
+    ld  a, d
+    out (DMA_PORT), a
+    ld  a, #0xcf  ; WR6 = load
+    out (DMA_PORT), a
+    ld  a, #0x87  ; WR6 = enable
+    out (DMA_PORT), a
+    ret
+
+;extern void dma_memcpy(char *dest, const char *source, unsigned short count)
+_dma_memcpy::
+    pop iy  ; return
+    pop de  ; dest
+    pop hl  ; source
+    pop bc  ; count
+    push bc
+    push hl
+    push de
+    call dma_copy
+    jp  (iy)
+
+;extern void dma_memset(char *dest, const short value, unsigned short count)
+_dma_memset::
+    pop iy  ; return
+    pop de  ; dest
+    pop hl  ; value
+    pop bc  ; count
+    push bc
+    push hl
+    push de
+    ld  a, b
+    or  c
+    jr  z, memset_done
+    ld  a, l
+    ld  h, d
+    ld  l, e
+    ld  (hl), a ; seed, the copy drags it along
+    inc de
+    dec bc
+    call dma_copy
+memset_done:
+    jp  (iy)
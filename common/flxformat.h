@@ -0,0 +1,360 @@
+/*
+ * Part of Jari Komppa's zx spectrum next suite
+ * https://github.com/jarikomppa/specnext
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
+ */
+
+// FLX chunk formats, reference decoders and the decode time model,
+// shared by flxenc and flxbench. See flxenc.cpp for the file layout and
+// playflx/decoders.asm for the Next side. C++, and included by one
+// source file per tool, as the definitions are all here.
+
+#ifndef FLXFORMAT_H
+#define FLXFORMAT_H
+
+#define FLX_WIDTH 256
+#define FLX_HEIGHT 192
+#define FRAMESIZE (FLX_WIDTH * FLX_HEIGHT)
+#define HEADERSIZE (14 + 512)
+
+enum ChunkType
+{
+    NEXTFRAME = 0,
+    SAMEFRAME = 3,
+    BLACKFRAME = 6,
+    ONECOLOR = 9,
+    LZ1B = 12,
+    LZ4 = 15,
+    LZ5 = 18,
+    LZ6 = 21,
+    LZ3C = 24,
+    SUBFRAME = 27,
+    PALETTE = 30,
+    TILES = 33
+};
+
+enum OpKind
+{
+    OP_RLE,  // [byte]       fill
+    OP_LIT,  // [bytes]      copy from file
+    OP_PREV, // [word ofs]   copy from previous frame
+    OP_CUR,  // [word ofs]   copy from earlier in the current frame
+    OP_NEAR  // [signed ofs] copy from previous frame, relative to screen offset
+};
+
+// One of the two ops an LZ state can decode. Negative ops are encoded as
+// -length, the others as +length. Long ops use -128 or 127 as the op,
+// followed by a word length. Zero length always goes to the fill/literal
+// op; the decoders alternate between the two states after every op.
+struct OpSpec
+{
+    int mKind;
+    int mNegative;
+    int mLong;
+};
+
+struct LzFormat
+{
+    int mType;
+    const char * mName;
+    OpSpec mOp[2][2]; // [tick/tock][op]
+};
+
+static const LzFormat gFormats[] =
+{
+    { LZ1B, "LZ1B", { { { OP_RLE, 1, 0 }, { OP_PREV, 0, 0 } }, { { OP_PREV, 1, 0 }, { OP_LIT, 0, 0 } } } },
+    { LZ3C, "LZ3C", { { { OP_RLE, 1, 1 }, { OP_NEAR, 0, 1 } }, { { OP_LIT, 1, 1 }, { OP_NEAR, 0, 1 } } } },
+    { LZ4,  "LZ4",  { { { OP_RLE, 1, 1 }, { OP_CUR,  0, 1 } }, { { OP_CUR,  1, 1 }, { OP_LIT, 0, 0 } } } },
+    { LZ5,  "LZ5",  { { { OP_RLE, 1, 1 }, { OP_PREV, 0, 1 } }, { { OP_PREV, 1, 1 }, { OP_LIT, 0, 1 } } } },
+    { LZ6,  "LZ6",  { { { OP_RLE, 1, 1 }, { OP_PREV, 0, 1 } }, { { OP_CUR,  1, 1 }, { OP_LIT, 0, 1 } } } }
+};
+#define FORMATS (int)(sizeof(gFormats) / sizeof(gFormats[0]))
+
+// Op and argument bytes, not counting literal data
+static int opbytes(int aKind)
+{
+    switch (aKind)
+    {
+        case OP_RLE: return 2;
+        case OP_LIT: return 1;
+        case OP_NEAR: return 2;
+    }
+    return 3;
+}
+
+// Slot taking zero length ops in the given state
+static int zeroslot(const LzFormat &aFormat, int aState)
+{
+    int k = aFormat.mOp[aState][0].mKind;
+    return (k == OP_RLE || k == OP_LIT) ? 0 : 1;
+}
+
+#define TILECOLS (FLX_WIDTH / 8)
+#define TILECOUNT (TILECOLS * (FLX_HEIGHT / 8))
+
+// Decode time model, in T-states at 28MHz, counted from decoders.asm,
+// blitters.asm and streamingio.asm. Measured PERF_GRIND numbers can be
+// dropped in with -costs.
+struct CostModel
+{
+    int mChunk;      // type byte, dispatch, size and checksum words
+    int mOp;         // op byte and the decoder loop around the op
+    int mReadByte;   // extra readbyte (run value, near offset)
+    int mReadWord;   // extra readword (long length, offset)
+    int mFill;       // screenfill setup
+    int mFileCopy;   // screencopyfromfile + read setup
+    int mPrevCopy;   // screencopyfromprevframe setup
+    int mLdirBase;   // memcpy with ldir (up to mDmaMin bytes)
+    int mLdirByte;
+    int mDmaBase;    // memcpy with dma
+    int mDmaByte;
+    int mDmaMin;
+    int mStreamByte; // ini from the sd card, per file byte
+    int mTile;       // TILES: one tile, 8 rows of ldi and the loop around it
+};
+
+static CostModel gCost = { 760, 300, 119, 273, 190, 330, 260, 79, 24, 296, 5, 12, 16, 2100 };
+
+static const struct { const char *mName; int *mValue; } gCostNames[] =
+{
+    { "chunk", &gCost.mChunk }, { "op", &gCost.mOp }, { "readbyte", &gCost.mReadByte },
+    { "readword", &gCost.mReadWord }, { "fill", &gCost.mFill }, { "filecopy", &gCost.mFileCopy },
+    { "prevcopy", &gCost.mPrevCopy }, { "ldirbase", &gCost.mLdirBase }, { "ldirbyte", &gCost.mLdirByte },
+    { "dmabase", &gCost.mDmaBase }, { "dmabyte", &gCost.mDmaByte }, { "dmamin", &gCost.mDmaMin },
+    { "streambyte", &gCost.mStreamByte }, { "tile", &gCost.mTile }
+};
+
+// "name value" lines, # starts a comment
+static int loadcosts(const char *aFilename)
+{
+    FILE *f = fopen(aFilename, "r");
+    if (!f)
+        return 0;
+    char line[256], name[64];
+    int value;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (line[0] == '#' || sscanf(line, "%63s %d", name, &value) != 2)
+            continue;
+        int found = 0;
+        for (size_t i = 0; i < sizeof(gCostNames) / sizeof(gCostNames[0]); i++)
+        {
+            if (strcmp(name, gCostNames[i].mName) == 0)
+            {
+                *gCostNames[i].mValue = value;
+                found = 1;
+            }
+        }
+        if (!found)
+            printf("Unknown cost \"%s\"\n", name);
+    }
+    fclose(f);
+    return 1;
+}
+
+static int memcpycycles(int aBytes)
+{
+    if (aBytes <= 0)
+        return 0;
+    if (aBytes <= gCost.mDmaMin)
+        return gCost.mLdirBase + gCost.mLdirByte * aBytes;
+    return gCost.mDmaBase + gCost.mDmaByte * aBytes;
+}
+
+// Cycles for one op, including streaming its bytes in. Blits split at
+// 8K page boundaries, which repeats the setup.
+static int opcycles(int aKind, int aLen, int aLong)
+{
+    int c = gCost.mOp + (aLong ? gCost.mReadWord : 0);
+    int bytes = opbytes(aKind) + (aLong ? 2 : 0) + (aKind == OP_LIT ? aLen : 0);
+    int pages = aLen >> 13;
+    switch (aKind)
+    {
+        case OP_RLE:
+            c += gCost.mReadByte;
+            if (aLen)
+                c += (gCost.mFill + memcpycycles(aLen - 1)) + pages * gCost.mFill;
+            break;
+        case OP_LIT:
+            if (aLen)
+                c += (gCost.mFileCopy + memcpycycles(aLen)) + pages * gCost.mFileCopy;
+            break;
+        case OP_NEAR:
+            c += gCost.mReadByte + gCost.mPrevCopy + memcpycycles(aLen) + pages * gCost.mPrevCopy;
+            break;
+        default:
+            c += gCost.mReadWord + gCost.mPrevCopy + memcpycycles(aLen) + pages * gCost.mPrevCopy;
+            break;
+    }
+    return c + bytes * gCost.mStreamByte;
+}
+
+// Whole screen fills and copies (SAMEFRAME, BLACKFRAME, ONECOLOR)
+static int fullscreencycles(int aType)
+{
+    int c = gCost.mChunk + (aType == ONECOLOR ? gCost.mReadByte : 0);
+    if (aType == SAMEFRAME)
+        return c + 6 * (gCost.mPrevCopy + gCost.mDmaBase) + gCost.mDmaByte * FRAMESIZE + 5 * gCost.mStreamByte;
+    return c + 3 * (gCost.mFill + gCost.mDmaBase) + gCost.mDmaByte * FRAMESIZE + (aType == ONECOLOR ? 6 : 5) * gCost.mStreamByte;
+}
+
+// TILES: one [skip][count] run, and one 8x8 tile within a run
+static int tileruncycles()
+{
+    return gCost.mOp + 2 * gCost.mReadByte + 2 * gCost.mStreamByte;
+}
+
+static int tilecycles()
+{
+    return gCost.mTile + 64 * gCost.mStreamByte;
+}
+
+// What the decoders did, summed over any number of chunks. Pixels are
+// bytes written to the frame; literal data is mPixels[OP_LIT].
+struct FlxOpStats
+{
+    long long mOps[5];    // by OpKind
+    long long mPixels[5];
+    long long mLong;      // ops with a word length
+    long long mCycles;    // modeled decode time, as flxenc counts it
+};
+
+// Decodes one LZ block over aOut, the way playflx does. Returns 0 if the
+// block was well formed and covered the whole frame. Ops are added to
+// aStats if given.
+static int lzdecode(const LzFormat &aFormat, const unsigned char *aData, int aLen, const unsigned char *aPrev, unsigned char *aOut, FlxOpStats *aStats = 0)
+{
+    int idx = 0, p = 0, s = 0;
+    while (idx < aLen)
+    {
+        signed char b = (signed char)aData[idx++];
+        int slot;
+        if (b == 0)
+            slot = zeroslot(aFormat, s);
+        else
+            slot = (aFormat.mOp[s][0].mNegative == (b < 0)) ? 0 : 1;
+        const OpSpec &op = aFormat.mOp[s][slot];
+        int l = op.mNegative ? -b : b;
+        int islong = op.mLong && b == (op.mNegative ? -128 : 127);
+        if (islong)
+        {
+            if (idx + 2 > aLen)
+                return -1;
+            l = aData[idx] | (aData[idx + 1] << 8);
+            idx += 2;
+        }
+        if (p + l > FRAMESIZE)
+            return -1;
+        int src;
+        switch (op.mKind)
+        {
+            case OP_RLE:
+                if (idx + 1 > aLen)
+                    return -1;
+                memset(aOut + p, aData[idx++], l);
+                break;
+            case OP_LIT:
+                if (idx + l > aLen)
+                    return -1;
+                memcpy(aOut + p, aData + idx, l);
+                idx += l;
+                break;
+            case OP_PREV:
+            case OP_CUR:
+                if (idx + 2 > aLen)
+                    return -1;
+                src = aData[idx] | (aData[idx + 1] << 8);
+                idx += 2;
+                if (src + l > FRAMESIZE || (op.mKind == OP_PREV && !aPrev) || (op.mKind == OP_CUR && src + l > p))
+                    return -1;
+                memcpy(aOut + p, (op.mKind == OP_PREV ? aPrev : aOut) + src, l);
+                break;
+            case OP_NEAR:
+                if (idx + 1 > aLen || !aPrev)
+                    return -1;
+                src = p + (signed char)aData[idx++];
+                if (src < 0 || src + l > FRAMESIZE)
+                    return -1;
+                memcpy(aOut + p, aPrev + src, l);
+                break;
+        }
+        if (aStats)
+        {
+            aStats->mOps[op.mKind]++;
+            aStats->mPixels[op.mKind] += l;
+            aStats->mLong += islong;
+            aStats->mCycles += opcycles(op.mKind, l, islong);
+        }
+        p += l;
+        s ^= 1;
+    }
+    if (aStats)
+        aStats->mCycles += gCost.mChunk + 5 * gCost.mStreamByte;
+    return (p == FRAMESIZE) ? 0 : -1;
+}
+
+// TILES runs count as OP_PREV ops for the skipped tiles and OP_LIT ops
+// per tile in the stats.
+static int tiledecode(const unsigned char *aData, int aLen, const unsigned char *aPrev, unsigned char *aOut, FlxOpStats *aStats = 0)
+{
+    memcpy(aOut, aPrev, FRAMESIZE);
+    if (aStats)
+        aStats->mCycles += fullscreencycles(SAMEFRAME);
+    int i = 0, t = 0;
+    while (i < aLen)
+    {
+        if (i + 2 > aLen)
+            return -1;
+        t += aData[i];
+        int count = aData[i + 1];
+        i += 2;
+        if (t + count > TILECOUNT || i + count * 64 > aLen)
+            return -1;
+        if (aStats)
+        {
+            aStats->mOps[OP_PREV]++;
+            aStats->mPixels[OP_PREV] += aData[i - 2] * 64;
+            aStats->mOps[OP_LIT] += count;
+            aStats->mPixels[OP_LIT] += count * 64;
+            aStats->mCycles += tileruncycles() + count * tilecycles();
+        }
+        for (; count; count--, t++)
+        {
+            int ofs = (t / TILECOLS) * 8 * FLX_WIDTH + (t % TILECOLS) * 8;
+            for (int y = 0; y < 8; y++, ofs += FLX_WIDTH, i += 8)
+                memcpy(aOut + ofs, aData + i, 8);
+        }
+    }
+    return 0;
+}
+
+// playflx calcchecksum: e ^= byte, d += e over the render target
+static unsigned short checksum(const unsigned char *aFrame)
+{
+    unsigned char e = 0, d = 0;
+    for (int i = 0; i < FRAMESIZE; i++)
+    {
+        e ^= aFrame[i];
+        d += e;
+    }
+    return (unsigned short)((d << 8) | e);
+}
+
+static const char *chunkname(int aType)
+{
+    switch (aType)
+    {
+        case SAMEFRAME: return "SAMEFRAME";
+        case BLACKFRAME: return "BLACKFRAME";
+        case ONECOLOR: return "ONECOLOR";
+        case PALETTE: return "PALETTE";
+        case TILES: return "TILES";
+    }
+    for (int i = 0; i < FORMATS; i++)
+        if (gFormats[i].mType == aType)
+            return gFormats[i].mName;
+    return "?";
+}
+
+#endif // FLXFORMAT_H
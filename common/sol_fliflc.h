@@ -23,11 +23,31 @@ Usage example:
     }
     
     fli_free(fli);
+
+fli_open_stream() works the same way, but only keeps the current frame
+in memory and reads the next one from disk in fli_render().
+
+fli_seek(fli, n) makes the next fli_render() produce frame n. Frame
+positions are indexed as frames are rendered. The index only covers
+frames that have been rendered once; seeking past them renders forward
+to get there. Going back replays from frame 0, unless fli_snapshots()
+was called: from then on the picture and palette are also saved every
+FLI_SNAPSHOT_INTERVAL frames, so a seek only replays the frames since
+the nearest snapshot. That makes scrubbing or looping from a mark cheap,
+at the cost of memory growing with the length of the clip. One pass
+over the file is serial either way, as every frame is a delta on the
+last one.
+
+The chunk decoders write runs with memset / memcpy; define
+SOL_FLIFLC_SCALAR before including to get the byte-at-a-time reference
+versions instead. Defining SOL_FLIFLC_NO_EXTERN_C gives the functions
+C++ linkage, so that both can be built into one program in separate
+namespaces (see tools/flicheck.cpp).
 	*/
 
 #ifndef SOL_FLIFLC_H
 #define SOL_FLIFLC_H
-#ifdef __cplusplus
+#if defined(__cplusplus) && !defined(SOL_FLIFLC_NO_EXTERN_C)
 extern "C" {
 #endif
 
@@ -45,21 +65,42 @@ typedef struct FLIDATA
     int    mLooped;      // changes to 1 if we're looped.
     unsigned char * mNextframe;   // Pointer to next frame in flicdata
     unsigned char * mLoopframe;   // Pointer to loop frame in flicdata
+    void * mFile;        // FILE * when streaming, 0 otherwise
+    int    mBufsize;     // size of mFlicdata when streaming
+    long   mFirstframe;  // file offset of first frame when streaming
+    long * mFrameofs;    // position of each frame, mIndexed entries valid
+    int    mIndexed;     // number of frames whose position is known
+    unsigned char ** mSnapshot; // framebuffer + palette before every FLI_SNAPSHOT_INTERVAL'th frame, 0 unless fli_snapshots()
 } FLI;
 
 // Opens a FLI or FLC file, and loads it to memory.
 extern FLI * fli_open(char * aFilename);
 
+// Opens a FLI or FLC file for streaming; frames are read one at a time.
+extern FLI * fli_open_stream(char * aFilename);
+
 // Deallocates all data behind aFlidata
 extern void fli_free(FLI * aFlidata);
 
 // Renders one frame.
 extern void fli_render(FLI * flidata);
 
+// Positions so that the next fli_render() renders frame aFrame.
+// Returns 0 if aFrame is out of range.
+extern int fli_seek(FLI * aFli, int aFrame);
+
+// Saves a snapshot every FLI_SNAPSHOT_INTERVAL frames from here on, for
+// cheap backward seeks. Each one takes mXSize * mYSize + 768 bytes.
+extern void fli_snapshots(FLI * aFli);
+
 #ifdef SOL_FLIFLC_IMPLEMENTATION
 
 #include <string.h>
 
+#ifndef FLI_SNAPSHOT_INTERVAL
+#define FLI_SNAPSHOT_INTERVAL 16
+#endif
+
 // FLI header
 typedef struct FLIHEADER_ 
 { 
@@ -81,7 +122,7 @@ typedef struct FLIHEADER_
     char      mReserved2[38];
     int       mOframe1; // offset to frame 1 
     int       mOframe2; // offset to frame 2 - for looping, jump here
-    char      mReserved3[42];
+    char      mReserved3[40];
 } FLIHEADER;
 
 // Frame header
@@ -117,7 +158,7 @@ void ifli_copy(FLI * aFli, unsigned char *aData)
     memcpy(aFli->mFramebuffer, aData, aFli->mXSize * aFli->mYSize);
 }
 
-// 64 - level palette chunk
+// 64 - level palette chunk. Every byte is scaled, so no memcpy path.
 void ifli_color(FLI * aFli, unsigned char *aData) 
 {
     short int *pktaddress;
@@ -144,7 +185,7 @@ void ifli_color(FLI * aFli, unsigned char *aData)
         else 
         {
             for (a = 0; a < set * 3; a++)
-                *(aFli->mPalette + skip * 3 + a) = *(aData + a);
+                *(aFli->mPalette + skip * 3 + a) = *(aData + a) * 4;
             aFli->mPaletteChange = 1;
             aData += set * 3;
         }
@@ -159,7 +200,9 @@ void ifli_colour256(FLI * aFli, unsigned char *aData)
     int set;
     short int numberpk;
     short int packetcount;
+#ifdef SOL_FLIFLC_SCALAR
     int a;
+#endif
     pktaddress = (short int *)aData;
     aData += 2;
     numberpk = *pktaddress;
@@ -171,14 +214,22 @@ void ifli_colour256(FLI * aFli, unsigned char *aData)
         aData++;
         if (set == 0) 
         {
+#ifdef SOL_FLIFLC_SCALAR
             for (a = 0; a < 768; a++)
                 *(aFli->mPalette + a) = *(aData + a);
+#else
+            memcpy(aFli->mPalette, aData, 768);
+#endif
             aFli->mPaletteChange = 1;
         } 
         else 
         {
+#ifdef SOL_FLIFLC_SCALAR
             for (a = 0; a < (set*3); a++)
                 *(aFli->mPalette + a + skip * 3) = *(aData + a);
+#else
+            memcpy(aFli->mPalette + skip * 3, aData, set * 3);
+#endif
             aFli->mPaletteChange = 1;
             aData += (set * 3);
         }
@@ -192,8 +243,11 @@ void ifli_rc(FLI *aFli, unsigned char *aData)
     short int numlines;
     unsigned char *vbuffptr;
     short int linecount;
-    unsigned char pktcount, skip, numpkt, sizecount, databyte;
-    signed char size;
+    unsigned char pktcount, skip, numpkt, databyte;
+#ifdef SOL_FLIFLC_SCALAR
+    unsigned char sizecount;
+#endif
+    int size;
     unsigned char *linestart;
     vbuffptr = aFli->mFramebuffer;
     addlines = (short int *)aData;
@@ -217,21 +271,32 @@ void ifli_rc(FLI *aFli, unsigned char *aData)
             aData++;
             if (size >= 0) 
             {
+#ifdef SOL_FLIFLC_SCALAR
                 for (sizecount = 0; sizecount < size; sizecount++) 
                 {
                     *vbuffptr = *aData;
                     vbuffptr++;
                     aData++;
                 }
+#else
+                memcpy(vbuffptr, aData, size);
+                vbuffptr += size;
+                aData += size;
+#endif
             } else {
                 size = -size;
                 databyte = *aData;
                 aData++;
+#ifdef SOL_FLIFLC_SCALAR
                 for (sizecount = 0; sizecount < size; sizecount++)
                 {
                     *vbuffptr = databyte;
                     vbuffptr++;
                 }
+#else
+                memset(vbuffptr, databyte, size);
+                vbuffptr += size;
+#endif
             }
         }
         linestart += aFli->mXSize;
@@ -244,11 +309,16 @@ void ifli_ss2(FLI *aFli, unsigned char *aData)
     short int numlines;
     unsigned char *vbuffptr;
     short int linecount;
-    char skip;
-    int pktcount, sizecount, databyte;
+    unsigned char skip;
+    int pktcount, sizecount;
     short int numpkt;
-    signed char size;
+    int size;
     unsigned char *linestart;
+#ifdef SOL_FLIFLC_SCALAR
+    int databyte;
+#else
+    unsigned short int pair;
+#endif
     vbuffptr = aFli->mFramebuffer;
     numlines = *(short int *)aData;
     aData += 2;
@@ -271,10 +341,11 @@ void ifli_ss2(FLI *aFli, unsigned char *aData)
                 skip = *aData;
                 aData++;
                 vbuffptr += skip;
-                size = *aData;
+                size = (signed char)*aData;
                 aData++;
                 if (size >= 0)
                 {
+#ifdef SOL_FLIFLC_SCALAR
                     for (sizecount = 0; sizecount < size; sizecount++)
                     {
                         *vbuffptr = *aData;
@@ -284,10 +355,16 @@ void ifli_ss2(FLI *aFli, unsigned char *aData)
                         vbuffptr++;
                         aData++;
                     }
+#else
+                    memcpy(vbuffptr, aData, size * 2);
+                    vbuffptr += size * 2;
+                    aData += size * 2;
+#endif
                 } 
                 else 
                 {
                     size = -size;
+#ifdef SOL_FLIFLC_SCALAR
                     databyte = *aData;
                     aData++;
                     for (sizecount = 0; sizecount < size; sizecount++)
@@ -298,6 +375,14 @@ void ifli_ss2(FLI *aFli, unsigned char *aData)
                         vbuffptr++;
                     }
                     aData++;
+#else
+                    // store the pixel pair a word at a time
+                    memcpy(&pair, aData, 2);
+                    aData += 2;
+                    for (sizecount = 0; sizecount < size; sizecount++)
+                        memcpy(vbuffptr + sizecount * 2, &pair, 2);
+                    vbuffptr += size * 2;
+#endif
                 }
             }
         }
@@ -310,8 +395,11 @@ void ifli_brun(FLI * aFli, unsigned char* aData)
 {
     short int numlines;
     unsigned char *vbuffptr;
-    unsigned char pktcount, numpkt, sizecount;
-    signed char size;
+    unsigned char pktcount, numpkt;
+#ifdef SOL_FLIFLC_SCALAR
+    unsigned char sizecount;
+#endif
+    int size;
     vbuffptr = aFli->mFramebuffer;
     
     for (numlines = 0; numlines < aFli->mYSize; numlines++)
@@ -324,20 +412,31 @@ void ifli_brun(FLI * aFli, unsigned char* aData)
             aData++;
             if (size >= 0)
             {
+#ifdef SOL_FLIFLC_SCALAR
                 for (sizecount = 0; sizecount < size; sizecount++) 
                 {
                     *vbuffptr = *aData;
                     vbuffptr++;
                 }
+#else
+                memset(vbuffptr, *aData, size);
+                vbuffptr += size;
+#endif
                 aData++;
             } else {
                 size = -size;
+#ifdef SOL_FLIFLC_SCALAR
                 for (sizecount = 0; sizecount < size; sizecount++)
                 {
                     *vbuffptr = *aData;
                     vbuffptr++;
                     aData++;
                 }
+#else
+                memcpy(vbuffptr, aData, size);
+                vbuffptr += size;
+                aData += size;
+#endif
             }
         }
     }
@@ -410,6 +509,30 @@ unsigned char *ifli_frame(FLI * aFli)
 **  FLI/FLC decoder functions. Part 3: "high level" functions          **
 *************************************************************************/
 
+// Allocates the player state for a validated header
+FLI * ifli_alloc(FLIHEADER * aHeader)
+{
+    FLIDATA * fli;
+    fli = (FLIDATA *)malloc(sizeof(FLIDATA));
+    fli->mFramebuffer = (unsigned char*)malloc(aHeader->mWidth * aHeader->mHeight);
+    fli->mXSize = aHeader->mWidth;
+    fli->mYSize = aHeader->mHeight;
+    fli->mPalette = (unsigned char*)malloc(768);
+    fli->mPaletteChange = 0;
+    fli->mFrame = 0;
+    fli->mLooped = 0;
+    fli->mMaxframe = aHeader->mFliFrames;
+    fli->mFile = 0;
+    fli->mBufsize = 0;
+    fli->mFirstframe = 0;
+    fli->mFrameofs = (long *)malloc(sizeof(long) * (fli->mMaxframe + 1));
+    fli->mIndexed = 0;
+    fli->mSnapshot = 0;
+    memset(fli->mFramebuffer, 0, aHeader->mWidth * aHeader->mHeight);
+    memset(fli->mPalette, 0, 768);
+    return fli;
+}
+
 FLI * fli_open(char * filename)
 {
     FILE * f;
@@ -420,32 +543,125 @@ FLI * fli_open(char * filename)
     {
         return 0;
     }
-    fli = (FLIDATA *)malloc(sizeof(FLIDATA));
     fread(&header, 1, sizeof(header), f);
-    if (header.mFliMagic != 0xAF12)
+    // 0xAF11 = FLI, 0xAF12 = FLC
+    if ((unsigned short)header.mFliMagic != 0xAF11 && (unsigned short)header.mFliMagic != 0xAF12)
     {
         fclose(f);
         return 0;
     }
-    fli->mFramebuffer = (unsigned char*)malloc(header.mWidth * header.mHeight);
-    fli->mXSize = header.mWidth;
-    fli->mYSize = header.mHeight;
-    fli->mPalette = (unsigned char*)malloc(768);
-    fli->mPaletteChange = 0;
-    fli->mFrame = 0;
-    fli->mLooped = 0;
-    fli->mMaxframe = header.mFliFrames;
+    fli = ifli_alloc(&header);
     fli->mFlicdata = (unsigned char *)malloc(header.mFliSize - sizeof(header));
     fread(fli->mFlicdata, 1, header.mFliSize - sizeof(header), f);
     fli->mNextframe = fli->mFlicdata;
     fli->mLoopframe = fli->mNextframe;
     fclose(f);
-    memset(fli->mFramebuffer, 0, header.mWidth * header.mHeight);
     return fli;
 }
 
+FLI * fli_open_stream(char * filename)
+{
+    FILE * f;
+    FLIHEADER header;
+    FLIDATA * fli;
+    f = fopen(filename, "rb");
+    if (f == 0) 
+    {
+        return 0;
+    }
+    if (fread(&header, 1, sizeof(header), f) != sizeof(header) ||
+        ((unsigned short)header.mFliMagic != 0xAF11 && (unsigned short)header.mFliMagic != 0xAF12))
+    {
+        fclose(f);
+        return 0;
+    }
+    fli = ifli_alloc(&header);
+    // frame buffer grows to the largest frame seen so far
+    fli->mBufsize = sizeof(FLIFRAMEHEADER);
+    fli->mFlicdata = (unsigned char *)malloc(fli->mBufsize);
+    fli->mNextframe = fli->mFlicdata;
+    fli->mLoopframe = fli->mNextframe;
+    fli->mFile = f;
+    fli->mFirstframe = sizeof(header);
+    return fli;
+}
+
+// Reads the next frame from disk to mFlicdata
+void ifli_readframe(FLI * aFli)
+{
+    FILE * f;
+    FLIFRAMEHEADER * frame;
+    int size, got;
+    f = (FILE *)aFli->mFile;
+    frame = (FLIFRAMEHEADER *)aFli->mFlicdata;
+    if (fread(frame, 1, sizeof(FLIFRAMEHEADER), f) != sizeof(FLIFRAMEHEADER))
+    {
+        // truncated file; render nothing
+        memset(frame, 0, sizeof(FLIFRAMEHEADER));
+        frame->mFramesize = sizeof(FLIFRAMEHEADER);
+        aFli->mNextframe = aFli->mFlicdata;
+        return;
+    }
+    size = frame->mFramesize;
+    if (size < (int)sizeof(FLIFRAMEHEADER))
+        size = frame->mFramesize = sizeof(FLIFRAMEHEADER);
+    if (size > aFli->mBufsize)
+    {
+        aFli->mFlicdata = (unsigned char *)realloc(aFli->mFlicdata, size);
+        aFli->mBufsize = size;
+    }
+    got = (int)fread(aFli->mFlicdata + sizeof(FLIFRAMEHEADER), 1, size - sizeof(FLIFRAMEHEADER), f);
+    if (got < size - (int)sizeof(FLIFRAMEHEADER))
+        memset(aFli->mFlicdata + sizeof(FLIFRAMEHEADER) + got, 0, size - sizeof(FLIFRAMEHEADER) - got);
+    aFli->mNextframe = aFli->mFlicdata;
+}
+
+// Position of the next frame: file offset when streaming, else offset in mFlicdata
+long ifli_tell(FLI * aFli)
+{
+    if (aFli->mFile)
+        return ftell((FILE *)aFli->mFile);
+    return (long)(aFli->mNextframe - aFli->mFlicdata);
+}
+
+void ifli_setpos(FLI * aFli, long aPos)
+{
+    if (aFli->mFile)
+        fseek((FILE *)aFli->mFile, aPos, SEEK_SET);
+    else
+        aFli->mNextframe = aFli->mFlicdata + aPos;
+}
+
+// Indexes the frame about to be rendered, if it's the first time we get here
+void ifli_mark(FLI * aFli)
+{
+    int size;
+    unsigned char *snap;
+    if (aFli->mFrame != aFli->mIndexed)
+        return;
+    aFli->mFrameofs[aFli->mFrame] = ifli_tell(aFli);
+    // frame 0 starts from the blank picture ifli_alloc made, no need to keep it
+    if (aFli->mSnapshot && aFli->mFrame && aFli->mFrame % FLI_SNAPSHOT_INTERVAL == 0)
+    {
+        size = aFli->mXSize * aFli->mYSize;
+        snap = (unsigned char *)malloc(size + 768);
+        memcpy(snap, aFli->mFramebuffer, size);
+        memcpy(snap + size, aFli->mPalette, 768);
+        aFli->mSnapshot[aFli->mFrame / FLI_SNAPSHOT_INTERVAL] = snap;
+    }
+    aFli->mIndexed++;
+}
+
 void fli_free(FLI * aFli)
 {
+  int i;
+  if (aFli->mSnapshot)
+    for (i = 0; i <= aFli->mMaxframe / FLI_SNAPSHOT_INTERVAL; i++)
+      free(aFli->mSnapshot[i]);
+  free(aFli->mSnapshot);
+  free(aFli->mFrameofs);
+  if (aFli->mFile)
+    fclose((FILE *)aFli->mFile);
   free(aFli->mFlicdata);
   free(aFli->mPalette);
   free(aFli->mFramebuffer);
@@ -454,18 +670,71 @@ void fli_free(FLI * aFli)
 
 void fli_render(FLI * aFli)
 {
+    ifli_mark(aFli);
+    if (aFli->mFile)
+        ifli_readframe(aFli);
     aFli->mNextframe = ifli_frame(aFli);
     aFli->mFrame++;
     if (aFli->mFrame == aFli->mMaxframe)
     {
         aFli->mFrame = 0;
         aFli->mNextframe = aFli->mLoopframe;
+        if (aFli->mFile)
+            fseek((FILE *)aFli->mFile, aFli->mFirstframe, SEEK_SET);
         aFli->mLooped = 1;
     }
 }
 
+int fli_seek(FLI * aFli, int aFrame)
+{
+    int snap, size;
+    if (aFrame < 0 || aFrame >= aFli->mMaxframe)
+        return 0;
+    if (aFli->mIndexed)
+    {
+        // nearest snapshot we have at or before aFrame; frame 0 is
+        // always there, as the blank picture. Snapshots only start
+        // where fli_snapshots() was called.
+        snap = aFrame;
+        if (snap > aFli->mIndexed - 1)
+            snap = aFli->mIndexed - 1;
+        snap -= snap % FLI_SNAPSHOT_INTERVAL;
+        if (!aFli->mSnapshot)
+            snap = 0;
+        while (snap && !aFli->mSnapshot[snap / FLI_SNAPSHOT_INTERVAL])
+            snap -= FLI_SNAPSHOT_INTERVAL;
+        // going forward from where we are is cheaper if we're past the snapshot
+        if (aFli->mFrame > aFrame || aFli->mFrame < snap)
+        {
+            size = aFli->mXSize * aFli->mYSize;
+            if (snap)
+            {
+                memcpy(aFli->mFramebuffer, aFli->mSnapshot[snap / FLI_SNAPSHOT_INTERVAL], size);
+                memcpy(aFli->mPalette, aFli->mSnapshot[snap / FLI_SNAPSHOT_INTERVAL] + size, 768);
+            }
+            else
+            {
+                memset(aFli->mFramebuffer, 0, size);
+                memset(aFli->mPalette, 0, 768);
+            }
+            ifli_setpos(aFli, aFli->mFrameofs[snap]);
+            aFli->mFrame = snap;
+            aFli->mPaletteChange = 1;
+        }
+    }
+    while (aFli->mFrame < aFrame)
+        fli_render(aFli);
+    return 1;
+}
+
+void fli_snapshots(FLI * aFli)
+{
+    if (!aFli->mSnapshot)
+        aFli->mSnapshot = (unsigned char **)calloc(aFli->mMaxframe / FLI_SNAPSHOT_INTERVAL + 1, sizeof(unsigned char *));
+}
+
 #endif // SOL_FLIFLC_IMPLEMENTATION
-#ifdef __cplusplus
+#if defined(__cplusplus) && !defined(SOL_FLIFLC_NO_EXTERN_C)
 }
 #endif // __cplusplus
 #endif // SOL_FLIFLC_H
@@ -41,6 +41,25 @@ Usage example (converting 32bpp RGBX image to paletted image):
 	free(idxmap);
 	free(palette);
 
+Usage example (arena, reusing one SQ for several images):
+
+	SQ *q;
+	q = sq_alloc_arena(0);
+	for (each image)
+	{
+		sq_addcolormap(q, data, x * y, 4);
+		sq_reduce(q, &idxmap, &palette, NULL, 256);
+		...
+		free(idxmap);
+		free(palette);
+	}
+	sq_free(q);
+
+	With an arena, color nodes and all temporaries of sq_reduce come
+	out of one block that's rewound instead of freed piece by piece,
+	and sq_reduce leaves q ready for the next image instead of freeing it.
+	idxmap and palette are still malloc'd and owned by the caller.
+
 	*/
 
 #ifndef SOL_QMEDIAN_H
@@ -55,6 +74,7 @@ extern "C" {
 
 struct sqi_colorstruc;
 struct sqi_colormapstruc;
+struct sqi_arenachunk;
 
 typedef struct sq_quantstruc 
 {
@@ -66,11 +86,30 @@ typedef struct sq_quantstruc
 	struct sqi_colormapstruc* mLastcolmap;
 	int mColors;
 	int mZeros;
+	struct sqi_arenachunk* mArena; // NULL if not using an arena
 } SQ;
 
 /* Use sq_alloc to allocate a new quantize base. */
 extern SQ* sq_alloc();
 
+/* Allocate a quantize base that takes all its memory from an arena.
+ * aBytes is the initial arena size, 0 for a default; the arena grows
+ * if needed. About 16 bytes per added color plus a few kilobytes is
+ * enough to never grow. sq_reduce doesn't free an arena based base,
+ * it resets it; call sq_free when done.
+ */
+extern SQ* sq_alloc_arena(int aBytes);
+
+/* Forget all added colormaps so the base can be reused. With an arena
+ * this is O(1) and keeps the arena memory for the next round.
+ */
+extern void sq_reset(SQ *q);
+
+/* Free a quantize base that wasn't consumed by sq_reduce (arena based
+ * bases, or ones you decided not to reduce after all).
+ */
+extern void sq_free(SQ *q);
+
 /* Add colormaps with qaddcolormap. Stride, typically 3 or 4,
  * states how many bytes per each color. If stride is 4, the
  * 4th byte is ignored.
@@ -89,6 +128,18 @@ extern int sq_addcolormap(SQ *q, unsigned char *aColmap, int aColors, int aStrid
  */
 extern int sq_reduce(SQ* q, SQ_IDXMAPTYPE** aIdxmap, unsigned char** aPal, int* aOutcolorCount, int aPalwid);
 
+/* Reduce a color histogram to palwid colors. aColors has aEntries
+ * colors, aStride bytes each (r,g,b first), and aCounts the number of
+ * pixels of each color; the median cut is weighted by the counts.
+ * Memory and time depend on aEntries only, not on the image size.
+ * Entries should be unique colors. Giving every entry a count of 1
+ * gives the same result as sq_reduce on the same colors.
+ * idxmap gets one index per histogram entry:
+ * *(idxmap + entry) == new_color;
+ * Returns the number of colors in the palette.
+ */
+extern int sq_reduce_histogram(unsigned char* aColors, int* aCounts, int aEntries, int aStride, SQ_IDXMAPTYPE** aIdxmap, unsigned char** aPal, int aPalwid);
+
 #ifdef SOL_QMEDIAN_IMPLEMENTATION
 
 #include <stdlib.h> // exit, malloc, free
@@ -98,6 +149,10 @@ extern int sq_reduce(SQ* q, SQ_IDXMAPTYPE** aIdxmap, unsigned char** aPal, int*
 #define SQI_RE_SORT
 // kill duplicates
 #define SQI_DUPENUKE
+// cut with the old linked list sort instead of counting sorts on an array
+//#define SQI_LIST_SORT
+// kill duplicates by sorting the whole list instead of with a hash table
+//#define SQI_SORT_DUPENUKE
 
 #define SQI_SWAP(a, b, c) { c = a; a = b; b = c; }
 
@@ -137,6 +192,85 @@ void* sqi_calloc(int aSize)
 	return temp;
 }
 
+/*
+ * local malloc
+ * - Same as sqi_calloc, but for blocks that are completely overwritten
+ *   anyway, so no need to clear them.
+ */
+void* sqi_malloc(int aSize)
+{
+	void *temp;
+	temp = malloc(aSize);
+	if (temp == NULL)
+	{
+		exit(1);
+	}
+	return temp;
+}
+
+#define SQI_ARENA_DEFAULT (256 * 1024)
+#define SQI_ARENA_ALIGN 16
+
+struct sqi_arenachunk
+{
+	struct sqi_arenachunk *mNext;
+	int mSize;
+	int mUsed;
+};
+
+/*
+ * local arena_chunk
+ * - allocate a new arena chunk with room for aSize bytes
+ */
+struct sqi_arenachunk* sqi_arena_chunk(int aSize)
+{
+	struct sqi_arenachunk *chunk;
+	chunk = (struct sqi_arenachunk *)sqi_malloc(SQI_ARENA_ALIGN + aSize);
+	chunk->mNext = NULL;
+	chunk->mSize = aSize;
+	chunk->mUsed = 0;
+	return chunk;
+}
+
+/*
+ * local alloc
+ * - Get uncleared memory for q; from its arena if it has one.
+ *   q may be NULL for plain malloc.
+ *   Grow the arena with a new chunk if the current one is full.
+ */
+void* sqi_alloc(SQ *q, int aSize)
+{
+	struct sqi_arenachunk *chunk;
+	void *temp;
+	if (q == NULL || q->mArena == NULL)
+	{
+		return sqi_malloc(aSize);
+	}
+	aSize = (aSize + SQI_ARENA_ALIGN - 1) & ~(SQI_ARENA_ALIGN - 1);
+	chunk = q->mArena;
+	if (chunk->mUsed + aSize > chunk->mSize)
+	{
+		chunk = sqi_arena_chunk(aSize > q->mArena->mSize ? aSize : q->mArena->mSize);
+		chunk->mNext = q->mArena;
+		q->mArena = chunk;
+	}
+	temp = (unsigned char *)chunk + SQI_ARENA_ALIGN + chunk->mUsed;
+	chunk->mUsed += aSize;
+	return temp;
+}
+
+/*
+ * local free
+ * - counterpart of sqi_alloc; no-op for arena memory.
+ */
+void sqi_free(SQ *q, void *aPtr)
+{
+	if (q == NULL || q->mArena == NULL)
+	{
+		free(aPtr);
+	}
+}
+
 /*
  * public newquant
  * - initialize quantize structure
@@ -146,6 +280,18 @@ SQ *sq_alloc(void)
 	return (SQ *)sqi_calloc(sizeof(SQ));
 }
 
+/*
+ * public sq_alloc_arena
+ * - initialize quantize structure with an arena
+ */
+SQ *sq_alloc_arena(int aBytes)
+{
+	SQ *q;
+	q = (SQ *)sqi_calloc(sizeof(SQ));
+	q->mArena = sqi_arena_chunk(aBytes > 0 ? aBytes : SQI_ARENA_DEFAULT);
+	return q;
+}
+
 /*
  * local add_color
  * - add a color to the color list
@@ -180,8 +326,8 @@ int sq_addcolormap(SQ* q, unsigned char* aColmap, int aColors, int aStride)
 	int a, ret;
 	struct sqi_colormapstruc* temp;
 	ret = q->mColors;
-	temp = (struct sqi_colormapstruc*)sqi_calloc(sizeof(struct sqi_colormapstruc));
-	temp->mCol = (struct sqi_colorstruc*)sqi_calloc(sizeof(struct sqi_colorstruc) * aColors);
+	temp = (struct sqi_colormapstruc*)sqi_alloc(q, sizeof(struct sqi_colormapstruc));
+	temp->mCol = (struct sqi_colorstruc*)sqi_alloc(q, sizeof(struct sqi_colorstruc) * aColors);
 	temp->mNext = NULL;
 	if (q->mColmap == NULL)
 	{
@@ -210,9 +356,80 @@ void sqi_free_colmaps(SQ *q)
 	while (walker != NULL)
 	{
 		prev = walker;
-		free(walker->mCol);
+		sqi_free(q, walker->mCol);
 		walker = walker->mNext;
-		free(prev);
+		sqi_free(q, prev);
+	}
+}
+
+/*
+ * public sq_reset
+ * - drop all colormaps, keep q (and its arena) for reuse
+ */
+void sq_reset(SQ *q)
+{
+	struct sqi_arenachunk *chunk, *arena;
+	int total;
+	arena = q->mArena;
+	if (arena == NULL)
+	{
+		sqi_free_colmaps(q);
+	}
+	else if (arena->mNext != NULL)
+	{
+		// The arena had to grow; replace the chunks with one block that
+		// fits everything so the next round won't have to.
+		total = 0;
+		while (arena != NULL)
+		{
+			chunk = arena;
+			total += chunk->mSize;
+			arena = arena->mNext;
+			free(chunk);
+		}
+		arena = sqi_arena_chunk(total);
+	}
+	else
+	{
+		arena->mUsed = 0;
+	}
+	memset(q, 0, sizeof(SQ));
+	q->mArena = arena;
+}
+
+/*
+ * public sq_free
+ * - free q and everything allocated through it
+ */
+void sq_free(SQ *q)
+{
+	struct sqi_arenachunk *chunk;
+	if (q->mArena == NULL)
+	{
+		sqi_free_colmaps(q);
+	}
+	while (q->mArena != NULL)
+	{
+		chunk = q->mArena;
+		q->mArena = chunk->mNext;
+		free(chunk);
+	}
+	free(q);
+}
+
+/*
+ * local release
+ * - end of sq_reduce: plain bases are freed, arena bases are reset
+ */
+void sqi_release(SQ *q)
+{
+	if (q->mArena == NULL)
+	{
+		sq_free(q);
+	}
+	else
+	{
+		sq_reset(q);
 	}
 }
 
@@ -344,6 +561,7 @@ struct sqi_colorstruc* sqi_sort_group(struct sqi_colorstruc* aCol, int aComponen
 	return bucket[s];
 }
 
+#ifdef SQI_SORT_DUPENUKE
 /*
  * local dupenuke
  * - kill duplicate colors by first sorting the list by all components,
@@ -392,6 +610,354 @@ void sqi_dupenuke(SQ* q)
 	}
 }
 
+#else
+/*
+ * local dupenuke
+ * - kill duplicate colors in one pass with an open addressing hash table
+ *   keyed on the packed color, moving duplicates to the zero-list. The
+ *   remaining (unique) colors are then sorted by all components, which
+ *   leaves the list exactly as the sorting version does, for a fraction
+ *   of the work when there are many duplicates.
+ */
+void sqi_dupenuke(SQ* q) 
+{
+	struct sqi_colorstruc *col, *last, *next, *found;
+	struct sqi_colorstruc **table, **oldtable;
+	unsigned int key, mask, pos, oldsize, a;
+	int unique;
+	if (q->mFirst == NULL)
+	{
+		return;
+	}
+	// Grown as needed, kept at most half full
+	mask = 1023;
+	table = (struct sqi_colorstruc **)sqi_calloc(sizeof(struct sqi_colorstruc *) * (mask + 1));
+	unique = 0;
+	last = NULL;
+	col = q->mFirst;
+	while (col != NULL)
+	{
+		next = col->mNext;
+		key = col->mData.mBlock;
+		pos = (key * 0x9e3779b1u) >> 8;
+		while (1)
+		{
+			pos &= mask;
+			found = table[pos];
+			if (found == NULL || found->mData.mBlock == key)
+			{
+				break;
+			}
+			pos++;
+		}
+		if (found != NULL)
+		{
+			// duplicate
+			col->mData.mBlock = found->mColoridx; // set datablock to point to real color instead
+			last->mNext = next;                   // removed from the list
+			if (q->mZeromap == NULL) 
+			{
+				q->mZeromap = col;
+			}
+			else 
+			{
+				q->mZerolast->mNext = col;
+			}
+			q->mZerolast = col;
+			q->mZerolast->mNext = NULL;           // added to zero-list
+			q->mZeros++;
+		}
+		else
+		{
+			// not dupe
+			table[pos] = col;
+			last = col;
+			unique++;
+			if ((unsigned int)unique * 2 > mask)
+			{
+				oldtable = table;
+				oldsize = mask + 1;
+				mask = mask * 2 + 1;
+				table = (struct sqi_colorstruc **)sqi_calloc(sizeof(struct sqi_colorstruc *) * (mask + 1));
+				for (a = 0; a < oldsize; a++)
+				{
+					if (oldtable[a] != NULL)
+					{
+						pos = (oldtable[a]->mData.mBlock * 0x9e3779b1u) >> 8;
+						while (table[pos & mask] != NULL)
+						{
+							pos++;
+						}
+						table[pos & mask] = oldtable[a];
+					}
+				}
+				free(oldtable);
+			}
+		}
+		col = next;
+	}
+	free(table);
+	q->mLast = last;
+	// Same order the sorting version leaves the list in
+	q->mFirst = sqi_sort_group(q->mFirst, 0);
+	q->mFirst = sqi_sort_group(q->mFirst, 1);
+	q->mFirst = sqi_sort_group(q->mFirst, 2);
+}
+#endif
+
+/*
+ * Array path. The same median cut as the linked list code above, but on
+ * a flat array of colors with pixel counts, with groups as ranges of the
+ * array and stable counting sorts. Used by sq_reduce_histogram, and by
+ * sq_reduce unless SQI_LIST_SORT is defined.
+ */
+
+struct sqi_histentry
+{
+	union sqi_colorchunk mData;
+	int mCount;
+	int mIdx; // index to idxmap
+};
+
+/*
+ * local hist_sort
+ * - stable counting sort of aLen entries by given component
+ */
+void sqi_hist_sort(struct sqi_histentry *aEntry, struct sqi_histentry *aTemp, int aLen, int aComponent)
+{
+	int bucket[256];
+	int a, v, n;
+	memset(bucket, 0, sizeof(bucket));
+	for (a = 0; a < aLen; a++)
+	{
+		bucket[aEntry[a].mData.mComponent[aComponent]]++;
+	}
+	n = 0;
+	for (a = 0; a < 256; a++)
+	{
+		v = bucket[a];
+		bucket[a] = n;
+		n += v;
+	}
+	for (a = 0; a < aLen; a++)
+	{
+		aTemp[bucket[aEntry[a].mData.mComponent[aComponent]]++] = aEntry[a];
+	}
+	memcpy(aEntry, aTemp, sizeof(struct sqi_histentry) * aLen);
+}
+
+/*
+ * local hist_examine
+ * - Find out the largest component of a range and return it, its size
+ *   and its count-weighted sum.
+ */
+void sqi_hist_examine(struct sqi_histentry *aEntry, int aLen, int *aComponent, int *aSize, long long *aSum)
+{
+	int c, a, v, mn[3], mx[3];
+	long long sum[3];
+	for (c = 0; c < 3; c++)
+	{
+		mn[c] = mx[c] = aEntry[0].mData.mComponent[c];
+		sum[c] = 0;
+	}
+	for (a = 0; a < aLen; a++)
+	{
+		for (c = 0; c < 3; c++)
+		{
+			v = aEntry[a].mData.mComponent[c];
+			sum[c] += (long long)v * aEntry[a].mCount;
+			if (mn[c] > v) mn[c] = v;
+			if (mx[c] < v) mx[c] = v;
+		}
+	}
+	*aComponent = 0;
+	*aSize = mx[0] - mn[0];
+	*aSum = sum[0];
+	for (c = 1; c < 3; c++)
+	{
+		if ((mx[c] - mn[c]) > *aSize)
+		{
+			*aSize = mx[c] - mn[c];
+			*aComponent = c;
+			*aSum = sum[c];
+		}
+	}
+}
+
+/*
+ * local hist_cut
+ * - Find the median split point of a range, like sqi_cut_group.
+ *   Returns the length of the first half, or aLen if it can't be cut.
+ */
+int sqi_hist_cut(struct sqi_histentry *aEntry, int aLen, int aComponent, long long aMax)
+{
+	long long median, count;
+	int a;
+	median = aMax / 2;
+	count = 0;
+	a = 0;
+	while (count <= median && a < aLen)
+	{
+		count += (long long)aEntry[a].mData.mComponent[aComponent] * aEntry[a].mCount;
+		a++;
+	}
+	// the entry that went over the median starts the second half,
+	// unless it was the very first one
+	if (a > 1)
+	{
+		a--;
+	}
+	return a;
+}
+
+/*
+ * local array_reduce
+ * - quantize aEntries colors to aPalwid, writing idxmap through mIdx.
+ *   Sets *aReduced to 0 if there were few enough colors to use as-is.
+ *   returns number of colors in aPal.
+ */
+int sqi_array_reduce(SQ *q, struct sqi_histentry *aEntry, int aEntries, SQ_IDXMAPTYPE *aIdxmap, unsigned char *aPal, int aPalwid, int *aReduced)
+{
+	int i, n, a, groups, cut;
+	long long count, wsum[3];
+	struct sqi_histentry *temp;
+	int *groupstart, *grouplen, *groupcomponent, *groupcomponentsize, *groupsorted;
+	long long *groupcomponentsum;
+	temp = (struct sqi_histentry *)sqi_alloc(q, sizeof(struct sqi_histentry) * aEntries);
+	if (aEntries <= aPalwid)
+	{
+		/*
+		 * If number of input colors is less than requested output,
+		 * just sort the colors and so on. Don't do any real reducing, that is.
+		 */
+		sqi_hist_sort(aEntry, temp, aEntries, 0);
+		sqi_hist_sort(aEntry, temp, aEntries, 2);
+		sqi_hist_sort(aEntry, temp, aEntries, 1);
+		for (i = 0; i < aEntries; i++)
+		{
+			*(aIdxmap + aEntry[i].mIdx) = i;
+			*(aPal + i * 3 + 0) = aEntry[i].mData.mComponent[0];
+			*(aPal + i * 3 + 1) = aEntry[i].mData.mComponent[1];
+			*(aPal + i * 3 + 2) = aEntry[i].mData.mComponent[2];
+		}
+		sqi_free(q, temp);
+		*aReduced = 0;
+		return aEntries;
+	}
+
+	groupstart = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	grouplen = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	groupsorted = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	groupcomponent = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	groupcomponentsize = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	groupcomponentsum = (long long *)sqi_alloc(q, sizeof(long long) * aPalwid);
+
+	// Set up, analyze initial group (i.e, all incoming colors)
+	groups = 1;
+	groupstart[0] = 0;
+	grouplen[0] = aEntries;
+	sqi_hist_examine(aEntry, aEntries, &groupcomponent[0], &groupcomponentsize[0], &groupcomponentsum[0]);
+	groupsorted[0] = -1;
+	while (groups < aPalwid)
+	{
+		// Find largest group (in a dimension, not volume)
+		i = 0;
+		for (n = 0; n < groups; n++)
+		{
+			if (groupcomponentsize[n] > groupcomponentsize[i])
+			{
+				i = n;
+			}
+		}
+		// If the group was not sorted by its largest dimension, sort it
+		if (groupsorted[i] != groupcomponent[i])
+		{
+			sqi_hist_sort(aEntry + groupstart[i], temp, grouplen[i], groupcomponent[i]);
+			groupsorted[i] = groupcomponent[i];
+		}
+		// Cut the group in half at median point
+		cut = sqi_hist_cut(aEntry + groupstart[i], grouplen[i], groupcomponent[i], groupcomponentsum[i]);
+		// If we can't cut, we're done
+		if (cut >= grouplen[i])
+		{
+			break;
+		}
+		groupstart[groups] = groupstart[i] + cut;
+		grouplen[groups] = grouplen[i] - cut;
+		grouplen[i] = cut;
+		// Analyze, store, increment, continue.
+		sqi_hist_examine(aEntry + groupstart[i], grouplen[i], &groupcomponent[i], &groupcomponentsize[i], &groupcomponentsum[i]);
+		sqi_hist_examine(aEntry + groupstart[groups], grouplen[groups], &groupcomponent[groups], &groupcomponentsize[groups], &groupcomponentsum[groups]);
+		groupsorted[groups] = groupsorted[i];
+		groups++;
+	}
+
+	// Build palette
+	for (i = 0; i < groups; i++)
+	{
+		count = wsum[0] = wsum[1] = wsum[2] = 0;
+		// Map the group's colors and compute their weighted average
+		for (a = groupstart[i]; a < groupstart[i] + grouplen[i]; a++)
+		{
+			*(aIdxmap + aEntry[a].mIdx) = i;
+			count += aEntry[a].mCount;
+			wsum[0] += (long long)aEntry[a].mData.mComponent[0] * aEntry[a].mCount;
+			wsum[1] += (long long)aEntry[a].mData.mComponent[1] * aEntry[a].mCount;
+			wsum[2] += (long long)aEntry[a].mData.mComponent[2] * aEntry[a].mCount;
+		}
+		if (groupcomponentsize[i] > 1 && count > 0)
+		{
+			// Average the colors in the group
+			*(aPal + i * 3 + 0) = (unsigned char)((wsum[0] + count / 2) / count);
+			*(aPal + i * 3 + 1) = (unsigned char)((wsum[1] + count / 2) / count);
+			*(aPal + i * 3 + 2) = (unsigned char)((wsum[2] + count / 2) / count);
+		}
+		else
+		{
+			// in case the group is small, averaging may lead into
+			// duplicate colors in tiny color spaces; using one
+			// of the original colors is "good enough"
+			*(aPal + i * 3 + 0) = aEntry[groupstart[i]].mData.mComponent[0];
+			*(aPal + i * 3 + 1) = aEntry[groupstart[i]].mData.mComponent[1];
+			*(aPal + i * 3 + 2) = aEntry[groupstart[i]].mData.mComponent[2];
+		}
+	}
+	sqi_free(q, groupstart);
+	sqi_free(q, grouplen);
+	sqi_free(q, groupsorted);
+	sqi_free(q, groupcomponent);
+	sqi_free(q, groupcomponentsize);
+	sqi_free(q, groupcomponentsum);
+	sqi_free(q, temp);
+	*aReduced = 1;
+	return aPalwid;
+}
+
+#ifdef SQI_RE_SORT
+/*
+ * local re_sort
+ * - sort the final palette by quantizing it again, remap idxmap to match.
+ */
+int sqi_re_sort(SQ_IDXMAPTYPE *aIdxmap, int aIndices, unsigned char **aPal, int aPalwid)
+{
+	int i;
+	SQ_IDXMAPTYPE* remapmap;
+	unsigned char* temppal, * tempcp;
+	SQ* reorder;
+	reorder = sq_alloc();
+	sq_addcolormap(reorder, *aPal, aPalwid, 3);
+	aPalwid = sq_reduce(reorder, &remapmap, &temppal, NULL, aPalwid);
+	SQI_SWAP(*aPal, temppal, tempcp);
+	free(temppal);
+	for (i = 0; i < aIndices; i++)
+	{
+		*(aIdxmap + i) = *(remapmap + *(aIdxmap + i));
+	}
+	free(remapmap);
+	return aPalwid;
+}
+#endif
+
 /*
  * public sq_reduce
  * - do the quantize, build index map, free all allocated resources.
@@ -399,33 +965,66 @@ void sqi_dupenuke(SQ* q)
  */
 int sq_reduce(SQ *q, SQ_IDXMAPTYPE**aIdxmap, unsigned char **aPal, int *aOutindices, int aPalwid)
 {
-	int i, n, totalcolors, comp[3], count, groups;
+	int i, n, totalcolors;
 	struct sqi_colorstruc* col;
+#ifdef SQI_LIST_SORT
+	int comp[3], count, groups;
 	struct sqi_colorstruc** group;
 	int *groupcomponent, *groupcomponentsize, *groupcomponentsum, *groupsorted;
-#ifdef SQI_RE_SORT
-	SQ_IDXMAPTYPE* remapmap;
-	unsigned char* temppal, * tempcp;
-	SQ* reorder;
+#else
+	struct sqi_histentry *entry;
+	int reduced;
 #endif
 	totalcolors = q->mColors;
+	// Every input color ends up in idxmap and the group arrays are only
+	// read up to the number of groups made, so only the palette (which
+	// may not be filled completely) needs clearing.
 	*aPal = (unsigned char *)sqi_calloc(sizeof(unsigned char) * aPalwid * 3);
-	*aIdxmap = (SQ_IDXMAPTYPE *)sqi_calloc(sizeof(SQ_IDXMAPTYPE) * totalcolors);
-	group = (struct sqi_colorstruc **)sqi_calloc(sizeof(struct sqi_colorstruc*) * aPalwid);
-	groupsorted = (int *)sqi_calloc(sizeof(int) * aPalwid);
-	groupcomponent = (int *)sqi_calloc(sizeof(int) * aPalwid);
-	groupcomponentsize = (int *)sqi_calloc(sizeof(int) * aPalwid);
-	groupcomponentsum = (int *)sqi_calloc(sizeof(int) * aPalwid);
+	*aIdxmap = (SQ_IDXMAPTYPE *)sqi_malloc(sizeof(SQ_IDXMAPTYPE) * totalcolors);
 #ifdef SQI_DUPENUKE
 	sqi_dupenuke(q);
 #endif
+	if (aOutindices)
+	{
+		*aOutindices = totalcolors;
+	}
+#ifndef SQI_LIST_SORT
+	// Copy the (unique) colors to an array in list order and cut that
+	n = q->mColors - q->mZeros;
+	entry = (struct sqi_histentry *)sqi_alloc(q, sizeof(struct sqi_histentry) * n);
+	col = q->mFirst;
+	for (i = 0; i < n; i++)
+	{
+		entry[i].mData = col->mData;
+		entry[i].mCount = 1;
+		entry[i].mIdx = col->mColoridx;
+		col = col->mNext;
+	}
+	aPalwid = sqi_array_reduce(q, entry, n, *aIdxmap, *aPal, aPalwid, &reduced);
+	sqi_free(q, entry);
+	col = q->mZeromap;
+	while (col != NULL) 
+	{
+		*(*aIdxmap + col->mColoridx) = *(*aIdxmap + col->mData.mBlock);
+		col = col->mNext;
+	}
+	sqi_release(q);
+#ifdef SQI_RE_SORT
+	if (reduced)
+	{
+		aPalwid = sqi_re_sort(*aIdxmap, totalcolors, aPal, aPalwid);
+	}
+#endif
+	return aPalwid; // Number of colors in palette
+#else
+	group = (struct sqi_colorstruc **)sqi_alloc(q, sizeof(struct sqi_colorstruc*) * aPalwid);
+	groupsorted = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	groupcomponent = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	groupcomponentsize = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
+	groupcomponentsum = (int *)sqi_alloc(q, sizeof(int) * aPalwid);
 	if ((q->mColors - q->mZeros) <= aPalwid) 
 	{
 		aPalwid = q->mColors - q->mZeros;
-		if (aOutindices)
-		{
-			*aOutindices = totalcolors;
-		}
 		/*
 		 * If number of input colors is less than requested output,
 		 * just sort the colors and so on. Don't do any real reducing, that is.
@@ -450,13 +1049,12 @@ int sq_reduce(SQ *q, SQ_IDXMAPTYPE**aIdxmap, unsigned char **aPal, int *aOutindi
 			*(*aIdxmap + col->mColoridx) = *(*aIdxmap + col->mData.mBlock);
 			col = col->mNext;
 		}
-		free(group);
-		free(groupsorted);
-		free(groupcomponent);
-		free(groupcomponentsize);
-		free(groupcomponentsum);
-		sqi_free_colmaps(q);
-		free(q);
+		sqi_free(q, group);
+		sqi_free(q, groupsorted);
+		sqi_free(q, groupcomponent);
+		sqi_free(q, groupcomponentsize);
+		sqi_free(q, groupcomponentsum);
+		sqi_release(q);
 		return aPalwid;
 	}
 	// Set up, analyze initial group (i.e, all incoming colors)
@@ -499,11 +1097,11 @@ int sq_reduce(SQ *q, SQ_IDXMAPTYPE**aIdxmap, unsigned char **aPal, int *aOutindi
 	for (i = 0; i < groups; i++)
 	{
 		col = group[i];
-		*(*aIdxmap + col->mColoridx) = i;
 		count = comp[0] = comp[1] = comp[2] = 0;
-		// Compute the average color for the group
+		// Map the group's colors and compute their average
 		while (col != NULL)
 		{
+			*(*aIdxmap + col->mColoridx) = i;
 			count++;
 			comp[0] += col->mData.mComponent[0];
 			comp[1] += col->mData.mComponent[1];
@@ -533,29 +1131,58 @@ int sq_reduce(SQ *q, SQ_IDXMAPTYPE**aIdxmap, unsigned char **aPal, int *aOutindi
 		*(*aIdxmap + col->mColoridx) = *(*aIdxmap + col->mData.mBlock);
 		col = col->mNext;
 	}
-	free(group);
-	free(groupsorted);
-	free(groupcomponent);
-	free(groupcomponentsize);
-	free(groupcomponentsum);
-	if (aOutindices)
+	sqi_free(q, group);
+	sqi_free(q, groupsorted);
+	sqi_free(q, groupcomponent);
+	sqi_free(q, groupcomponentsize);
+	sqi_free(q, groupcomponentsum);
+	sqi_release(q);
+#ifdef SQI_RE_SORT
+	aPalwid = sqi_re_sort(*aIdxmap, totalcolors, aPal, aPalwid);
+#endif /* RE_SORT */
+	return aPalwid; // Number of colors in palette
+#endif /* SQI_LIST_SORT */
+}
+
+/*
+ * public sq_reduce_histogram
+ * - quantize a histogram, build index map (one per entry).
+ *   returns total number of colors in the palette.
+ */
+int sq_reduce_histogram(unsigned char *aColors, int *aCounts, int aEntries, int aStride, SQ_IDXMAPTYPE **aIdxmap, unsigned char **aPal, int aPalwid)
+{
+	int a, reduced;
+	struct sqi_histentry *entry, *temp;
+	*aPal = (unsigned char *)sqi_calloc(sizeof(unsigned char) * aPalwid * 3);
+	*aIdxmap = (SQ_IDXMAPTYPE *)sqi_malloc(sizeof(SQ_IDXMAPTYPE) * (aEntries > 0 ? aEntries : 1));
+	if (aEntries <= 0)
 	{
-		*aOutindices = totalcolors;
+		return 0;
 	}
-	sqi_free_colmaps(q);
-	free(q);
+	entry = (struct sqi_histentry *)sqi_malloc(sizeof(struct sqi_histentry) * aEntries);
+	temp = (struct sqi_histentry *)sqi_malloc(sizeof(struct sqi_histentry) * aEntries);
+	for (a = 0; a < aEntries; a++)
+	{
+		entry[a].mData.mComponent[0] = *(aColors + a * aStride + 0);
+		entry[a].mData.mComponent[1] = *(aColors + a * aStride + 1);
+		entry[a].mData.mComponent[2] = *(aColors + a * aStride + 2);
+		entry[a].mData.mComponent[3] = 0;
+		entry[a].mCount = aCounts[a];
+		entry[a].mIdx = a;
+	}
+	// Same starting order sq_reduce has after sqi_dupenuke
+	sqi_hist_sort(entry, temp, aEntries, 0);
+	sqi_hist_sort(entry, temp, aEntries, 1);
+	sqi_hist_sort(entry, temp, aEntries, 2);
+	free(temp);
+	aPalwid = sqi_array_reduce(NULL, entry, aEntries, *aIdxmap, *aPal, aPalwid, &reduced);
+	free(entry);
 #ifdef SQI_RE_SORT
-	reorder = sq_alloc();
-	sq_addcolormap(reorder, *aPal, aPalwid, 3);
-	aPalwid = sq_reduce(reorder, &remapmap, &temppal, NULL, aPalwid);
-	SQI_SWAP(*aPal, temppal, tempcp);
-	free(temppal);
-	for (i = 0; i < totalcolors; i++)
+	if (reduced)
 	{
-		*(*aIdxmap + i) = *(remapmap + *(*aIdxmap + i));
+		aPalwid = sqi_re_sort(*aIdxmap, aEntries, aPal, aPalwid);
 	}
-	free(remapmap);
-#endif /* RE_SORT */
+#endif
 	return aPalwid; // Number of colors in palette
 }
 
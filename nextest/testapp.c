@@ -29,6 +29,7 @@ extern void di();
 extern void ei();
 extern void memcpy(char *dest, const char *source, unsigned short count);
 
+// 128x96, from tools/genlut with no options
 static const unsigned char vortex[] = {
 #include "vortex.h"
 };
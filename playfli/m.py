@@ -35,6 +35,7 @@ src = [
 	"crt0.s",
     "../common/std.s",	
     "../common/isr.s",
+    "../common/dma.s",
 	"esxdos.s",
 	"playfli.c"
 	]
@@ -22,8 +22,10 @@ extern unsigned char allocpage();
 extern unsigned char reservepage(unsigned char page); // alloc specific page
 extern void freepage(unsigned char page);
 
-extern void memcpy(char *dest, const char *source, unsigned short count);
-extern void memset(char *dest, const short value, unsigned short count);
+
+extern void dma_init();
+extern void dma_memcpy(char *dest, const char *source, unsigned short count);
+extern void dma_memset(char *dest, const short value, unsigned short count);
 
 extern volatile short framecounter;
 extern void setupisr7();
@@ -33,39 +35,6 @@ extern void di();
 extern void ei();
 
 
-void dma_memcpy(char *dest, const char *source, unsigned short count)
-{   
-    if (!count) return;
-    if (count < 20)
-    {
-        memcpy(dest, source, count);
-        return;
-    }
-    PORT_DATAGEAR_DMA = 0x83; // DMA_DISABLE
-    PORT_DATAGEAR_DMA = 0b01111101; // R0-Transfer mode, A -> B, write adress + block length
-    PORT_DATAGEAR_DMA = (unsigned short)source & 0xff;
-    PORT_DATAGEAR_DMA = ((unsigned short)source >> 8) & 0xff;
-    PORT_DATAGEAR_DMA = count & 0xff;
-    PORT_DATAGEAR_DMA = (count >> 8) & 0xff;
-    PORT_DATAGEAR_DMA = 0b01010100; // R1-write A time byte, increment, to memory, bitmask
-    PORT_DATAGEAR_DMA = 0b00000010; // 2t
-    PORT_DATAGEAR_DMA = 0b01010000; // R2-write B time byte, increment, to memory, bitmask
-    PORT_DATAGEAR_DMA = 0b00000010; // R2-Cycle length port B
-    PORT_DATAGEAR_DMA = 0b10101101; // R4-Continuous mode (use this for block transfer), write dest adress
-    PORT_DATAGEAR_DMA = (unsigned short)dest & 0xff;
-    PORT_DATAGEAR_DMA = ((unsigned short)dest >> 8) & 0xff;
-    PORT_DATAGEAR_DMA = 0b10000010; // R5-Restart on end of block, RDY active LOW
-    PORT_DATAGEAR_DMA = 0b11001111; // R6-Load
-    PORT_DATAGEAR_DMA = 0x87;       // R6-Enable DMA
-}
-
-void dma_memset(char *dest, const short value, unsigned short count)
-{
-    if (!count) return;
-    *dest = value;
-    dma_memcpy(dest+1, dest, count-1);
-}
-
 extern char *cmdline;
 
 unsigned char readnextreg(char reg)
@@ -180,6 +149,7 @@ void main()
     unsigned short i, j, c;
 
     framedelay = 0;
+    dma_init();
 
 #define SAVEREG(x) regstate[x] = readnextreg(x)
 #define RESTOREREG(x) writenextreg(x, regstate[x])
@@ -290,7 +260,7 @@ void main()
         {
             writenextreg(NEXTREG_MMU3, vpages[i + 1] + (numlines >> 5)); // one 8k bank eats 32 scanlines
             vbuffptr = fb + ((numlines & 31) << 8);
-            memset(vbuffptr, 0, 256);
+            dma_memset(vbuffptr, 0, 256);
         }
     }
     
@@ -315,10 +285,10 @@ loopanim:
         do
         {
             writenextreg(NEXTREG_MMU3, vpages[writepage]);
-            memset(fb, 0, 512);
+            dma_memset(fb, 0, 512);
             i = writepage - readpage + MAX_FRAMEBUFFERS;
             if (i > MAX_FRAMEBUFFERS) i -= MAX_FRAMEBUFFERS;
-            memset(fb, 7, i * 4);
+            dma_memset(fb, 7, i * 4);
         } 
         while (readpage == nextpage); // don't go past read head
         writepage = nextpage;
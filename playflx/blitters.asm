@@ -1,69 +1,3 @@
-setupdma:
-    ld hl, .initdata
-    ld bc, PORT_DATAGEAR_DMA | (.datasize<<8)
-    otir
-    ret
-.initdata:
-    db  $C3,$C3,$C3,$C3,$C3,$C3 ; reset DMA from any possible state (6x reset command)
-    db  %10'0'0'0010            ; WR5 = stop on end of block, /CE only
-    db  %1'0'000000             ; WR3 = all extra features [of real chip] disabled
-    db  %0'1'01'0'100           ; WR1 = A address ++, memory
-    db  2                       ; + custom 2T timing
-    db  %0'1'01'0'000           ; WR2 = B address ++, memory
-    db  2                       ; + custom 2T timing
-.datasize: EQU $ - .initdata
-
-; ------------------------------------------------------------------------
-
-; de dest (returns advanced by +bc)
-; hl src (returns advanced by +bc)
-; bc bytes (is preserved)
-; LDIR cost is 52 + 21*bc @3.5MHz ; 62 + 24*bc @28MHz (+read_wait)
-; DMA cost is 233 + 4*bc @3.5MHz ; 279 + 5*bc @28MHz (+read_wait)
-memcpy:
-    ; check BC against break-even point (LDIR vs DMA)
-    ld a, 12 ; break-even is 12 @28MHz, 11 @3.5MHz
-    cp c
-    sbc a, a                    ; 00 for C <0..12>, FF for C <13..FF>
-    or b                        ; non-zero for BC > 12
-    jr nz, .dma_memcpy
-    push bc
-    ldir
-    pop bc
-    ret
-.dma_memcpy:
-    ; this code style using `out (n),a` is actually reasonably fast and preserves HL,DE,BC for free
-    ld a, 0b01111101; // R0-Transfer mode, A -> B, write adress + block length
-    out (PORT_DATAGEAR_DMA), a
-    ld a, l ; source
-    out (PORT_DATAGEAR_DMA), a
-    ld a, h ; source
-    out (PORT_DATAGEAR_DMA), a
-    ld a, c ; count
-    out (PORT_DATAGEAR_DMA), a
-    ld a, b ; count
-    out (PORT_DATAGEAR_DMA), a
-    ld a, 0b10101101; // R4-Continuous mode (use this for block transfer), write dest adress
-    out (PORT_DATAGEAR_DMA), a
-    ld a, e ; dest
-    out (PORT_DATAGEAR_DMA), a
-    ld a, d ; dest
-    out (PORT_DATAGEAR_DMA), a
-    ld a, 0b11001111; // R6-Load
-    out (PORT_DATAGEAR_DMA), a
-    ld a, 0x87;       // R6-Enable DMA
-    IFNDEF PERF_GRIND
-    out (PORT_DATAGEAR_DMA), a
-    ENDIF
-    ; advance HL,DE the same way how LDIR would, but BC is preserved
-    add hl, bc
-    ex de, hl
-    add hl, bc
-    ex de, hl
-    ret
-
-; ------------------------------------------------------------------------
-
 ; de = screen offset (returns advanced by +bc)
 ; bc = bytes to fill
 ; a = byte to fill
@@ -118,7 +52,7 @@ screenfill:
 .a: ld (hl), 0 ; seed memcpy (self-modify value)
     ld a, b
     or c
-    call nz, memcpy ; if BC!=0 then fill the rest
+    call nz, dma_memcpy ; if BC!=0 then fill the rest
 
     inc bc ; restore bc to fill-count
     pop hl
@@ -248,7 +182,7 @@ screencopyfromprevframe:
     ld d, a
     ; hl = source address, de = output address, bc = clamped count, stack: screen ofs, original count
 
-    call memcpy
+    call dma_memcpy
 
     add ix, bc ; advance source offset
     pop hl
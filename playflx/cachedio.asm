@@ -50,7 +50,7 @@ read:
     push de
     ld hl, (fileindex)
     ;ldir ; [de]=[hl], de++, hl++, bc--
-    call memcpy
+    call dma_memcpy
     pop hl
     pop bc
     add hl, bc
@@ -122,4 +122,5 @@ nextfileblock:
 startstream:
 restartstream:
 endstream:
+prefetchblock:
     ret
@@ -38,7 +38,7 @@ helptext:
     db "-g --game\r"
     db "  Game mode, read docs for info\r"
     db "-d --debug\r"
-    db "  Show debug info\r"
+    db "  Show queue depth & underruns\r"
     db 0
 ;       12345678901234567890123456789012    
 
@@ -779,6 +779,123 @@ LZ3C:
     jp z, blockdone
     jp .tick
 
+; ------------------------------------------------------------------------
+TILES:
+; Starts off as a copy of the previous frame, then for the whole block:
+; [skip][count][.. count 8x8 tiles, 64 bytes each, row by row ..]
+; Tiles are numbered left to right, 32 per row (256x192 only).
+    call readword ; hl = bytes in block
+    push hl
+    ld de, 0 ; screen offset
+    ld ix, 0 ; source offset
+    ld bc, 256*192
+    call screencopyfromprevframe
+    ld hl, 0
+    ld (.tile), hl
+    pop hl
+.run:
+    ld a, h
+    or a, l
+    jp z, blockdone
+    dec hl
+    dec hl
+    push hl
+    call readbyte ; tiles to skip
+    ld e, a
+    ld d, 0
+    ld hl, (.tile)
+    add hl, de
+    ld (.tile), hl
+    call readbyte ; tiles to copy
+    ld (.count), a
+    pop hl
+    or a
+    jr z, .run
+.nexttile:
+    ld bc, 64
+    or a
+    sbc hl, bc
+    push hl
+    ; screen offset = row * 2048 + column * 8
+    ld hl, (.tile)
+    ld a, l
+    and 31
+    add a, a
+    add a, a
+    add a, a
+    ld e, a
+    srl h
+    rr l
+    srl h
+    rr l
+    ld a, l
+    and 0xf8
+    ld d, a
+    ; all 8 pixel rows of a tile are in the same 8K page
+    rlca
+    rlca
+    rlca
+    and 7
+    ld hl, rendertarget
+    add a, (hl)
+    nextreg DSTMMU, a
+    ld a, d
+    and 0x1f
+    or high DESTADDR
+    ld d, a ; de = output address
+    push de
+    ; copy straight from the file buffer if the whole tile is there,
+    ; otherwise gather it with read first
+  IFDEF USE_CACHED_IO
+    ld hl, FILEBUF + FILEBUFSZ
+  ELSE
+    ld hl, (blockend)
+  ENDIF
+    ld bc, (fileindex)
+    or a
+    sbc hl, bc
+    ld a, h
+    or a
+    jr nz, .direct
+    ld a, l
+    cp 64
+    jr nc, .direct
+    ld de, .gather
+    ld bc, 64
+    call read
+    ld hl, .gather
+    jr .copy
+.direct:
+    ld hl, (fileindex)
+    ld bc, 64
+    add hl, bc
+    ld (fileindex), hl
+    sbc hl, bc ; carry = 0, hl = tile data
+.copy:
+    pop de
+    ld bc, 8*256 + 64 ; b = rows, c counts the ldi bytes down and never borrows from b
+.row:
+    push de
+    .8 ldi
+    pop de
+    inc d      ; next pixel row
+    djnz .row
+    ld hl, (.tile)
+    inc hl
+    ld (.tile), hl
+    pop hl
+    ld a, (.count)
+    dec a
+    ld (.count), a
+    jp nz, .nexttile
+    jp .run
+.tile:
+    dw 0
+.count:
+    db 0
+.gather:
+    BLOCK 64, 0 ; a tile that straddles the end of a file block
+
 ; ------------------------------------------------------------------------
 SAMEFRAME: ;chunktype = 0;  printf("s"); break;
     call readword ; hl = bytes in block; ignored, as it's 0
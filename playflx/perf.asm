@@ -0,0 +1,115 @@
+; PERF_GRIND per-chunk profile
+;
+; The isr charges each 50Hz tick to the chunk type being decoded when it
+; fires, so over a clip the tick totals show where the time goes
+; (one tick = 1/50s = 560000 cycles at 28MHz). Dumped at exit as
+; "name chunks ticks", in hex.
+
+PERFENTRY EQU 6  ; dw chunks, dd ticks
+PERFSLOTS EQU 13 ; twelve chunk types + other
+PERFNAMELEN EQU 7
+
+; in: a = chunk type, preserved
+perfchunk:
+    push af
+    push de
+    push hl
+    cp 34
+    jr c, .known
+    ld a, 34   ; other
+.known:
+    ld hl, perfslot
+    ld e, a
+    ld d, 0
+    add hl, de
+    ld e, (hl)
+    ld hl, perftable
+    add hl, de
+    inc (hl)   ; chunks++
+    jr nz, .nocarry
+    inc hl
+    inc (hl)
+    dec hl
+.nocarry:
+    inc hl
+    inc hl
+    ld (perfcur), hl   ; isr adds ticks here from now on
+    pop hl
+    pop de
+    pop af
+    ret
+
+perfdump:
+    ld hl, perftable
+    ld (perfdumpptr), hl
+    ld hl, perfnames
+    ld b, PERFSLOTS
+.loop:
+    push bc
+    push hl
+    call printmsg
+    ld hl, (perfdumpptr)
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    ex de, hl
+    call printword ; chunks
+    ld hl, perfspace
+    call printmsg
+    ld hl, (perfdumpptr)
+    ld de, 4
+    add hl, de
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    ex de, hl
+    call printword ; ticks, high word
+    ld hl, (perfdumpptr)
+    inc hl
+    inc hl
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    ex de, hl
+    call printword ; ticks, low word
+    call printnewline
+    ld hl, (perfdumpptr)
+    ld de, PERFENTRY
+    add hl, de
+    ld (perfdumpptr), hl
+    pop hl
+    ld de, PERFNAMELEN
+    add hl, de
+    pop bc
+    djnz .loop
+    ret
+
+perfcur:
+    dw perftable + 12 * PERFENTRY + 2 ; header etc. count as other
+perfdumpptr:
+    dw 0
+perfspace:
+    db " ", 0
+
+; chunk type -> offset in perftable
+perfslot:
+    db  0, 72, 72,  6, 72, 72, 12, 72, 72, 18, 72, 72, 24, 72, 72, 30, 72
+    db 72, 36, 72, 72, 42, 72, 72, 48, 72, 72, 54, 72, 72, 60, 72, 72, 66, 72
+
+perfnames:
+    db "NEXT  ", 0
+    db "SAME  ", 0
+    db "BLACK ", 0
+    db "COLOR ", 0
+    db "LZ1B  ", 0
+    db "LZ4   ", 0
+    db "LZ5   ", 0
+    db "LZ6   ", 0
+    db "LZ3C  ", 0
+    db "SUB   ", 0
+    db "PAL   ", 0
+    db "TILES ", 0
+    db "OTHER ", 0
+
+perftable:
+    BLOCK PERFSLOTS * PERFENTRY, 0
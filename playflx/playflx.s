@@ -38,11 +38,15 @@ DSTMMU EQU NEXTREG_MMU5 ; & 6 & 7
 DOTADDR EQU 0x6000
 DOTDIFF EQU DOTADDR-0x2000
 SCRATCH EQU 0x8800 
-FILEBUF EQU 0x8000 ; 512 bytes buf, 1024+1 bytes INI+ret
+FILEBUF EQU 0x8000 ; FILEBUFCOUNT 512 byte buffers
 FILEBUFSZP2 EQU 9 ; 2^9 = 512 = buffer size
 FILEBUFSZ EQU 1 << FILEBUFSZP2
+FILEBUFCOUNT EQU 4 ; streaming read-ahead ring, 1, 2 or 4 blocks (4 fills up to SCRATCH)
 STACKADDR EQU 0x8d00
+PALBUF EQU 0x9000 ; PALSLOTS * 512 bytes, pending palette changes (past the isr vectors)
+PALSLOTS EQU 8 ; a power of two; one is always left free
 DESTADDR EQU 0xa000
+    ASSERT PALBUF + PALSLOTS * 512 <= DESTADDR
 SRCADDR EQU 0x4000
 
     MMU DOTADDR, $DF ; hard-wired mapping to match map file with CSpect debugger
@@ -146,7 +150,7 @@ realstart:
 
     call parsecmdline
 
-    call setupdma
+    call dma_init
 
     ld  hl, SCRATCH
     ld  b,  1       ; open existing
@@ -337,12 +341,16 @@ animloop:
     cp e       ; if showpageidx == renderpageidx
     jr nz, .nowait ; wait for the isr to progress
     ei         ; precache enables interrupts here
+    call prefetchblock ; read ahead while we wait
     jr .wait
 .nowait
     ENDIF
 
     call readbyte
     ;call printbyte
+    IFDEF PERF_GRIND
+    call perfchunk
+    ENDIF
     cp 0
     jp z, NEXTFRAME
     cp 3
@@ -363,6 +371,10 @@ animloop:
     jp z, LZ3C
     CP 27
     jp z, SUBFRAME
+    cp 30
+    jp z, PALETTE
+    cp 33
+    jp z, TILES
 
     jp UNKNOWN
 
@@ -419,8 +431,23 @@ fail: ; let's start shutting down
     IFDEF PERF_GRIND
     ld hl, (isrcallcount)
     call printword
+    call printnewline
+    call perfdump
     ENDIF    
 
+    IFNDEF PERF_GRIND
+    ; in debug mode, report how often the decode queue ran dry
+    ld a, (isr.debugcall)
+    cp 0xcd
+    jr nz, .nodebugreport
+    ld hl, underrun_msg
+    call printmsg
+    ld hl, (underruns)
+    call printword
+    call printnewline
+.nodebugreport:
+    ENDIF
+
     RESTORENEXTREG NEXTREG_MMU2, regstore + 1
 ;    RESTORENEXTREG NEXTREG_MMU3, regstore + .. handled by dotcopy stuff
 ;    RESTORENEXTREG NEXTREG_MMU4, regstore + 2 .. done below as last thing
@@ -543,6 +570,74 @@ SUBFRAME:
     ld (rendertarget), a
     jp animloop
 
+PALETTE:
+    ; [start][count, 0 = 256][count * 2 bytes of palette]
+    ; Goes with the frame being rendered, so it's queued for the isr to
+    ; set when that frame is flipped to. The queue is a ring of PALSLOTS
+    ; changes; the decoder only moves paltail and the isr only palhead.
+    IFNDEF PERF_GRIND
+    ld a, (paltail)
+    ld e, a
+    ld a, (palhead)
+    cp e
+    jr z, .nolast
+    ; the last one queued is still waiting. If it's for this frame, it's
+    ; a second change in one frame, which would wait on itself.
+    ld a, e
+    dec a
+    and PALSLOTS - 1
+    call palslot
+    ld a, (renderpageidx)
+    cp (hl)
+    jp z, fail_palette
+.nolast:
+.wait:
+    ; the others are all for earlier frames, so a full ring frees up
+    ld a, (paltail)
+    inc a
+    and PALSLOTS - 1
+    ld e, a
+    ld a, (palhead)
+    cp e
+    jr nz, .free
+    ei         ; precache enables interrupts here
+    call prefetchblock
+    jr .wait
+.free:
+    ld a, (paltail)
+    ELSE
+    xor a      ; nothing is shown, slot 0 will do
+    ENDIF
+    call palslot
+    ld a, (renderpageidx)
+    ld (hl), a
+    inc hl
+    push hl
+    push de
+    call readbyte
+    ld (hl), a ; start
+    inc hl
+    call readbyte
+    ld (hl), a ; count
+    ld c, a
+    ld b, 0
+    or a
+    jr nz, .notfull
+    inc b      ; 256 entries
+.notfull:
+    sla c
+    rl b       ; 2 bytes per entry
+    pop de
+    call read
+    pop hl
+    IFNDEF PERF_GRIND
+    ld a, (paltail)
+    inc a
+    and PALSLOTS - 1
+    ld (paltail), a ; now the isr can see it
+    ENDIF
+    jp animloop
+
 NEXTFRAME:
     ; advance the readypage so it can be shown
     ld a, (renderpageidx)
@@ -603,14 +698,38 @@ fail_mem:
     ld hl, fail_mem_msg
     jp printerrmsg
 
+fail_palette_msg:
+    db "Two palette changes in a frame\r",0
+fail_palette:
+    ld hl, fail_palette_msg
+    jp printerrmsg
+
+underrun_msg:
+    db "Queue underruns: ", 0
+
 
     IFDEF PERF_GRIND
 isr:
+    push af
     push hl
     ld hl, (isrcallcount)
     inc hl
     ld (isrcallcount), hl
+    ; charge the tick to the chunk being decoded
+    ld hl, (perfcur)
+    inc (hl)
+    jr nz, .ticked
+    inc hl
+    inc (hl)
+    jr nz, .ticked
+    inc hl
+    inc (hl)
+    jr nz, .ticked
+    inc hl
+    inc (hl)
+.ticked:
     pop hl
+    pop af
     ei
     reti
 .debugcall: ; needed for self-modifying code from options to compile
@@ -641,7 +760,7 @@ isr:
     ld d, a
     ld a, (showpageidx)
     cp a, e
-    jr z, .notready    ; if showpageidx == readypageidx 
+    jr z, .underrun    ; if showpageidx == readypageidx 
     inc a              ; showpageidx++
     cp a, d
     jr nz, .notrollover ; if showpageidx != framebuffers
@@ -658,6 +777,8 @@ isr:
     ;call printbyte
 .flip:nextreg NEXTREG_LAYER2_RAMPAGE, a
 
+    call palflip
+
     ; Current frame shown (for game mode)
     ld hl, (currentframe)
     inc hl
@@ -666,6 +787,18 @@ isr:
     ; Clear frame waits here (so if frame wasn't realy we'll show it ASAP)
     ld a, 0
     ld (framewaits), a
+    jr .notready
+
+.underrun:
+    ; A frame is due but the decoder hasn't queued one; count the ticks
+    ; we're late, once the first frame has been shown.
+    ld hl, (currentframe)
+    ld a, h
+    or l
+    jr z, .notready
+    ld hl, (underruns)
+    inc hl
+    ld (underruns), hl
 
 .notready:
 
@@ -679,6 +812,64 @@ isr:
     reti
     ENDIF ; /!perf_grind
 
+; in: a = palette slot
+; out: hl = its page, start, count; de = its 512 byte buffer
+palslot:
+    ld e, a
+    add a, a
+    add a, a
+    ld hl, palinfo
+    add a, l
+    ld l, a
+    adc a, h
+    sub l
+    ld h, a
+    ld a, e
+    add a, a
+    add a, PALBUF >> 8
+    ld d, a
+    ld e, 0
+    ret
+
+; called from isr after a flip: sets the oldest queued palette change if
+; its frame is now on screen
+palflip:
+    ld a, (paltail)
+    ld e, a
+    ld a, (palhead)
+    cp e
+    ret z      ; nothing queued
+    push af
+    call palslot
+    ld a, (showpageidx)
+    cp (hl)
+    jr z, .due
+    pop af
+    ret
+.due:
+  IFNDEF NO_GRAPHICS_SETUP
+    inc hl
+    ld a, (hl) ; start
+    nextreg NEXTREG_PALETTE_INDEX, a
+    inc hl
+    ld b, (hl) ; count, 0 = 256
+    ex de, hl
+.loop:
+    ld a, (hl)
+    inc hl
+    nextreg NEXTREG_ENHANCED_ULA_PALETTE_EXTENSION, a
+    ld a, (hl)
+    inc hl
+    nextreg NEXTREG_ENHANCED_ULA_PALETTE_EXTENSION, a
+    djnz .loop
+  ENDIF
+    pop af
+    inc a
+    and PALSLOTS - 1
+    ld (palhead), a
+    ret
+
+; sprite x = 32 + number of decoded frames queued for display
 showdebug:
     ld a, (showpageidx)
     ld c, a
@@ -751,19 +942,19 @@ lores_flip:
     ld de, DESTADDR
     ld hl, SRCADDR
     ld bc, 6*1024
-    ldir; can't dma because that goes boom. call memcpy.dma_memcpy
+    ldir; can't dma because that goes boom. call dma_memcpy.dma
     nextreg DSTMMU, 11
     ld de, DESTADDR
     ld hl, SRCADDR + 6 * 1024
     ld bc, 2*1024
-    ldir; call memcpy.dma_memcpy
+    ldir; call dma_memcpy.dma
     pop af
     inc a
     nextreg SRCMMU, a
     ld de, DESTADDR + 2 * 1024
     ld hl, SRCADDR
     ld bc, 4*1024
-    ldir; call memcpy.dma_memcpy
+    ldir; call dma_memcpy.dma
     RESTORENEXTREG SRCMMU, SCRATCH+3
     RESTORENEXTREG DSTMMU, SCRATCH+4
     ret
@@ -812,6 +1003,15 @@ drawoffset:
 config:
     dw 0    
 
+underruns:
+    dw 0
+palhead:
+    db 0 ; oldest queued palette change, next for the isr
+paltail:
+    db 0 ; where the decoder queues the next one
+palinfo:
+    BLOCK PALSLOTS * 4, 0 ; framebuffer index it goes with, start, count, unused
+
     IFDEF PERF_GRIND
 isrcallcount:
     dw 0
@@ -822,6 +1022,9 @@ cmdline:
 
   IFDEF DO_CHECKSUM_CHECK
     INCLUDE checksum.asm
+  ENDIF
+  IFDEF PERF_GRIND
+    INCLUDE perf.asm
   ENDIF
     INCLUDE isr.asm
   IFDEF USE_CACHED_IO
@@ -831,6 +1034,7 @@ cmdline:
   ENDIF
     INCLUDE decoders.asm
     INCLUDE blitters.asm
+    INCLUDE ../common/dma.asm
     INCLUDE print.asm
     INCLUDE esxdos.asm
     INCLUDE cmdline.asm
@@ -1,14 +1,22 @@
 ; replacement for cachedio using streaming i/o
+;
+; FILEBUFCOUNT blocks of 512 bytes at FILEBUF form a ring. The reads below
+; consume the blocks in order, and prefetchblock (called while waiting for
+; the isr) pulls blocks the card already has ready into the free slots, so
+; the decoder doesn't have to wait for the card later on.
+
+FILEBUFEND EQU FILEBUF + FILEBUFCOUNT * FILEBUFSZ
+    ASSERT FILEBUFCOUNT == 1 || FILEBUFCOUNT == 2 || FILEBUFCOUNT == 4
+    ASSERT (FILEBUF & 0xff) == 0 && FILEBUFSZ == 512
+    ASSERT FILEBUFEND <= SCRATCH
 
 ; out: a
 readbyte:
     push hl
-    ld hl, (fileindex) ; if FILEBUF + FILEBUFSZ, the buffer is exhausted and needs to read next block
-    ASSERT ((FILEBUF + FILEBUFSZ) & ~FILEBUFSZ) == FILEBUF
-    ASSERT ((FILEBUF + FILEBUFSZ - 1) & FILEBUFSZ) == 0 ; making sure the `bit + res` trick works
-    bit FILEBUFSZP2-8, h
-    res FILEBUFSZP2-8, h ; resets hl to FILEBUF
-    call nz, nextfileblock
+    ld hl, (fileindex)
+    ld a, l
+    or a
+    call z, blockboundary ; every 256 bytes, check for the end of the block
     ld a, (hl)
     inc hl
     ld (fileindex), hl
@@ -28,11 +36,11 @@ readword:
 read:
     push de
     push bc
-    ld hl, FILEBUF + FILEBUFSZ
+    ld hl, (blockend)
     ld bc, (fileindex)
     or a
     sbc hl, bc
-    call z, nextfileblock_hl_fbsz
+    call z, nextblock_hl_fbsz
     ; hl = max bytes to read at once
     pop bc  ; desired copy length
     push bc
@@ -52,7 +60,7 @@ read:
     push de
     ld hl, (fileindex)
     ;ldir ; [de]=[hl], de++, hl++, bc--
-    call memcpy
+    call dma_memcpy
     pop hl
     pop bc
     add hl, bc
@@ -73,11 +81,11 @@ read:
 ; bc = bytes
 skipbytes:
     push bc
-    ld hl, FILEBUF + FILEBUFSZ
+    ld hl, (blockend)
     ld bc, (fileindex)
     or a
     sbc hl, bc
-    call z, nextfileblock_hl_fbsz
+    call z, nextblock_hl_fbsz
     ; hl = max bytes to read at once
     pop bc  ; desired copy length
     push bc
@@ -110,6 +118,12 @@ blocksleft:
     dw 0
 cardflags:
     db 0
+blockend:
+    dw FILEBUF + FILEBUFSZ ; end of the block being read, low byte always 0
+fillindex:
+    dw FILEBUF              ; where the next block from the card goes
+blocksahead:
+    db 0                    ; blocks read past the current one
 
 
 endstream:
@@ -164,9 +178,88 @@ startfileblock:
     jp c, streaming_failed4
     ret
 
-nextfileblock_hl_fbsz:
+; in: hl = fileindex, at a 256 byte boundary
+; out: hl = where to read from
+blockboundary:
+    ld a, (blockend+1)
+    cp h
+    ret nz     ; middle of a block, or the start of a fresh one
+; in: hl = blockend
+; out: hl = start of the next block, which is ready
+nextblock:
+    ld a, h
+    cp FILEBUFEND >> 8
+    jr nz, .nowrap
+    ld h, FILEBUF >> 8
+.nowrap:
+    ld a, h
+    add a, FILEBUFSZ >> 8
+    ld (blockend+1), a
+    ld a, (blocksahead)
+    or a
+    call z, fillblock  ; nothing read ahead, wait for the card
+    ld a, (blocksahead)
+    dec a
+    ld (blocksahead), a
+    ret
+
+; for read / skipbytes when the block is exhausted
+; out: hl = FILEBUFSZ
+nextblock_hl_fbsz:
+    push af
+    ld hl, (fileindex)
+    call nextblock
+    ld (fileindex), hl
     ld hl, FILEBUFSZ
+    pop af
+    ret
+
+; Drops whatever is buffered and reads the next block to the start of the ring.
 nextfileblock:
+    push af
+    push hl
+    ld hl, FILEBUF
+    ld (fileindex), hl
+    ld (fillindex), hl
+    ld hl, FILEBUF + FILEBUFSZ
+    ld (blockend), hl
+    call fillblock
+    xor a
+    ld (blocksahead), a ; the block we just read is the current one
+    pop hl
+    pop af
+    ret
+
+; If there's room in the ring and the card has the next block ready,
+; reads it. Doesn't wait; call while idle.
+prefetchblock:
+  IF FILEBUFCOUNT > 1
+    ld a, (blocksahead)
+    cp FILEBUFCOUNT - 1
+    ret nc     ; ring is full
+    push hl
+    ld hl, (blocksleft)
+    ld a, h
+    or l
+    pop hl
+    ret z      ; past the end of the file map
+    push af
+    push hl
+    push bc
+    push de
+    ld c, 0xeb
+    in a, (c)
+    inc a
+    jr nz, readblock ; got the start token
+    pop de
+    pop bc
+    pop hl
+    pop af
+  ENDIF
+    ret
+
+; Reads the next block from the card to fillindex, waiting for it if needed.
+fillblock:
     push af
     push hl
     push bc
@@ -177,12 +270,20 @@ waittoken: ; wait for new data block to be ready
     inc a
     jr z, waittoken    
     ; a should be 0xfe+1 now, we probably should check for that..
-    ld hl, FILEBUF
-    ld (fileindex), hl
+readblock:
+    ld hl, (fillindex)
 ;   INI = (hl)=(c), hl++, b--
 ;   move this 1KB of INI elsewhere (generate them)
     .(FILEBUFSZ) ini
     in a, (c)       ; skip crc 1/2 (needs (n)op between)
+    ld a, h
+    cp FILEBUFEND >> 8
+    jr nz, .nowrap
+    ld h, FILEBUF >> 8
+.nowrap:
+    ld (fillindex), hl
+    ld hl, blocksahead
+    inc (hl)
     ld hl, (blocksleft)
     dec hl
     ld (blocksleft), hl
@@ -84,19 +84,30 @@
     jp nz, notnext
 
     push hl
-    PRINT "sdbench v0.4 by Jari Komppa\rhttp://iki.fi/sol\r"
+    PRINT "sdbench v0.5 by Jari Komppa\rhttp://iki.fi/sol\r"
     pop hl
 
     ld a, h
     or l
     jp z, halp
     ld a, (hl)
+    cp "s"
+    jr nz, notsuite
+    inc hl
+    ld a, (hl)
+    cp "u"
+    jp nz, halp
+    ld a, 1
+    ld (suitemode), a
+    jr argok
+notsuite:
     cp "g"
     jp nz, halp
     inc hl
     ld a, (hl)
     cp "o"
     jp nz, halp
+argok:
 
     PUSHALL
     ld (spstore), sp
@@ -164,6 +175,10 @@ fileok:
     rst     0x8
     .db     0x9b ; F_CLOSE
 
+    ld a, (suitemode)
+    or a
+    jp nz, suite
+
     PRINT "SD delay loops (100x): "
 
     di
@@ -209,6 +224,9 @@ done:
     ld a, (filehandle)
     rst     0x8
     .db     0x9b ; F_CLOSE
+    ld a, (suitemode)
+    or a
+    call nz, suiteclean
     RESTORENEXTREG 7, regstore
     ld sp, (spstore)
     POPALL
@@ -429,6 +447,12 @@ gettime:
 
 filemap:
     BLOCK 24, 0
+filemapptr:
+    dw 0 ; next entry
+filemapend:
+    dw 0 ; past the last entry
+blocksleft:
+    dw 0 ; in the current entry
 cardflags:
     db 0
 
@@ -449,6 +473,7 @@ startstream:
     PRINT "Data file is too fragmented.\rPlease run .defrag on it.\r"
     jp done
 .streamok2:
+    ld (filemapend), hl
     ld bc, filemap
     or a
     sbc hl, bc
@@ -457,6 +482,10 @@ startstream:
     jp done
 .streamok3:
     ld hl, filemap
+    ld (filemapptr), hl
+; starts streaming the entry at filemapptr
+startfileblock:
+    ld hl, (filemapptr)
     ld e, (hl)
     inc hl
     ld d, (hl)
@@ -469,6 +498,9 @@ startstream:
     ld c, (hl)
     inc hl
     ld b, (hl) ; BC=number of 512-byte blocks
+    inc hl
+    ld (filemapptr), hl
+    ld (blocksleft), bc
     pop hl     ; HLDE=card address from dot
     ld a, (cardflags)
     or a, 0x80 ; we'll wait for the start token
@@ -478,6 +510,48 @@ startstream:
     PRINT "Failed to start streaming.\r"
     jp done
 
+; out: hl = blocks in the file map, at most 0xffff
+mappedblocks:
+    ld de, filemap
+    ld hl, 0
+.loop:
+    push hl
+    ld hl, (filemapend)
+    or a
+    sbc hl, de
+    pop hl
+    ret z
+    ex de, hl  ; hl = entry, de = total
+    ld bc, 4
+    add hl, bc
+    ld c, (hl)
+    inc hl
+    ld b, (hl) ; BC=number of 512-byte blocks
+    inc hl     ; next entry
+    ex de, hl
+    add hl, bc
+    jr nc, .loop
+    ld hl, 0xffff
+    ret
+
+; Reads one block like stream512, moving on to the next file map entry
+; where the current one ends, the way playflx's streamingio does.
+streamblock:
+    call stream512
+    ld hl, (blocksleft)
+    dec hl
+    ld (blocksleft), hl
+    ld a, h
+    or l
+    ret nz
+    ld hl, (filemapptr)
+    ld de, (filemapend)
+    or a
+    sbc hl, de
+    ret z ; that was the last one
+    call endstream
+    jp startfileblock
+
 ; --------------------------------------------------
 
 endstream:
@@ -546,7 +620,7 @@ streaming_test:
     ld b, 0
 .inner:
     push bc
-    call stream512
+    call streamblock
     pop bc
     djnz .inner
     pop bc
@@ -701,6 +775,738 @@ freading_test:
     .db     0x9b ; F_CLOSE
     ret
 
+; --------------------------------------------------
+; Suite mode: every case at every cpu speed, RUNS times each. Prints
+; min/median/max kB/s and writes the same to sdbench.csv.
+;
+; Timing uses the FRAMES system variable, which the rom isr ticks at
+; 50 or 60Hz with interrupts on, so the runs are long enough for the
+; 1/50s resolution to stay around 1%.
+
+RUNS EQU 5
+
+suite:
+    ; 16K buffer for the big reads and writes: two fresh pages at
+    ; 0x8000 (mmu4/5), or at 0xc000 (mmu6/7) if the stack lives at 0x8000.
+    ld hl, 0x8000
+    ld a, (spstore + 1)
+    and 0xc0
+    cp 0x80
+    ld a, 0x54 ; mmu4
+    jr nz, .bufok
+    ld a, 0x56 ; mmu6
+    ld hl, 0xc000
+.bufok:
+    ld (bufmmu), a
+    ld (bufaddr), hl
+
+    ld bc, 0x243B ; nextreg select
+    out (c), a
+    inc b         ; nextreg i/o
+    in a, (c)
+    ld (mmustore), a
+    dec b
+    ld a, (bufmmu)
+    inc a
+    out (c), a
+    inc b
+    in a, (c)
+    ld (mmustore + 1), a
+
+    call allocpage
+    jp nc, nomem
+    ld a, e
+    ld (bufpages), a
+    call allocpage
+    jp nc, nomem
+    ld a, e
+    ld (bufpages + 1), a
+
+    ld a, (bufmmu)
+    ld d, a
+    ld a, (bufpages)
+    ld e, a
+    call setmmu
+    inc d
+    ld a, (bufpages + 1)
+    ld e, a
+    call setmmu
+
+    STORENEXTREGMASK 5, hz, 4 ; 60hz video?
+    or a
+    ld a, 50
+    jr z, .hzok
+    ld a, 60
+.hzok:
+    ld (hz), a
+
+    ld hl, csvname
+    ld b, 2 + 0x0c ; write, create new file, delete existing
+	ld  a,  '*'
+	rst     0x8
+	.db     0x9a ; F_OPEN
+    jp c, file_create_fail
+    ld (csvhandle), a
+    ld hl, csvheader
+    ld bc, csvheaderend - csvheader
+	rst     0x8
+	.db     0x9e ; F_WRITE
+    jp c, file_write_fail
+
+    PRINT "Running the suite. This takes\rseveral minutes.\r"
+
+    ld hl, speeds
+.speedloop:
+    ld a, (hl)
+    cp 0xff
+    jp z, .finished
+    nextreg 7, a
+    inc hl
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    inc hl
+    ld (speedptr), hl
+    ld (speedname), de
+
+    ld hl, (speedname)
+    ld de, linebuf
+    call putstr
+    ld hl, mhzhdr
+    call putstr
+    ld hl, linebuf
+    call printloop
+
+    ld hl, cases
+    ld (caseptr), hl
+.caseloop:
+    ld hl, (caseptr)
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    inc hl
+    ld a, d
+    or e
+    jr z, .casesdone
+    ld (.call + 1), de
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    inc hl
+    ld (casekb), de
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    inc hl
+    ld (caseparam), de
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    inc hl
+    ld (casecount), de
+    ld e, (hl)
+    inc hl
+    ld d, (hl)
+    inc hl
+    ld (casename), de
+    ld (caseptr), hl
+
+    ld hl, runs
+    ld (runptr), hl
+    ld b, RUNS
+.runloop:
+    push bc
+    ld bc, (caseparam)
+    ld de, (casecount)
+.call:
+    call 0 ; (modified above), returns hl = frames
+    call kbps
+    ex de, hl
+    ld hl, (runptr)
+    ld (hl), e
+    inc hl
+    ld (hl), d
+    inc hl
+    ld (runptr), hl
+    pop bc
+    djnz .runloop
+
+    call sortruns
+    call report
+    jr .caseloop
+
+.casesdone:
+    ld a, "\r"
+    rst 16
+    ld hl, (speedptr)
+    jp .speedloop
+
+.finished:
+    ld a, (csvhandle)
+    rst     0x8
+    .db     0x9b ; F_CLOSE
+    ld a, 0xff
+    ld (csvhandle), a
+    PRINT "Results written to sdbench.csv\r"
+    jp done
+
+; --------------------------------------------------
+; Called from done; undoes whatever suite got to.
+suiteclean:
+    ld a, (csvhandle)
+    rst     0x8
+    .db     0x9b ; F_CLOSE
+    ld hl, tmpname
+	ld  a,  '*'
+	rst     0x8
+	.db     0xad ; F_UNLINK
+    ld a, (bufpages)
+    or a
+    ret z ; never got to the buffer
+    ld a, (bufmmu)
+    ld d, a
+    ld a, (mmustore)
+    ld e, a
+    call setmmu
+    inc d
+    ld a, (mmustore + 1)
+    ld e, a
+    call setmmu
+    ld a, (bufpages)
+    ld e, a
+    call freepage
+    ld a, (bufpages + 1)
+    or a
+    ret z
+    ld e, a
+    jp freepage
+
+; d = nextreg, e = value
+setmmu:
+    ld bc, 0x243B ; nextreg select
+    out (c), d
+    inc b         ; nextreg i/o
+    out (c), e
+    ret
+
+; output e = page, nc = fail
+allocpage:
+    ld      hl, 0x0001 ; alloc zx memory
+    exx                             ; place parameters in alternates
+    ld      de, 0x01bd             ; IDE_BANK
+    ld      c, 7                   ; "usually 7, but 0 for some calls"
+    rst     0x8
+    .db     0x94                   ; +3dos call
+    ret
+
+; e = page
+freepage:
+    ld      hl, 0x0003 ; free zx memory
+    exx                             ; place parameters in alternates
+    ld      de, 0x01bd             ; IDE_BANK
+    ld      c, 7                   ; "usually 7, but 0 for some calls"
+    rst     0x8
+    .db     0x94                   ; +3dos call
+    ret
+
+nomem:
+    PRINT "Out of memory.\r"
+    jp done
+
+; --------------------------------------------------
+; Frame timer. Start waits for a fresh frame so the runs line up.
+timerstart:
+    ei
+    halt
+    ld hl, (23672) ; FRAMES
+    ld (framestart), hl
+    ret
+
+; out hl = frames since timerstart, at least 1
+timerstop:
+    ld hl, (23672) ; FRAMES
+    ld de, (framestart)
+    or a
+    sbc hl, de
+    ret nz
+    inc hl
+    ret
+
+; in hl = frames, out hl = casekb * hz / frames
+kbps:
+    ex de, hl
+    ld hl, 0
+    ld bc, (casekb)
+    ld a, (hz)
+.mul:
+    add hl, bc
+    dec a
+    jr nz, .mul
+
+; hl = hl / de
+div16:
+    ld a, h
+    ld c, l    ; ac = dividend, becomes quotient
+    ld hl, 0   ; remainder
+    ld b, 16
+.loop:
+    sla c
+    rla
+    adc hl, hl
+    or a
+    sbc hl, de
+    jr nc, .fits
+    add hl, de
+    djnz .loop
+    jr .out
+.fits:
+    inc c
+    djnz .loop
+.out:
+    ld h, a
+    ld l, c
+    ret
+
+; --------------------------------------------------
+; Bubble sort the RUNS results, smallest first
+sortruns:
+    ld b, RUNS - 1
+.outer:
+    push bc
+    ld b, RUNS - 1
+    ld hl, runs
+.inner:
+    ld e, (hl)
+    inc hl
+    ld d, (hl) ; de = this
+    inc hl
+    ld c, (hl)
+    inc hl
+    ld a, (hl) ; ac = next
+    push hl
+    ld h, a
+    ld l, c
+    or a
+    sbc hl, de
+    pop hl
+    jr nc, .noswap
+    ld (hl), d
+    dec hl
+    ld (hl), e
+    dec hl
+    ld (hl), a
+    dec hl
+    ld (hl), c
+    inc hl
+    inc hl
+    inc hl
+.noswap:
+    dec hl ; hl = next
+    djnz .inner
+    pop bc
+    djnz .outer
+    ret
+
+; --------------------------------------------------
+; Print "case min median max" and write the csv line
+report:
+    ld de, linebuf
+    ld hl, (casename)
+    call putstr
+    ld a, " "
+    call putresults
+    ld a, "\r"
+    ld (de), a
+    inc de
+    xor a
+    ld (de), a
+    ld hl, linebuf
+    call printloop
+
+    ld de, linebuf
+    ld hl, (speedname)
+    call putstr
+    ld a, ","
+    ld (de), a
+    inc de
+    ld hl, (casename)
+    call putstr
+    ld a, ","
+    ld (de), a
+    inc de
+    ld hl, (casekb)
+    call putdec
+    ld a, ","
+    ld (de), a
+    inc de
+    ld hl, RUNS
+    call putdec
+    ld a, ","
+    call putresults
+    ld a, "\n"
+    ld (de), a
+    inc de
+
+    ex de, hl
+    ld de, linebuf
+    or a
+    sbc hl, de
+    ld b, h
+    ld c, l
+    ex de, hl ; hl = linebuf, bc = length
+    ld a, (csvhandle)
+    rst     0x8
+    .db     0x9e ; F_WRITE
+    jp c, file_write_fail
+    ret
+
+; a = separator, de = output
+putresults:
+    ld (.sep1 + 1), a
+    ld (.sep2 + 1), a
+    ld (.sep3 + 1), a
+.sep1:
+    ld a, 0 ; (modified above)
+    ld (de), a
+    inc de
+    ld hl, (runs)
+    call putdec
+.sep2:
+    ld a, 0 ; (modified above)
+    ld (de), a
+    inc de
+    ld hl, (runs + (RUNS / 2) * 2)
+    call putdec
+.sep3:
+    ld a, 0 ; (modified above)
+    ld (de), a
+    inc de
+    ld hl, (runs + (RUNS - 1) * 2)
+    jp putdec
+
+; copy zero terminated hl to de, de points past the copy
+putstr:
+    ld a, (hl)
+    or a
+    ret z
+    ld (de), a
+    inc hl
+    inc de
+    jr putstr
+
+; hl in decimal to de, de points past the digits
+putdec:
+    push de
+    ld de, decbuf
+    ld bc, -10000
+    call .digit
+    ld bc, -1000
+    call .digit
+    ld bc, -100
+    call .digit
+    ld bc, -10
+    call .digit
+    ld bc, -1
+    call .digit
+    pop de
+    ld hl, decbuf
+    ld b, 4
+.skip: ; leading zeros, but keep the last digit
+    ld a, (hl)
+    cp "0"
+    jr nz, .copy
+    inc hl
+    djnz .skip
+.copy:
+    inc b
+.copyloop:
+    ld a, (hl)
+    ld (de), a
+    inc hl
+    inc de
+    djnz .copyloop
+    ret
+.digit:
+    ld a, "0" - 1
+.sub:
+    inc a
+    add hl, bc
+    jr c, .sub
+    sbc hl, bc
+    ld (de), a
+    inc de
+    ret
+
+; --------------------------------------------------
+; Cases. In: bc = caseparam, de = casecount. Out: hl = frames.
+
+openread:
+    ld hl, filename
+    ld b, 1 ; open, only existing files
+	ld  a,  '*'
+	rst     0x8
+	.db     0x9a ; F_OPEN
+    jp c, general_error
+    ld (filehandle), a
+    ret
+
+; hl = frames, preserved
+closetimed:
+    push hl
+    ld a, (filehandle)
+    rst     0x8
+    .db     0x9b ; F_CLOSE
+    pop hl
+    ret
+
+; de reads of bc bytes each from the start of the data file
+freadcase:
+    push bc
+    push de
+    call openread
+    call timerstart
+    pop de
+    pop bc
+.loop:
+    push bc
+    push de
+    ld a, (filehandle)
+    ld hl, (bufaddr)
+    rst     0x8
+    .db     0x9d ; F_READ
+    pop de
+    pop bc
+    jp c, general_error
+    dec de
+    ld a, d
+    or e
+    jr nz, .loop
+    call timerstop
+    jr closetimed
+
+; de 512 byte blocks through DISK_FILEMAP streaming, like streamingio.asm
+streamcase:
+    push de
+    call openread
+    call startstream
+    call mappedblocks
+    pop de
+    push de
+    or a
+    sbc hl, de
+    jr nc, .mapped
+    ; the file map doesn't reach that far; reading on would time
+    ; whatever the card has after the last entry
+    call endstream
+    PRINT "Data file is too fragmented\rto stream. Please run .defrag\ron it.\r"
+    jp done
+.mapped:
+    call timerstart
+    pop de
+.loop:
+    push de
+    call streamblock
+    pop de
+    dec de
+    ld a, d
+    or e
+    jr nz, .loop
+    call timerstop
+    push hl
+    call endstream
+    pop hl
+    jr closetimed
+
+; de seeks to a random 512 byte block of the 1MB file, each followed by
+; a 512 byte read
+seekcase:
+    push de
+    call openread
+    call timerstart
+    pop de
+.loop:
+    push de
+    call random
+    ld a, h
+    and 7
+    ld h, a
+    add hl, hl ; block * 2
+    ld c, h
+    ld d, l
+    ld e, 0
+    ld b, 0    ; bcde = block * 512
+    ld hl, 0   ; seek_set
+    ld a, (filehandle)
+    rst     0x8
+    .db     0x9f ; F_SEEK
+    jp c, general_error
+    call fread512
+    jp c, general_error
+    pop de
+    dec de
+    ld a, d
+    or e
+    jr nz, .loop
+    call timerstop
+    jr closetimed
+
+; de writes of bc bytes each to a new file, close included in the time
+writecase:
+    push bc
+    push de
+    call timerstart
+    ld hl, tmpname
+    ld b, 2 + 0x0c ; write, create new file, delete existing
+	ld  a,  '*'
+	rst     0x8
+	.db     0x9a ; F_OPEN
+    jp c, file_create_fail
+    ld (filehandle), a
+    pop de
+    pop bc
+.loop:
+    push bc
+    push de
+    ld a, (filehandle)
+    ld hl, (bufaddr)
+    rst     0x8
+    .db     0x9e ; F_WRITE
+    pop de
+    pop bc
+    jp c, file_write_fail
+    dec de
+    ld a, d
+    or e
+    jr nz, .loop
+    ld a, (filehandle)
+    rst     0x8
+    .db     0x9b ; F_CLOSE
+    jp timerstop
+
+; xorshift, out hl
+random:
+    ld hl, (rndstate)
+    ld a, h
+    rra
+    ld a, l
+    rra
+    xor h
+    ld h, a
+    ld a, l
+    rra
+    ld a, h
+    rra
+    xor l
+    ld l, a
+    xor h
+    ld h, a
+    ld (rndstate), hl
+    ret
+
+; routine, kB per run, caseparam, casecount, name
+cases:
+    dw freadcase, 256, 512, 512, name_fread512
+    dw freadcase, 256, 1024, 256, name_fread1k
+    dw freadcase, 256, 4096, 64, name_fread4k
+    dw freadcase, 256, 16384, 16, name_fread16k
+    dw streamcase, 1024, 0, 2048, name_stream
+    dw seekcase, 128, 0, 256, name_seek
+    dw writecase, 256, 512, 512, name_write512
+    dw writecase, 256, 4096, 64, name_write4k
+    dw 0
+
+name_fread512:
+    db "fread512", 0
+name_fread1k:
+    db "fread1k", 0
+name_fread4k:
+    db "fread4k", 0
+name_fread16k:
+    db "fread16k", 0
+name_stream:
+    db "stream", 0
+name_seek:
+    db "seek512", 0
+name_write512:
+    db "write512", 0
+name_write4k:
+    db "write4k", 0
+
+; nextreg 7 value, name
+speeds:
+    db 3
+    dw name_28
+    db 2
+    dw name_14
+    db 1
+    dw name_7
+    db 0
+    dw name_3
+    db 0xff
+
+name_28:
+    db "28", 0
+name_14:
+    db "14", 0
+name_7:
+    db "7", 0
+name_3:
+    db "3.5", 0
+
+mhzhdr:
+    db "MHz, kB/s min median max\r", 0
+
+csvheader:
+    db "mhz,case,kb,runs,min,median,max\n"
+csvheaderend:
+
+csvname:
+    db "sdbench.csv", 0
+
+tmpname:
+    db "sdbench.tmp", 0
+
+suitemode:
+    db 0
+csvhandle:
+    db 0xff
+bufmmu:
+    db 0
+bufaddr:
+    dw 0
+bufpages:
+    db 0, 0
+mmustore:
+    db 0, 0
+hz:
+    db 0
+framestart:
+    dw 0
+rndstate:
+    dw 1
+speedptr:
+    dw 0
+speedname:
+    dw 0
+caseptr:
+    dw 0
+casekb:
+    dw 0
+caseparam:
+    dw 0
+casecount:
+    dw 0
+casename:
+    dw 0
+runptr:
+    dw 0
+runs:
+    BLOCK RUNS * 2, 0
+decbuf:
+    BLOCK 5, 0
+linebuf:
+    BLOCK 64, 0
+
 ; --------------------------------------------------
 
 general_error:
@@ -767,6 +1573,13 @@ helptext:
     db "\r"
     db "To run the test:\r"
     db ".sdbench go\r"
+    db "\r"
+    db "To run the full suite (fread\r"
+    db "512B..16K, streaming, seeks\r"
+    db "and writes at every cpu speed,\r"
+    db "min/median/max kB/s, also\r"
+    db "written to sdbench.csv):\r"
+    db ".sdbench suite\r"
     db "\r",0
 
 notnextmsg:
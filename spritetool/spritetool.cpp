@@ -10,116 +10,550 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <stdarg.h>
+#include <thread>
+#include <atomic>
+#include <vector>
 #define STB_IMAGE_IMPLEMENTATION
 #include "../common/stb_image.h"
 #define SOL_QMEDIAN_IMPLEMENTATION
 #include "../common/sol_qmedian.h"
 
-int main(int parc, char** pars)
+// Output options, shared by all sheets
+int gFourbit = 0;   // 16 color sprites, two pixels per byte
+int gBinary = 0;    // raw patterns instead of C source
+int gNxp = 0;       // also write the palette as a 512 byte .nxp
+int gPalwid = 256;  // palette entries to quantize to
+int gTransparent = 0xff;
+
+struct Sheet
 {
-	if (parc < 3)
-	{
-		printf("Usage: inputfile outputfile\n");
-		return -1;
-	}
-	int x,y,n;
-    unsigned char *data = stbi_load(pars[1], &x, &y, &n, 4);
-	if (!data)
+	const char* mIn;
+	char mOut[1024];
+	char mNxpOut[1024];
+	int mX, mY;
+	unsigned char* mData;    // rgba, reduced to 3 bits per component
+	unsigned char* mIdxmap;
+	unsigned char* mPalette; // gPalwid * 3, 3 bits per component
+	int mColors[512];        // 9-bit color histogram
+	int mUnique;
+	int mCount;
+	int mKeyidx;
+	const char* mError;
+};
+
+// Growable output buffer; the whole file goes out with a single fwrite.
+struct OutBuf
+{
+	char* mData;
+	int mLen;
+	int mCap;
+};
+
+static void outreserve(OutBuf& b, int aBytes)
+{
+	if (b.mLen + aBytes <= b.mCap)
+		return;
+	while (b.mLen + aBytes > b.mCap)
+		b.mCap = b.mCap ? b.mCap * 2 : 65536;
+	b.mData = (char*)realloc(b.mData, b.mCap);
+}
+
+static void outstr(OutBuf& b, const char* aStr, int aLen)
+{
+	outreserve(b, aLen);
+	memcpy(b.mData + b.mLen, aStr, aLen);
+	b.mLen += aLen;
+}
+
+static void outf(OutBuf& b, const char* aFmt, ...)
+{
+	char tmp[256];
+	va_list args;
+	va_start(args, aFmt);
+	int len = vsnprintf(tmp, sizeof(tmp), aFmt, args);
+	va_end(args);
+	outstr(b, tmp, len);
+}
+
+// "0x%02x, " without going through printf
+static void outhex(OutBuf& b, int aValue)
+{
+	static const char hex[] = "0123456789abcdef";
+	outreserve(b, 6);
+	char* p = b.mData + b.mLen;
+	p[0] = '0';
+	p[1] = 'x';
+	p[2] = hex[(aValue >> 4) & 15];
+	p[3] = hex[aValue & 15];
+	p[4] = ',';
+	p[5] = ' ';
+	b.mLen += 6;
+}
+
+static int color9(const unsigned char* aPixel)
+{
+	return aPixel[0] | (aPixel[1] << 3) | (aPixel[2] << 6);
+}
+
+// Palette entry as the Next stores it, RRRGGGBB in the top 8 bits.
+static int nextcolor9(const unsigned char* aPixel)
+{
+	return (aPixel[0] << 6) | (aPixel[1] << 3) | aPixel[2];
+}
+
+// Load the image and build its 9-bit color histogram.
+static void loadsheet(Sheet& s)
+{
+	int n;
+	s.mData = stbi_load(s.mIn, &s.mX, &s.mY, &n, 4);
+	if (!s.mData)
 	{
-		printf("Unable to read \"%s\"\n", pars[1]);
-		return -1;
+		s.mError = "Unable to read image";
+		return;
 	}
-	if ((x & 15) || (y & 15))
+	if ((s.mX & 15) || (s.mY & 15))
 	{
-		printf("Image resolution (%dx%d) not divisible by 16\n", x, y);
-		return -1;
+		s.mError = "Image resolution not divisible by 16";
+		return;
 	}
-	printf("%d rows, %d columns - total %d sprites\n", y >> 4, x >> 4, (y >> 4) * (x >> 4));
 
 	// Reduce color space to 3 bits (8 levels) each
-	for (int i = 0; i < x * y * 4; i++)
-		data[i] >>= 5;
+	for (int i = 0; i < s.mX * s.mY * 4; i++)
+		s.mData[i] >>= 5;
 
-	int colors[512];
 	for (int i = 0; i < 512; i++)
-		colors[i] = 0;
-	for (int i = 0; i < x * y; i++)
-		colors[(data[i * 4 + 0]) | (data[i * 4 + 1] << 3) | (data[i * 4 + 2] << 6)] = 1;
+		s.mColors[i] = 0;
+	for (int i = 0; i < s.mX * s.mY; i++)
+		s.mColors[color9(s.mData + i * 4)]++;
+	s.mUnique = 0;
+	for (int i = 0; i < 512; i++)
+		if (s.mColors[i])
+			s.mUnique++;
+}
+
+// Quantize a 9-bit histogram to at most gPalwid colors. aMap receives the
+// palette index for each of the 512 colors present in the histogram.
+// Quantizing the histogram instead of every pixel keeps the quantizer's
+// work at (at most) 512 entries.
+static int quantize(const int* aColors, unsigned char* aMap, unsigned char** aPalette)
+{
 	int colorcount = 0;
+	int entry[512];
+	unsigned char histcolor[512 * 3];
+	int histcount[512];
 	for (int i = 0; i < 512; i++)
-		if (colors[i])
+	{
+		entry[i] = colorcount;
+		if (aColors[i])
+		{
+			histcolor[colorcount * 3 + 0] = i & 7;
+			histcolor[colorcount * 3 + 1] = (i >> 3) & 7;
+			histcolor[colorcount * 3 + 2] = i >> 6;
+			// Unweighted, which is what quantizing per pixel did
+			// (duplicates were merged before cutting).
+			histcount[colorcount] = 1;
 			colorcount++;
+		}
+	}
+	unsigned char* histidx;
+	int count = sq_reduce_histogram(histcolor, histcount, colorcount, 3, &histidx, aPalette, gPalwid);
+	for (int i = 0; i < 512; i++)
+		aMap[i] = aColors[i] ? histidx[entry[i]] : 0;
+	free(histidx);
+	return count;
+}
+
+// Swap palette index aKeyidx with the transparent index.
+static void swaptransparent(unsigned char* aPalette, int aKeyidx)
+{
+	for (int c = 0; c < 3; c++)
+	{
+		int t = aPalette[aKeyidx * 3 + c];
+		aPalette[aKeyidx * 3 + c] = aPalette[gTransparent * 3 + c];
+		aPalette[gTransparent * 3 + c] = t;
+	}
+}
 
-	printf("Found %d unique colors, ", colorcount);
-	SQ* q;
-	unsigned char* idxmap;
-	unsigned char* palette;
-	int transparent_index = 0xff;
-	q = sq_alloc();
-	sq_addcolormap(q, data, x * y, 4);
-	int count =	sq_reduce(q, &idxmap, &palette, NULL, 256);
-	printf("%d total colors after quantization\n", count);
-	printf("Top left color (%d, %d, %d) index %d\n", data[0], data[1], data[2], idxmap[0]);
-	int keyidx = idxmap[0];
-	if (keyidx != transparent_index)
-	{
-		printf("Remapping %d to %d\n", idxmap[0], transparent_index);
-		for (int i = 0; i < x * y; i++)
+// Map pixels through aMap, with aKeyidx and the transparent index swapped.
+static void mapsheet(Sheet& s, const unsigned char* aMap, int aKeyidx)
+{
+	unsigned char map[512];
+	for (int i = 0; i < 512; i++)
+	{
+		map[i] = aMap[i];
+		if (aKeyidx != gTransparent)
 		{
-			if (idxmap[i] == transparent_index)
-			{
-				idxmap[i] = keyidx;
-			}
-			else			
-			if (idxmap[i] == keyidx)
-			{
-				idxmap[i] = transparent_index;
-			}
+			if (map[i] == gTransparent)
+				map[i] = aKeyidx;
+			else
+			if (map[i] == aKeyidx)
+				map[i] = gTransparent;
 		}
-		int r = palette[keyidx * 3 + 0];
-		int g = palette[keyidx * 3 + 1];
-		int b = palette[keyidx * 3 + 2];
-		palette[keyidx * 3 + 0] = palette[transparent_index * 3 + 0];
-		palette[keyidx * 3 + 1] = palette[transparent_index * 3 + 1];
-		palette[keyidx * 3 + 2] = palette[transparent_index * 3 + 2];
-		palette[transparent_index * 3 + 0] = r;
-		palette[transparent_index * 3 + 1] = g;
-		palette[transparent_index * 3 + 2] = b;
-	}
-
-	FILE* f = fopen(pars[2], "wb");
+	}
+	s.mIdxmap = (unsigned char*)malloc(s.mX * s.mY);
+	for (int i = 0; i < s.mX * s.mY; i++)
+		s.mIdxmap[i] = map[color9(s.mData + i * 4)];
+}
+
+static int writefile(const char* aFilename, const OutBuf& b)
+{
+	FILE* f = fopen(aFilename, "wb");
 	if (!f)
+		return 0;
+	int ok = fwrite(b.mData, 1, b.mLen, f) == (size_t)b.mLen;
+	fclose(f);
+	return ok;
+}
+
+// Sprite patterns in sprite order, 256 bytes each (128 when 4-bit, two
+// pixels per byte with the left one in the high nibble), which is the
+// order the sprite pattern port takes them in.
+static void outpatterns(OutBuf& b, const Sheet& s)
+{
+	outreserve(b, s.mX * s.mY);
+	unsigned char* d = (unsigned char*)b.mData + b.mLen;
+	for (int row = 0; row < (s.mY >> 4); row++)
 	{
-		printf("Unable to open %s\n", pars[2]);
-		return -1;
+		for (int col = 0; col < (s.mX >> 4); col++)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				const unsigned char* p = s.mIdxmap + (row * 16 + i) * s.mX + col * 16;
+				if (gFourbit)
+				{
+					for (int j = 0; j < 16; j += 2)
+						*d++ = (p[j] << 4) | p[j + 1];
+				}
+				else
+				{
+					memcpy(d, p, 16);
+					d += 16;
+				}
+			}
+		}
 	}
-	printf("Outputting palette..\n");
+	b.mLen = (int)((char*)d - b.mData);
+}
+
+// 9-bit palette, two bytes per entry (RRRGGGBB, 0000000B), always 256 entries.
+static void outnxp(OutBuf& b, const Sheet& s)
+{
+	outreserve(b, 512);
 	for (int i = 0; i < 256; i++)
 	{
-		int c = (palette[i * 3 + 0] << 0) | (palette[i * 3 + 1] << 3) | (palette[i * 3 + 2] << 6);
-		fprintf(f, "0x%02x, 0x%02x, // palette index %3d, (%d, %d, %d)\n", c >> 1, c & 1, i, palette[i * 3 + 0], palette[i * 3 + 1], palette[i * 3 + 2]);
+		int c = (i < gPalwid) ? nextcolor9(s.mPalette + i * 3) : 0;
+		b.mData[b.mLen++] = (char)(c >> 1);
+		b.mData[b.mLen++] = (char)(c & 1);
+	}
+}
+
+static void writesheet(Sheet& s)
+{
+	OutBuf b = { 0, 0, 0 };
+	if (gBinary)
+	{
+		outpatterns(b, s);
 	}
-	printf("Outputting sprites..\n");
-	for (int row = 0, sprite = 0; row < (y >> 4); row++)
+	else
 	{
-		for (int col = 0; col < (x >> 4); col++, sprite++)
+		outreserve(b, gPalwid * 48 + (s.mX * s.mY) * 6 + (s.mX * s.mY / 256) * 32);
+		for (int i = 0; i < gPalwid; i++)
 		{
-			fprintf(f, "// Sprite %d\n", sprite);
-			for (int i = 0; i < 16; i++)
+			int c = nextcolor9(s.mPalette + i * 3);
+			outf(b, "0x%02x, 0x%02x, // palette index %3d, (%d, %d, %d)\n", c >> 1, c & 1, i, s.mPalette[i * 3 + 0], s.mPalette[i * 3 + 1], s.mPalette[i * 3 + 2]);
+		}
+		int rowbytes = gFourbit ? 8 : 16;
+		for (int row = 0, sprite = 0; row < (s.mY >> 4); row++)
+		{
+			for (int col = 0; col < (s.mX >> 4); col++, sprite++)
 			{
-				for (int j = 0; j < 16; j++)
+				outf(b, "// Sprite %d\n", sprite);
+				for (int i = 0; i < 16; i++)
 				{
-					fprintf(f, "0x%02x, ", idxmap[(row * 16 + i) * x + (col * 16 + j)]);
+					const unsigned char* p = s.mIdxmap + (row * 16 + i) * s.mX + col * 16;
+					for (int j = 0; j < rowbytes; j++)
+						outhex(b, gFourbit ? ((p[j * 2] << 4) | p[j * 2 + 1]) : p[j]);
+					outstr(b, "\n", 1);
 				}
-				fprintf(f, "\n");
 			}
 		}
 	}
+	if (!writefile(s.mOut, b))
+		s.mError = "Unable to write output file";
+	if (gNxp && !s.mError)
+	{
+		b.mLen = 0;
+		outnxp(b, s);
+		if (!writefile(s.mNxpOut, b))
+			s.mError = "Unable to write palette file";
+	}
+	free(b.mData);
+}
 
-	fclose(f);
+static void freesheet(Sheet& s)
+{
+	if (s.mData)
+		stbi_image_free(s.mData);
+	free(s.mIdxmap);
+	s.mData = 0;
+	s.mIdxmap = 0;
+}
+
+// Run aFunc on every sheet without an error, handing them out one at a time.
+template <typename T>
+static void runpool(std::vector<Sheet>& aSheets, int aThreads, T aFunc)
+{
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> pool;
+	for (int i = 0; i < aThreads; i++)
+	{
+		pool.emplace_back([&]() {
+			size_t n;
+			while ((n = next++) < aSheets.size())
+				if (!aSheets[n].mError)
+					aFunc(aSheets[n]);
+		});
+	}
+	for (auto& t : pool)
+		t.join();
+}
+
+// .nxp name: the output name with its extension replaced
+static void nxpname(Sheet& s)
+{
+	int len = (int)strlen(s.mOut);
+	const char* dot = strrchr(s.mOut, '.');
+	if (dot && !strpbrk(dot, "/\\"))
+		len = (int)(dot - s.mOut);
+	snprintf(s.mNxpOut, sizeof(s.mNxpOut), "%.*s.nxp", len, s.mOut);
+}
+
+// Output name for batch mode: outdir/basename.h (.spr when binary)
+static void outname(Sheet& s, const char* aOutdir)
+{
+	const char* base = s.mIn;
+	for (const char* p = s.mIn; *p; p++)
+		if (*p == '/' || *p == '\\')
+			base = p + 1;
+	int len = (int)strlen(base);
+	const char* dot = strrchr(base, '.');
+	if (dot)
+		len = (int)(dot - base);
+	snprintf(s.mOut, sizeof(s.mOut), "%s/%.*s.%s", aOutdir, len, base, gBinary ? "spr" : "h");
+	nxpname(s);
+}
+
+// Output format switches, valid in both modes
+static int outoption(const char* aOpt)
+{
+	if (strcmp(aOpt, "-4bit") == 0)
+	{
+		gFourbit = 1;
+		gPalwid = 16;
+		gTransparent = 0x0f;
+	}
+	else
+	if (strcmp(aOpt, "-bin") == 0)
+		gBinary = 1;
+	else
+	if (strcmp(aOpt, "-nxp") == 0)
+		gNxp = 1;
+	else
+		return 0;
+	return 1;
+}
+
+static int batch(int parc, char** pars)
+{
+	int shared = 0;
+	int threads = (int)std::thread::hardware_concurrency();
+	const char* outdir = ".";
+	std::vector<Sheet> sheets;
+	for (int i = 2; i < parc; i++)
+	{
+		if (outoption(pars[i]))
+			continue;
+		if (strcmp(pars[i], "-shared") == 0)
+			shared = 1;
+		else
+		if (strcmp(pars[i], "-j") == 0 && i + 1 < parc)
+			threads = atoi(pars[++i]);
+		else
+		if (strcmp(pars[i], "-o") == 0 && i + 1 < parc)
+			outdir = pars[++i];
+		else
+		{
+			Sheet s;
+			memset(&s, 0, sizeof(s));
+			s.mIn = pars[i];
+			sheets.push_back(s);
+		}
+	}
+	if (sheets.empty())
+	{
+		printf("No input files\n");
+		return -1;
+	}
+	// names depend on the format switches, which may come after inputs
+	for (auto& s : sheets)
+		outname(s, outdir);
+	if (threads < 1)
+		threads = 1;
+	if (threads > (int)sheets.size())
+		threads = (int)sheets.size();
+
+	if (shared)
+	{
+		// Decode all sheets, quantize the union of their colors once, then
+		// map and write each sheet with the one palette. The first sheet's
+		// top left color becomes the transparent index.
+		runpool(sheets, threads, loadsheet);
+		int colors[512];
+		for (int i = 0; i < 512; i++)
+			colors[i] = 0;
+		Sheet* first = 0;
+		for (auto& s : sheets)
+		{
+			if (s.mError)
+				continue;
+			if (!first)
+				first = &s;
+			for (int i = 0; i < 512; i++)
+				colors[i] += s.mColors[i];
+		}
+		if (!first)
+		{
+			printf("No usable input files\n");
+			return -1;
+		}
+		unsigned char map[512];
+		unsigned char* palette;
+		int unique = 0;
+		for (int i = 0; i < 512; i++)
+			if (colors[i])
+				unique++;
+		int count = quantize(colors, map, &palette);
+		int keyidx = map[color9(first->mData)];
+		if (keyidx != gTransparent)
+			swaptransparent(palette, keyidx);
+		printf("Shared palette: %d unique colors, %d total colors after quantization\n", unique, count);
+		for (auto& s : sheets)
+		{
+			s.mPalette = palette;
+			s.mCount = count;
+			s.mKeyidx = keyidx;
+		}
+		runpool(sheets, threads, [&](Sheet& s) {
+			mapsheet(s, map, keyidx);
+			writesheet(s);
+			freesheet(s);
+		});
+		free(palette);
+	}
+	else
+	{
+		runpool(sheets, threads, [](Sheet& s) {
+			loadsheet(s);
+			if (s.mError)
+				return;
+			unsigned char map[512];
+			s.mCount = quantize(s.mColors, map, &s.mPalette);
+			s.mKeyidx = map[color9(s.mData)];
+			if (s.mKeyidx != gTransparent)
+				swaptransparent(s.mPalette, s.mKeyidx);
+			mapsheet(s, map, s.mKeyidx);
+			writesheet(s);
+			freesheet(s);
+			free(s.mPalette);
+		});
+	}
+
+	int fails = 0;
+	for (auto& s : sheets)
+	{
+		if (s.mError)
+		{
+			printf("%s: %s\n", s.mIn, s.mError);
+			freesheet(s);
+			fails++;
+		}
+		else
+		{
+			printf("%s -> %s: %d sprites, %d unique colors, %d colors\n", s.mIn, s.mOut, (s.mY >> 4) * (s.mX >> 4), s.mUnique, s.mCount);
+		}
+	}
+	printf("%d sheets, %d failed\n", (int)sheets.size(), fails);
+	return fails ? -1 : 0;
+}
+
+int main(int parc, char** pars)
+{
+	if (parc > 1 && strcmp(pars[1], "-batch") == 0)
+		return batch(parc, pars);
+	const char* infile = 0;
+	const char* outfile = 0;
+	for (int i = 1; i < parc; i++)
+	{
+		if (outoption(pars[i]))
+			continue;
+		if (!infile)
+			infile = pars[i];
+		else
+			outfile = pars[i];
+	}
+	if (!outfile)
+	{
+		printf("Usage: [options] inputfile outputfile\n");
+		printf("   or: -batch [options] [-shared] [-j threads] [-o outdir] inputfile [inputfile..]\n");
+		printf("Options:\n");
+		printf("   -4bit  16 color sprites, two pixels per byte\n");
+		printf("   -bin   write raw sprite patterns instead of C source\n");
+		printf("   -nxp   also write the palette as a 512 byte .nxp next to the output\n");
+		return -1;
+	}
+
+	Sheet s;
+	memset(&s, 0, sizeof(s));
+	s.mIn = infile;
+	snprintf(s.mOut, sizeof(s.mOut), "%s", outfile);
+	nxpname(s);
+	loadsheet(s);
+	if (!s.mData)
+	{
+		printf("Unable to read \"%s\"\n", infile);
+		return -1;
+	}
+	if (s.mError)
+	{
+		printf("Image resolution (%dx%d) not divisible by 16\n", s.mX, s.mY);
+		return -1;
+	}
+	printf("%d rows, %d columns - total %d sprites\n", s.mY >> 4, s.mX >> 4, (s.mY >> 4) * (s.mX >> 4));
+
+	printf("Found %d unique colors, ", s.mUnique);
+	unsigned char map[512];
+	s.mCount = quantize(s.mColors, map, &s.mPalette);
+	printf("%d total colors after quantization\n", s.mCount);
+	int keyidx = map[color9(s.mData)];
+	printf("Top left color (%d, %d, %d) index %d\n", s.mData[0], s.mData[1], s.mData[2], keyidx);
+	if (keyidx != gTransparent)
+	{
+		printf("Remapping %d to %d\n", keyidx, gTransparent);
+		swaptransparent(s.mPalette, keyidx);
+	}
+	mapsheet(s, map, keyidx);
+
+	printf("Outputting palette and sprites..\n");
+	writesheet(s);
+	if (s.mError)
+	{
+		printf("%s\n", s.mError);
+		return -1;
+	}
 
-	free(idxmap);
-	free(palette);
+	freesheet(s);
+	free(s.mPalette);
 
 	printf("All done\n");
 
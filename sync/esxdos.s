@@ -103,7 +103,7 @@ _fseek::
 	ld	d,  6 (ix)
 	ld  hl, #0     ; just seek_set (for now)
     rst     #0x8
-    .db     #0x9d
+    .db     #0x9f  ; f_seek
 	pop	ix
 	ret
 
@@ -26,8 +26,8 @@ extern void setupuart(unsigned char rateindex) __z88dk_fastcall;
 extern unsigned short receive(char *b);
 extern char checksum(char *dp, unsigned short len);
 
-extern void memcpy(char *dest, const char *source, unsigned short count);
-extern void memset(char *a, char b, unsigned short l);
+extern void dma_memcpy(char *dest, const char *source, unsigned short count);
+extern void dma_memset(char *dest, const short value, unsigned short count);
 extern void print(char * t);
 extern unsigned short framecounter;
 extern char *cmdline;
@@ -58,7 +58,7 @@ void scrollup()
         unsigned char* dst = (unsigned char*)yofs[i];
         for (j = 0; j < 8; j++)
         {
-            memcpy(dst, src, 32);
+            dma_memcpy(dst, src, 32);
             src += 256;
             dst += 256;
         }
@@ -68,7 +68,7 @@ void scrollup()
         unsigned char* dst = (unsigned char*)yofs[i];
         for (j = 0; j < 8; j++)
         {
-            memset(dst, 0, 32);
+            dma_memset(dst, 0, 32);
             dst += 256;
         }
     }
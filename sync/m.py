@@ -36,6 +36,8 @@ src = [
     "std.s",
 	"esxdos.s",
 	"uart.s",
+	"zunpack.s",
+	"../common/dma.s",
 	"gfx.c",
 	"nextsync.c"
 	]
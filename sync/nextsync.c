@@ -12,6 +12,10 @@ extern const unsigned char fona_png[];
 #define TIMEOUT 20000
 #define TIMEOUT_FLUSHUART 10000
 
+// NextSync5 window buffer; held packets plus one burst must fit
+#define WINDOW_BUFSIZE (3 * (1024 + 5))
+#define WINDOW_MAX 8 // packets, one bit each in the ack mask
+
 #define SETX(x) scr_x = (x)
 #define SETY(y) scr_y = (y)
 
@@ -26,6 +30,7 @@ extern unsigned char fopen(unsigned char *fn, unsigned char mode);
 extern void fclose(unsigned char handle);
 extern unsigned short fread(unsigned char handle, unsigned char* buf, unsigned short bytes);
 extern void fwrite(unsigned char handle, unsigned char* buf, unsigned short bytes);
+extern void fseek(unsigned char handle, unsigned long ofs);
 extern void makepath(char *pathspec); // must be 0xff terminated!
 extern void conprint(char *txt) __z88dk_fastcall;
 
@@ -39,9 +44,22 @@ __sfr __banked __at 0x143b UART_RX;
 __sfr __banked __at 0x153b UART_CTL;
 
 extern unsigned short receive(char *b);
+extern unsigned short receiveupto(char *b, unsigned short max);
 extern char checksum(char *dp, unsigned short len);
-
-extern void memcpy(char *dest, const char *source, unsigned short count);
+extern unsigned short checksumrun(char *dp, unsigned short len, unsigned short sum);
+
+extern void dma_init();
+extern void dma_memcpy(char *dest, const char *source, unsigned short count);
+extern void dma_memset(char *dest, const short value, unsigned short count);
+extern unsigned short zunpack(unsigned short len, unsigned char *dp, unsigned char *scratch, unsigned char filehandle);
+
+// zunpack state, kept between calls so packed data can span packets.
+// It unpacks through a 1K ring in scratch and writes it out when full.
+// With len 0 it only finishes a match left over from the last call.
+unsigned char unpackstate;
+signed short unpacksize;
+unsigned short unpackd;
+unsigned short unpackoffset;
 extern unsigned short mulby10(unsigned short input) __z88dk_fastcall;
 
 extern unsigned short framecounter;
@@ -120,16 +138,6 @@ char memcmp(char *a, char *b, unsigned short l)
     return 0;
 }
 
-void memset(char *a, char b, unsigned short l)
-{
-    unsigned short i = 0;
-    while (i < l)
-    {
-        a[i] = b;
-        i++;
-    }
-}
-
 extern void drawchar(unsigned char c);
 
 extern void scrollup();
@@ -237,7 +245,8 @@ extern unsigned char strinstr(char *a, char *b, unsigned short len, char blen);
 // [at]"AT+CIPSENDEX=5\r\r\n\r\nOK\r\n> "
 // [s]"Sync3"
 // [bi]"\r\nRecv 5 bytes\r\n\r\nSEND OK\r\n\r\n+IPD,14:\0\x0eNextSync33\x0a\0"
-unsigned short bufinput(char *buf)
+// Reads one +IPD into buf, at most max bytes.
+unsigned short bufinput(char *buf, unsigned short max)
 {
     unsigned short timeout = TIMEOUT;
     unsigned short datalen = 0;
@@ -259,10 +268,10 @@ unsigned short bufinput(char *buf)
         if (r != ':' && (r < '0' || r > '9')) return 0;
     }
 
-    if (datalen > 2048 || datalen == 0) return 0;
+    if (datalen > max || datalen == 0) return 0;
     do
     {
-        ofs += receive(buf + ofs);
+        ofs += receiveupto(buf + ofs, datalen - ofs);
         timeout--;
     }
     while (timeout && ofs < datalen);
@@ -303,25 +312,35 @@ retryatcmd:
 }
 
 // max cmdlen = 9
-void cipxfer(char *cmd, unsigned char cmdlen, unsigned char *output, unsigned short *len, unsigned char **dataptr)
-{    
+unsigned char cipsend(char *cmd, unsigned char cmdlen, unsigned char *output)
+{
     const char *cipsendcmd_c="AT+CIPSENDEX=0\r\n";
     char *cipsendcmd = (char *)cipsendcmd_c;
+    cipsendcmd[13] = '0' + cmdlen;
+    if (atcmd(cipsendcmd, ">", 1, output)) // cipsend prompt
+    {
+        return 1;
+    }
+    flush_uart();
+    send(cmd, cmdlen);
+    return 0;
+}
+
+// max cmdlen = 9
+void cipxfer(char *cmd, unsigned char cmdlen, unsigned char *output, unsigned short *len, unsigned char **dataptr)
+{    
     unsigned short received, expected;
     unsigned short timeout = 5; // relatively small timeout needed because bufinput has timeout
-    cipsendcmd[13] = '0' + cmdlen;
     *len = 0;
-    if (atcmd(cipsendcmd, ">", 1, output)) // cipsend prompt
+    if (cipsend(cmd, cmdlen, output))
     {
         return;
     }
-    flush_uart();
     expected = 2; // always expect at least 2 bytes. Actually, we should expect at least 5.. size+checksums
     received = 0;
-    send(cmd, cmdlen);
     do 
     {
-        unsigned short r = bufinput(output + received);
+        unsigned short r = bufinput(output + received, 2048 - received);
         received += r;
         if (expected == 2 && received > 2)
         {
@@ -338,6 +357,26 @@ void cipxfer(char *cmd, unsigned char cmdlen, unsigned char *output, unsigned sh
     *len = received - 2; // reduce size bytes    
 }
 
+// Sends cmd and reads the reply stream into buf (room for max bytes)
+// until expected bytes have arrived or the esp goes quiet. The stream
+// may hold several packets; returns its length.
+unsigned short cipburst(char *cmd, unsigned char cmdlen, unsigned char *output, unsigned char *buf, unsigned short expected, unsigned short max)
+{
+    unsigned short received = 0;
+    unsigned short timeout = 5 + (expected >> 9); // the esp splits the stream into several +IPDs
+    if (cipsend(cmd, cmdlen, output))
+    {
+        return 0;
+    }
+    do
+    {
+        received += bufinput(buf + received, max - received);
+        timeout--;
+    }
+    while (timeout && received < expected);
+    return received;
+}
+
 #ifndef SYNCSLOW
 char gofast(char *inbuf)
 {
@@ -451,6 +490,228 @@ failure:
     return 1;
 }
 
+static const char hexdigit[] = "0123456789abcdef";
+
+// NextSync5 transfer. Each "Ack" says which packets the window of count
+// packets from base still needs; the server sends them back to back.
+// In-order packets get written, the ones after a gap are held in winbuf
+// until the gap is filled, so only the lost packets are resent.
+// If packedlen isn't 0, that many bytes of zunpack data come instead
+// and get unpacked through unpackbuf, or with delta set, they're
+// [block number, 2 bytes big endian][1K block] records that get
+// patched into the existing file. That file must be baselen bytes with
+// a checksum of basesum, or it isn't what the server last sent. Returns
+// 2 if there's no such file to patch.
+char transfer5(char *fn, unsigned long filelen, unsigned long packedlen, unsigned char delta, unsigned long baselen, unsigned short basesum, unsigned short payload, unsigned char window, unsigned char *inbuf, unsigned char *winbuf, unsigned char *unpackbuf)
+{
+    unsigned short slotofs[WINDOW_MAX]; // payload of window packet i in winbuf
+    unsigned short slotlen[WINDOW_MAX];
+    char ack[8];
+    unsigned long left = packedlen ? packedlen : filelen;
+    unsigned long received = 0;
+    unsigned short used = 0; // winbuf bytes taken by held packets
+    unsigned short expected;
+    unsigned short got;
+    unsigned short ofs;
+    unsigned short sz;
+    unsigned char have = 0; // bit i: packet base + i is held
+    unsigned char base = 0; // packet number of window slot 0
+    unsigned char count;
+    unsigned char failcount = 0;
+    unsigned char filehandle;
+    unsigned char i;
+    unsigned char next;
+    unsigned char *bp;
+    unsigned short bleft;
+    unsigned short block = 0;
+    unsigned short blockleft = 0; // bytes of the block being patched
+    unsigned char blockhdr = 0; // bytes of the block number read
+    unsigned long blockofs;
+    unsigned short sum = 0;
+
+    if (delta)
+    {
+        filehandle = fopen(fn, 3); // read + write + open existing
+        if (filehandle == 0)
+            return 2;
+        // Edited here, or another card: the blocks would go over the
+        // wrong file, so ask for all of it. unpackbuf is free with deltas.
+        blockofs = 0; // counts the file size first
+        while ((sz = fread(filehandle, unpackbuf, 1024)) != 0)
+        {
+            sum = checksumrun(unpackbuf, sz, sum);
+            blockofs += sz;
+        }
+        if (blockofs != baselen || sum != basesum)
+        {
+            fclose(filehandle);
+            return 2;
+        }
+    }
+    else
+    {
+        filehandle = createfilewithpath(fn);
+    }
+    if (filehandle == 0)
+    {
+        print("Unable to open file");
+        return 0;
+    }
+
+    unpackstate = 0;
+    unpacksize = 0;
+    unpackd = 0;
+    ack[0] = 'A';
+    ack[1] = 'c';
+    ack[2] = 'k';
+    while (left)
+    {
+        // Window packets still to come and the bytes we're missing of them
+        {
+            unsigned long l = left;
+            count = 0;
+            expected = 0;
+            while (count < window && l)
+            {
+                sz = l > payload ? payload : (unsigned short)l;
+                if (!(have & (1 << count)))
+                    expected += sz + 5;
+                l -= sz;
+                count++;
+            }
+        }
+        ack[3] = hexdigit[base >> 4];
+        ack[4] = hexdigit[base & 15];
+        ack[5] = hexdigit[have >> 4];
+        ack[6] = hexdigit[have & 15];
+        ack[7] = hexdigit[count];
+        got = used + cipburst(ack, 8, inbuf, winbuf + used, expected, WINDOW_BUFSIZE - used);
+
+        // [2 bytes size][packet number][payload][checksums, 2 bytes]
+        ofs = used;
+        while (ofs + 5 <= got)
+        {
+            sz = (winbuf[ofs] << 8) | winbuf[ofs + 1];
+            if (sz < 5 || sz > payload + 5 || ofs + sz > got)
+                break; // lost sync, the rest gets asked again
+            i = winbuf[ofs + 2] - base;
+            if (checksum(winbuf + ofs + 2, sz - 4) == 0 && i < count && !(have & (1 << i)))
+            {
+                slotofs[i] = ofs + 3;
+                slotlen[i] = sz - 5;
+                have |= 1 << i;
+            }
+            ofs += sz;
+        }
+
+        if (have & 1)
+        {
+            failcount = 0;
+        }
+        else
+        {
+            failcount++;
+            if (failcount > 5) goto failure;
+            flush_uart_hard();
+        }
+
+        while (have & 1)
+        {
+            if (delta)
+            {
+                bp = winbuf + slotofs[0];
+                bleft = slotlen[0];
+                while (bleft)
+                {
+                    if (!blockleft)
+                    {
+                        block = (block << 8) | *bp;
+                        bp++;
+                        bleft--;
+                        blockhdr++;
+                        if (blockhdr == 2)
+                        {
+                            blockhdr = 0;
+                            blockofs = (unsigned long)block << 10;
+                            fseek(filehandle, blockofs);
+                            blockleft = 1024;
+                            if (filelen - blockofs < 1024)
+                                blockleft = filelen - blockofs;
+                        }
+                        continue;
+                    }
+                    sz = bleft < blockleft ? bleft : blockleft;
+                    fwrite(filehandle, bp, sz);
+                    bp += sz;
+                    bleft -= sz;
+                    blockleft -= sz;
+                    received += sz;
+                }
+            }
+            else if (packedlen)
+            {
+                received += zunpack(slotlen[0], winbuf + slotofs[0], unpackbuf, filehandle);
+            }
+            else
+            {
+                fwrite(filehandle, winbuf + slotofs[0], slotlen[0]);
+                received += slotlen[0];
+            }
+            left -= slotlen[0];
+            for (i = 1; i < WINDOW_MAX; i++)
+            {
+                slotofs[i - 1] = slotofs[i];
+                slotlen[i - 1] = slotlen[i];
+            }
+            have >>= 1;
+            base++;
+        }
+        SETX(5);
+        printnum(received);
+        SETY(scr_y -1);
+
+        // Move the held packets to the start of winbuf, lowest first
+        used = 0;
+        do
+        {
+            next = WINDOW_MAX;
+            for (i = 0; i < WINDOW_MAX; i++)
+                if ((have & (1 << i)) && slotofs[i] >= used && (next == WINDOW_MAX || slotofs[i] < slotofs[next]))
+                    next = i;
+            if (next != WINDOW_MAX)
+            {
+                dma_memcpy(winbuf + used, winbuf + slotofs[next], slotlen[next]);
+                slotofs[next] = used;
+                used += slotlen[next];
+            }
+        }
+        while (next != WINDOW_MAX);
+    }
+
+    if (packedlen && !delta)
+    {
+        // A match crossing the last 1K is still pending
+        received += zunpack(0, winbuf, unpackbuf, filehandle);
+        fwrite(filehandle, unpackbuf, unpackd);
+        received += unpackd;
+        SETX(5);
+        printnum(received);
+        SETY(scr_y -1);
+        if (received != filelen)
+        {
+            // Fail the sync so the server doesn't take the file as sent
+            print("Unpack error");
+            goto failure;
+        }
+    }
+
+    fclose(filehandle);
+    return 0;
+failure:
+    fclose(filehandle);
+    return 1;
+}
+
 void main()
 {                                 //1234567890123456789012
     const char *cipstart_prefix  = "AT+CIPSTART=\"TCP\",\"";
@@ -458,9 +719,15 @@ void main()
     const char *conffile         = "c:/sys/config/nextsync.cfg";
     char fn[256];
     char inbuf[2048];
-    char scratch[2048];
+    char scratch[WINDOW_BUFSIZE]; // also the NextSync5 window buffer
+    char unpackbuf[1024];
     unsigned char fnlen;
     unsigned long filelen;
+    unsigned long packedlen;
+    unsigned char delta;
+    unsigned long baselen = 0;
+    unsigned short basesum = 0;
+    char xferresult;
     unsigned char *dp;
     unsigned short len = 0;     
     unsigned char nextreg6;
@@ -468,6 +735,8 @@ void main()
     char fastuart = 0;
     char filehandle;
     char retrycount;
+    unsigned short payload;
+    unsigned char window = WINDOW_MAX; // 0 for the NextSync3 protocol
 
     len = parse_cmdline(fn);
 
@@ -522,10 +791,11 @@ void main()
     writenextreg(0x06, nextreg6 & 0x7d); // disable turbo key & 50/60 switch (leave other bits alone)
     nextreg7 = readnextreg(0x07);
     writenextreg(0x07, 3); // 28MHz
+    dma_init();
 
     // cls
-    memset((unsigned char*)yofs[0],0,192*32);
-    memset((unsigned char*)yofs[0]+192*32,4,24*32);
+    dma_memset((unsigned char*)yofs[0],0,192*32);
+    dma_memset((unsigned char*)yofs[0]+192*32,4,24*32);
           
     SETX(0);
     
@@ -579,9 +849,9 @@ retryconnect:
     retrycount = 10;
     while (retrycount && atcmd("AT+CIPCLOSE\r\n", "ERROR", 5, inbuf)) { retrycount--; }
 
-    memcpy(scratch, cipstart_prefix, 19);
-    memcpy(scratch+19, fn, len);
-    memcpy(scratch+19+len, cipstart_postfix, 9); // take care to copy the terminating zero
+    dma_memcpy(scratch, cipstart_prefix, 19);
+    dma_memcpy(scratch+19, fn, len);
+    dma_memcpy(scratch+19+len, cipstart_postfix, 9); // take care to copy the terminating zero
 
     if (atcmd(scratch, "OK", 2, inbuf))
     {
@@ -592,10 +862,23 @@ retryconnect:
     print("Handshake..");
     retrycount = 0;
 retryhandshake:
-    // Check server version/request protocol
-    cipxfer("Sync3", 5, inbuf, &len, &dp);
+    // Check server version/request protocol. Servers that don't know
+    // NextSync5 say "Error", so fall back to NextSync3 with them.
+    if (window)
+    {
+        cipxfer("Sync5", 5, inbuf, &len, &dp);
+        if (len == 5+3 && checksum(dp, len - 3) == 0 && memcmp(dp, "Error", 5) == 0)
+        {
+            window = 0;
+            goto retryhandshake;
+        }
+    }
+    else
+    {
+        cipxfer("Sync3", 5, inbuf, &len, &dp);
+    }
 
-    if (len < 9 || memcmp(dp, "NextSync3", 9) != 0)
+    if (window ? (len < 11+3 || memcmp(dp, "NextSync5", 9) != 0) : (len < 9 || memcmp(dp, "NextSync3", 9) != 0))
     {        
         retrycount++;
         if (retrycount < 5)
@@ -616,25 +899,69 @@ retryhandshake:
         goto closeconn;
     }
 
+    if (window)
+    {
+        // As many packets as fit in the window buffer
+        payload = (dp[9] << 8) | dp[10];
+        window = 0;
+        len = payload + 5;
+        while (window < WINDOW_MAX && len <= WINDOW_BUFSIZE)
+        {
+            window++;
+            len += payload + 5;
+        }
+    }
+
     print("Connected\n");
     
     do
     {        
 
-        cipxfer("Next", 4, inbuf, &len, &dp);
+        // NextSync5 servers may send the file packed, or just the changed
+        // blocks, if we ask with "Nextd"
+        if (window)
+            cipxfer("Nextd", 5, inbuf, &len, &dp);
+        else
+            cipxfer("Next", 4, inbuf, &len, &dp);
 retrynext:
         if (checksum(dp, len-3) == 0)
         {
             filelen = ((unsigned long)dp[0] << 24) | ((unsigned long)dp[1] << 16) | ((unsigned long)dp[2] << 8) | (unsigned long)dp[3];        
             fnlen = dp[4];
-            memcpy(fn, dp+5, fnlen);
+            dma_memcpy(fn, dp+5, fnlen);
             fn[fnlen] = 0;
+            packedlen = 0;
+            delta = 0;
+            if (window)
+            {
+                packedlen = ((unsigned long)dp[5+fnlen] << 24) | ((unsigned long)dp[6+fnlen] << 16) | ((unsigned long)dp[7+fnlen] << 8) | (unsigned long)dp[8+fnlen];
+                delta = dp[9+fnlen];
+                if (delta)
+                {
+                    baselen = ((unsigned long)dp[10+fnlen] << 24) | ((unsigned long)dp[11+fnlen] << 16) | ((unsigned long)dp[12+fnlen] << 8) | (unsigned long)dp[13+fnlen];
+                    basesum = (dp[14+fnlen] << 8) | dp[15+fnlen];
+                }
+            }
             if (*fn)
             {
                 print(fn);
                 print("Size:\nXfer:"); SETX(5); SETY(scr_y - 2);
                 printnum(filelen);
-                if (transfer(fn, inbuf))
+                if (window)
+                {
+                    xferresult = transfer5(fn, filelen, packedlen, delta, baselen, basesum, payload, window, inbuf, scratch, unpackbuf);
+                    if (xferresult == 2)
+                    {
+                        // Not on the next any more, or changed here, get all of it
+                        cipxfer("Full", 4, inbuf, &len, &dp);
+                        goto retrynext;
+                    }
+                }
+                else
+                {
+                    xferresult = transfer(fn, inbuf);
+                }
+                if (xferresult)
                 {
                     print("Lost connection.");
                     goto closeconn;
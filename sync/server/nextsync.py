@@ -7,12 +7,17 @@
 
 import random
 
+import collections
 import datetime
 import fnmatch
+import hashlib
+import itertools
+import json
+import multiprocessing
+import operator
 import socket
 import struct
 import time
-import glob
 import sys
 import os
 
@@ -20,10 +25,13 @@ assert sys.version_info >= (3, 6) # We need 3.6 for f"" strings.
 
 PORT = 2048    # Port to listen on (non-privileged ports are > 1023)
 VERSION3 = "NextSync3"
-VERSION = "NextSync4"
+VERSION5 = "NextSync5"
+VERSION = VERSION5
 IGNOREFILE = "syncignore.txt"
-SYNCPOINT = "syncpoint.dat"
+MANIFEST = "syncmanifest.dat"
+METRICS = "syncmetrics.jsonl"
 MAX_PAYLOAD = 1024
+BLOCKSIZE = 1024 # delta blocks
 
 # If you want to be really safe (but transfer slower), use this:
 #MAX_PAYLOAD = 256
@@ -34,50 +42,257 @@ MAX_PAYLOAD = 1024
 opt_drive = '/'
 opt_always_sync = False
 opt_sync_once = False
+opt_pack = True
+opt_delta = True
+opt_verbose = False
+opt_metrics = False
+opt_adaptive = False
 
-def update_syncpoint(knownfiles):
-    with open(SYNCPOINT, 'w') as f:
-        for x in knownfiles:
-            f.write(f"{x}\n")
-
-def agecheck(f):
-    if not os.path.isfile(SYNCPOINT):
-        return False
-    ptime = os.path.getmtime(SYNCPOINT)
-    mtime = os.path.getmtime(f)
-    if mtime > ptime:
-        return False
-    return True
-
-def getFileList():    
-    knownfiles = []
-    if os.path.isfile(SYNCPOINT):
-        with open(SYNCPOINT) as f:
-            knownfiles = f.read().splitlines()
+# Payload sizes the adaptive mode (-t) moves between
+PAYLOAD_STEPS = [256, 512, 1024, 1455]
+
+# Low overhead counters for the -m metrics file and the adaptive mode
+class Metrics:
+    RTT_BUCKETS = [5, 10, 20, 50, 100, 200, 500, 1000] # ms, last bucket is slower
+    RATE_WINDOW = 5 # seconds of history for the rolling kBps
+    ADAPT_PACKETS = 64 # packets between payload size decisions
+
+    def __init__(self):
+        self.rtt = [0] * (len(self.RTT_BUCKETS) + 1)
+        self.bypayload = {} # payload size: [packets, retries]
+        self.recent = collections.deque() # (time, bytes) sent lately
+        self.adapt = [] # 1 for each resent packet, 0 otherwise
+        self.answered = None
+        self.lastemit = time.time()
+
+    # Round trip: from our last reply to the next's next request
+    def request(self, now):
+        if self.answered is not None:
+            ms = (now - self.answered) * 1000
+            i = 0
+            while i < len(self.RTT_BUCKETS) and ms >= self.RTT_BUCKETS[i]:
+                i += 1
+            self.rtt[i] += 1
+
+    def reply(self, now, nbytes):
+        self.answered = now
+        if nbytes:
+            self.recent.append((now, nbytes))
+
+    def packet(self, payload, retry):
+        c = self.bypayload.setdefault(payload, [0, 0])
+        c[0] += 1
+        c[1] += retry
+        self.adapt.append(retry)
+
+    def kbps(self, now):
+        while self.recent and self.recent[0][0] < now - self.RATE_WINDOW:
+            self.recent.popleft()
+        return sum(x[1] for x in self.recent) / self.RATE_WINDOW / 1024
+
+    # Next payload size: down a step at 1/16 packets resent, up one when none were
+    def adaptpayload(self, payload):
+        if len(self.adapt) < self.ADAPT_PACKETS:
+            return payload
+        resent = sum(self.adapt)
+        self.adapt = []
+        i = PAYLOAD_STEPS.index(payload) if payload in PAYLOAD_STEPS else 2
+        if resent * 16 >= self.ADAPT_PACKETS and i > 0:
+            i -= 1
+        elif resent == 0 and i < len(PAYLOAD_STEPS) - 1:
+            i += 1
+        if PAYLOAD_STEPS[i] != payload:
+            print(f"{timestamp()} | {resent} of {self.ADAPT_PACKETS} packets resent, payload {payload} -> {PAYLOAD_STEPS[i]}")
+        return PAYLOAD_STEPS[i]
+
+    # One JSON line per second while connected, and one at disconnect
+    def emit(self, now, counters, final=False):
+        if not opt_metrics or (not final and now - self.lastemit < 1):
+            return
+        self.lastemit = now
+        line = dict(counters)
+        line.update({
+            "time": round(now, 3),
+            "final": final,
+            "kbps": round(self.kbps(now), 2),
+            "rtt_ms": dict(zip([f"<{x}" for x in self.RTT_BUCKETS] + [f">={self.RTT_BUCKETS[-1]}"], self.rtt)),
+            "payloads": {str(k): {"packets": v[0], "retries": v[1]} for k, v in sorted(self.bypayload.items())}})
+        with open(METRICS, 'a') as f:
+            f.write(json.dumps(line) + "\n")
+
+# The manifest remembers what the next has: for each file its size, mtime,
+# a hash per 1K block and the whole file's nextsum, as last sent. It also
+# caches the ignore list verdict for every path seen, so the patterns only
+# run on new paths.
+def loadmanifest():
+    manifest = {"ignore": [], "ignored": {}, "files": {}}
+    if os.path.isfile(MANIFEST):
+        try:
+            with open(MANIFEST) as f:
+                manifest.update(json.load(f))
+        except ValueError:
+            print(f"Warning: {MANIFEST} is broken, syncing all files.")
+    return manifest
+
+def savemanifest(manifest):
+    with open(MANIFEST + ".tmp", 'w') as f:
+        json.dump(manifest, f)
+    os.replace(MANIFEST + ".tmp", MANIFEST)
+
+def blockhashes(data):
+    return [hashlib.blake2b(data[i:i+BLOCKSIZE], digest_size=8).hexdigest() for i in range(0, len(data), BLOCKSIZE)]
+
+# The packet checksum over a whole file, checksumrun() on the next:
+# e ^= byte, d += e, as d << 8 | e. The next checks its copy against
+# this before patching a delta into it.
+def nextsum(data):
+    xors = list(itertools.accumulate(data, operator.xor))
+    if not xors:
+        return 0
+    return ((sum(xors) & 0xff) << 8) | xors[-1]
+
+# Walks the tree like glob("**") did, skipping dot names, but with one
+# listing per directory, which on Windows also carries the stats, and
+# without going into directories the ignore list covers completely
+# (a pattern ending in * that matches "dir/"). The verdicts for both are
+# cached in ignored.
+def scantree(top, ignorelist, ignored, seen, files):
+    with os.scandir(top or '.') as it:
+        for entry in it:
+            if entry.name.startswith('.'):
+                continue
+            g = os.path.join(top, entry.name) if top else entry.name
+            if g not in ignored:
+                ignored[g] = g == MANIFEST or g == METRICS or any(fnmatch.fnmatch(g, i) for i in ignorelist)
+            seen[g] = ignored[g]
+            if entry.is_dir():
+                d = g + os.sep
+                if d not in ignored:
+                    ignored[d] = any(i.endswith('*') and fnmatch.fnmatch(d, i) for i in ignorelist)
+                seen[d] = ignored[d]
+                if not ignored[d]:
+                    scantree(g, ignorelist, ignored, seen, files)
+            elif not ignored[g] and entry.is_file():
+                files.append((g, entry.stat()))
+
+# Files that may need syncing as [name, size, mtime, manifest entry or None].
+# Files whose size and mtime match the manifest are skipped unread. Every
+# file still gets its stat looked at: an edit in place only changes the
+# file's own mtime, not its directory's.
+def getFileList(manifest):    
     ignorelist = []
     if os.path.isfile(IGNOREFILE):
         with open(IGNOREFILE) as f:
             ignorelist = f.read().splitlines()
+    if manifest["ignore"] != ignorelist:
+        manifest["ignore"] = ignorelist
+        manifest["ignored"] = {}
+    ignored = manifest["ignored"]
+    seen = {} # drops paths that are gone
+    known = manifest["files"]
     r = []
-    gf = glob.glob("**", recursive=True)
-    for g in gf:
-        if os.path.isfile(g) and os.path.exists(g):
-            ignored = False
-            for i in ignorelist:
-                if fnmatch.fnmatch(g, i):
-                    ignored = True
-            if not opt_always_sync:
-                if g in knownfiles:
-                    if agecheck(g):
-                        ignored = True
-            if not ignored:
-                stats = os.stat(g)
-                r.append([g, stats.st_size])
+    files = []
+    scantree('', ignorelist, ignored, seen, files)
+    for g, stats in files:
+        old = None if opt_always_sync else known.get(g)
+        if old is not None and old[0] == stats.st_size and old[1] == stats.st_mtime:
+            continue
+        r.append([g, stats.st_size, stats.st_mtime, old])
+    manifest["ignored"] = seen
     return r
 
+# Packs data for zunpack.s on the next:
+# [11nnnnnn][n+1 literal bytes] or [length-4, 0..191][256-distance]
+# with matches of 4..195 bytes from up to 256 bytes back.
+def pack(data):
+    out = bytearray()
+    lit = bytearray()
+    chains = {}
+    n = len(data)
+    i = 0
+    def flushliterals():
+        for j in range(0, len(lit), 64):
+            run = lit[j:j+64]
+            out.append(0xc0 | (len(run) - 1))
+            out.extend(run)
+        lit.clear()
+    def remember(pos):
+        key = data[pos:pos+4]
+        c = chains.setdefault(key, [])
+        c.append(pos)
+        if len(c) > 64:
+            del c[:32]
+    while i < n:
+        best = 0
+        bestpos = 0
+        if i + 4 <= n:
+            limit = min(195, n - i)
+            for pos in reversed(chains.get(data[i:i+4], ())):
+                if pos < i - 256:
+                    break
+                l = 4
+                while l < limit and data[pos + l] == data[i + l]:
+                    l += 1
+                if l > best:
+                    best = l
+                    bestpos = pos
+                    if l == limit:
+                        break
+        if best:
+            flushliterals()
+            out.append(best - 4)
+            out.append(256 - (i - bestpos))
+            for j in range(i, min(i + best, n - 3)):
+                remember(j)
+            i += best
+        else:
+            lit.append(data[i])
+            if i + 4 <= n:
+                remember(i)
+            i += 1
+    flushliterals()
+    return bytes(out)
+
+# Runs in the worker pool: reads the file and works out how to send it.
+# Gives the data, its block hashes, the packed data if that's smaller,
+# the delta against the manifest entry if there is one, whether the
+# file is in fact unchanged (touched, but the same content) and its
+# nextsum.
+def loadfile(job):
+    fn, old, dopack, dodelta = job
+    with open(fn, 'rb') as srcfile:
+        filedata = srcfile.read()
+    hashes = blockhashes(filedata)
+    if old is not None and old[0] == len(filedata) and old[2] == hashes:
+        return filedata, hashes, None, None, True, old[3] if len(old) > 3 else nextsum(filedata)
+    packed = pack(filedata) if dopack else None
+    if packed is not None and len(packed) >= len(filedata):
+        packed = None
+    # [block number 2 bytes big endian][block] for the blocks that differ;
+    # the next can't truncate, so only for files that didn't shrink.
+    # Entries from before nextsums can't be checked on the next, so none.
+    delta = None
+    if dodelta and old is not None and len(old) > 3 and len(filedata) >= old[0] and len(hashes) <= 0x10000:
+        delta = b''.join(i.to_bytes(2, byteorder="big") + filedata[i*BLOCKSIZE:(i+1)*BLOCKSIZE]
+            for i in range(len(hashes)) if i >= len(old[2]) or old[2][i] != hashes[i])
+    return filedata, hashes, packed, delta, False, nextsum(filedata)
+
 def timestamp():
     return datetime.datetime.now().strftime("%Y-%m-%d %H:%M:%S")
 
+def packetchecksum(data):
+    checksum0 = 0
+    checksum1 = 0
+    for x in data:
+        checksum0 = (checksum0 ^ x) & 0xff
+        checksum1 = (checksum1 + checksum0) & 0xff
+    return checksum0.to_bytes(1, byteorder="big") + checksum1.to_bytes(1, byteorder="big")
+
+# NextSync5 data packet: packet number goes first so the checksum covers it
+def makepacket5(payload, packetno):
+    data = (packetno & 0xff).to_bytes(1, byteorder="big") + payload
+    return (len(payload)+5).to_bytes(2, byteorder="big") + data + packetchecksum(data)
+
 def sendpacket(conn, payload, packetno):
     checksum0 = 0 # random.choice([0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1]) # 5%
     checksum1 = 0
@@ -91,16 +306,17 @@ def sendpacket(conn, payload, packetno):
         + (checksum1 & 0xff).to_bytes(1, byteorder="big")
         + (packetno & 0xff).to_bytes(1, byteorder="big"))
     conn.sendall(packet)
-    print(f'{timestamp()} | Packet sent: {len(packet)} bytes, payload: {len(payload)} bytes, checksums: {checksum0}, {checksum1}, packetno: {packetno & 0xff}')
+    if opt_verbose:
+        print(f'{timestamp()} | Packet sent: {len(packet)} bytes, payload: {len(payload)} bytes, checksums: {checksum0}, {checksum1}, packetno: {packetno & 0xff}')
           
 def warnings():
     print()
     print(f"Note: Using {os.getcwd()} as sync root")
     if not os.path.isfile(IGNOREFILE):
         print(f"Warning! Ignore file {IGNOREFILE} not found in directory. All files will be synced, possibly including this file.")
-    if not os.path.isfile(SYNCPOINT):
-        print(f"Note: Sync point file {SYNCPOINT} not found, syncing all files regardless of timestamp.")
-    initial = getFileList()
+    if not os.path.isfile(MANIFEST):
+        print(f"Note: Manifest file {MANIFEST} not found, syncing all files.")
+    initial = getFileList(loadmanifest())
     total = 0
     for x in initial:
         total += x[1]
@@ -115,6 +331,7 @@ def warnings():
     print()
 
 def main():
+    global MAX_PAYLOAD
     print(f"NextSync server, protocol version {VERSION}")
     print("by Jari Komppa 2020")
     print()
@@ -138,6 +355,7 @@ def main():
 
     warnings()
     
+    metrics = Metrics() # kept across connections so the adaptive payload carries over
     working = True
     while working:
         print(f"{timestamp()} | NextSync listening to port {PORT}")
@@ -154,80 +372,171 @@ def main():
             conn, addr = s.accept()
             # Make sure *nixes close the socket when we ask it to.
             conn.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
-            f = getFileList()
+            manifest = loadmanifest()
+            f = getFileList(manifest)
             print(f'{timestamp()} | Sync file list has {len(f)} files.')
-            knownfiles = []
-            if os.path.isfile(SYNCPOINT):
-                with open(SYNCPOINT) as kf:
-                    knownfiles = kf.read().splitlines()
             fn = 0
             filedata = b''
+            loaded = None # loadfile results for f[loadedfrom] on
+            loadedfrom = 0
+            current = None # file being sent and its loadfile result
             packet = b''
             fileofs = 0
             totalbytes = 0
             packetno = 0
+            acked = 0 # NextSync5: packets the next has written
+            sent = 0  # NextSync5: packets sent at least once
+            payload = MAX_PAYLOAD # NextSync5: fixed when the next asks for "Sync5"
             starttime = time.time()
             endtime = starttime
-            with conn:                
+            with conn, multiprocessing.Pool() as pool:
                 print(f'{timestamp()} | Connected by {addr[0]} port {addr[1]}')
                 talking = True                
                 while talking:
+                    metrics.emit(time.time(), {"bytes": totalbytes, "payloadbytes": payloadbytes, "packets": packets,
+                        "retries": retries, "restarts": restarts, "gee": gee, "payload": MAX_PAYLOAD})
                     data = conn.recv(1024)
                     if not data:
                         break
-                    decoded = data.decode()
-                    print(f'{timestamp()} | Data received: "{decoded}", {len(decoded)} bytes')
+                    metrics.request(time.time())
+                    sentbefore = totalbytes
+                    if opt_verbose:
+                        decoded = data.decode(errors="replace")
+                        print(f'{timestamp()} | Data received: "{decoded}", {len(decoded)} bytes')
                     if data == b"Sync3":
                         print(f'{timestamp()} | Sending "{VERSION3}"')
                         packet = str.encode(VERSION3)
                         sendpacket(conn, packet, 0)
                         packets += 1
                         totalbytes += len(packet)
-                    elif data == b"Next" or data == b"Neex": # Really common mistransmit. Probably uart-esp..
-                        if data == b"Neex":
+                    elif data == b"Sync5":
+                        payload = MAX_PAYLOAD
+                        print(f'{timestamp()} | Sending "{VERSION5}", payload {payload}')
+                        packet = str.encode(VERSION5) + payload.to_bytes(2, byteorder="big")
+                        sendpacket(conn, packet, 0)
+                        packets += 1
+                        totalbytes += len(packet)
+                    elif data in (b"Next", b"Neex", b"Nextz", b"Nextd", b"Full"):
+                        # "Next": [file length 4 bytes big endian][filename length 1 byte][filename]
+                        # "Nextz" adds [length of the data sent 4 bytes big endian],
+                        # 0 if the file is sent raw, and "Nextd" also [1 if the
+                        # data is a delta]. "Full" asks again without a delta.
+                        if data == b"Neex": # Really common mistransmit. Probably uart-esp..
                             gee += 1
-                        if fn >= len(f):
+                            data = b"Next"
+                        if data == b"Full" and current is None:
+                            sendpacket(conn, str.encode("Error"), 0)
+                            continue
+                        if data != b"Full":
+                            # The next only asks for more once the previous file is done
+                            if current is not None:
+                                manifest["files"][current[0][0]] = [current[0][1], current[0][2], current[1][1], current[1][5]]
+                                current = None
+                            if loaded is None or loadedfrom > fn:
+                                loaded = pool.imap(loadfile, [(x[0], x[3], opt_pack, opt_delta) for x in f[fn:]])
+                                loadedfrom = fn
+                            while loadedfrom < fn: # skip files already sent
+                                next(loaded)
+                                loadedfrom += 1
+                            while fn < len(f):
+                                result = next(loaded)
+                                loadedfrom += 1
+                                fn += 1
+                                if not result[4]:
+                                    current = (f[fn-1], result)
+                                    break
+                                print(f"{timestamp()} | File:{f[fn-1][0]} unchanged")
+                                manifest["files"][f[fn-1][0]] = [f[fn-1][1], f[fn-1][2], result[1], result[5]]
+                        if current is None:
                             print(f"{timestamp()} | Nothing (more) to sync")
-                            packet = b'\x00\x00\x00\x00\x00' # end of.
+                            packet = bytes({b"Next": 5, b"Nextz": 9, b"Nextd": 10}[data]) # end of.
                             packets += 1
                             sendpacket(conn, packet, 0)
                             totalbytes += len(packet)
                             # Sync complete, set sync point
-                            update_syncpoint(knownfiles)
+                            savemanifest(manifest)
                         else:
-                            specfn = opt_drive + f[fn][0].replace('\\','/')
-                            print(f"{timestamp()} | File:{f[fn][0]} (as {specfn}) length:{f[fn][1]} bytes")
-                            packet = (f[fn][1]).to_bytes(4, byteorder="big") + (len(specfn)).to_bytes(1, byteorder="big") + (specfn).encode()
+                            specfn = opt_drive + current[0][0].replace('\\','/')
+                            rawdata, hashes, packed, delta, unchanged, filesum = current[1]
+                            filedata = rawdata
+                            how = "raw"
+                            if data != b"Next" and packed is not None:
+                                filedata = packed
+                                how = "packed"
+                            if data == b"Nextd" and delta is not None and len(delta) < len(filedata):
+                                filedata = delta
+                                how = "delta"
+                            print(f"{timestamp()} | File:{current[0][0]} (as {specfn}) length:{len(rawdata)} bytes, sending {len(filedata)} bytes {how}")
+                            packet = (len(rawdata)).to_bytes(4, byteorder="big") + (len(specfn)).to_bytes(1, byteorder="big") + (specfn).encode()
+                            if data != b"Next":
+                                packet += (0 if how == "raw" else len(filedata)).to_bytes(4, byteorder="big")
+                            if data != b"Next" and data != b"Nextz":
+                                packet += (1 if how == "delta" else 0).to_bytes(1, byteorder="big")
+                            if how == "delta":
+                                # What the next's copy must be for the delta to apply
+                                old = current[0][3]
+                                packet += old[0].to_bytes(4, byteorder="big") + old[3].to_bytes(2, byteorder="big")
                             packets += 1
                             sendpacket(conn, packet, 0)
                             totalbytes += len(packet)
-                            with open(f[fn][0], 'rb') as srcfile:
-                                filedata = srcfile.read()
-                            payloadbytes += len(filedata)
-                            if f[fn][0] not in knownfiles:
-                                knownfiles.append(f[fn][0])
+                            payloadbytes += len(rawdata)
                             fileofs = 0
                             packetno = 0
-                            fn+=1
+                            acked = 0
+                            sent = 0
                     elif data == b"Get" or data == b"Gee": # Really common mistransmit. Probably uart-esp..
                         bytecount = MAX_PAYLOAD
                         if bytecount + fileofs > len(filedata):
                             bytecount = len(filedata) - fileofs                        
                         packet = filedata[fileofs:fileofs+bytecount]
-                        print(f"{timestamp()} | Sending {bytecount} bytes, offset {fileofs}/{len(filedata)}")
+                        if opt_verbose:
+                            print(f"{timestamp()} | Sending {bytecount} bytes, offset {fileofs}/{len(filedata)}")
                         packets += 1
+                        metrics.packet(MAX_PAYLOAD, 0)
                         sendpacket(conn, packet, packetno)
                         totalbytes += len(packet)
                         fileofs += bytecount                        
                         packetno += 1
                         if data == b"Gee":
                             gee += 1
+                    elif data.startswith(b"Ack") and len(data) == 8:
+                        # "Ack" [base][held mask][window] in hex: everything before packet
+                        # number base is written, send the window from base minus the held ones
+                        try:
+                            base = int(data[3:5], 16)
+                            mask = int(data[5:7], 16)
+                            window = int(data[7:8], 16)
+                        except ValueError:
+                            print(f"{timestamp()} | Bad ack")
+                            sendpacket(conn, str.encode("Error"), 0)
+                            continue
+                        acked += (base - acked) & 0xff
+                        burst = b''
+                        for i in range(window):
+                            ofs = (acked + i) * payload
+                            if ofs >= len(filedata):
+                                break
+                            if mask & (1 << i):
+                                continue
+                            if acked + i < sent:
+                                retries += 1
+                            metrics.packet(payload, int(acked + i < sent))
+                            packet = filedata[ofs:ofs+payload]
+                            burst += makepacket5(packet, acked + i)
+                            packets += 1
+                            totalbytes += len(packet)
+                            sent = max(sent, acked + i + 1)
+                        if opt_verbose:
+                            print(f"{timestamp()} | Sending window of {window} from packet {acked}, held {mask:02x}, {len(burst)} bytes")
+                        conn.sendall(burst)
                     elif data == b"Retry":
                         retries += 1
+                        metrics.packet(MAX_PAYLOAD, 1)
                         print(f"{timestamp()} | Resending")
                         sendpacket(conn, packet, packetno - 1)
                     elif data == b"Restart":
                         restarts += 1
+                        metrics.packet(MAX_PAYLOAD, 1)
                         print(f"{timestamp()} | Restarting")
                         fileofs = 0
                         packetno = 0
@@ -245,36 +554,56 @@ def main():
                     else:
                         print(f"{timestamp()} | Unknown command")
                         sendpacket(conn, str.encode("Error"), 0)
+                    metrics.reply(time.time(), totalbytes - sentbefore)
+                    if opt_adaptive:
+                        # NextSync3 takes the new size with the next "Get",
+                        # NextSync5 with the next connection
+                        MAX_PAYLOAD = metrics.adaptpayload(MAX_PAYLOAD)
                 endtime = time.time()
+            savemanifest(manifest) # keeps the files that made it if the sync broke
         deltatime = endtime - starttime
         print(f"{timestamp()} | {totalbytes/1024:.2f} kilobytes transferred in {deltatime:.2f} seconds, {(totalbytes/deltatime)/1024:.2f} kBps")
         print(f"{timestamp()} | {payloadbytes/1024:.2f} kilobytes payload, {(payloadbytes/deltatime)/1024:.2f} kBps effective speed")
         print(f"{timestamp()} | packets: {packets}, retries: {retries}, restarts: {restarts}, gee: {gee}")
+        metrics.emit(time.time(), {"bytes": totalbytes, "payloadbytes": payloadbytes, "packets": packets,
+            "retries": retries, "restarts": restarts, "gee": gee, "payload": MAX_PAYLOAD, "seconds": round(deltatime, 3)}, True)
         print(f"{timestamp()} | Disconnected")
         print()                
         if opt_sync_once:
             working = False
             
 
-for x in sys.argv[1:]:
-    if x == '-c':
-        opt_drive = 'c:/'
-    elif x == '-d':
-        opt_drive = 'd:/'
-    elif x == '-e':
-        opt_drive = 'e:/'
-    elif x == '-a':
-        opt_always_sync = True
-    elif x == '-o':
-        opt_sync_once = True
-    elif x == '-s':
-        MAX_PAYLOAD = 256
-    elif x == '-u':
-        MAX_PAYLOAD = 1455
-    else:
-        print(f"Unknown parameter: {x}")
-        print(
-        """
+# Guarded so the packing pool's worker processes don't run the server
+if __name__ == "__main__":
+    for x in sys.argv[1:]:
+        if x == '-c':
+            opt_drive = 'c:/'
+        elif x == '-d':
+            opt_drive = 'd:/'
+        elif x == '-e':
+            opt_drive = 'e:/'
+        elif x == '-a':
+            opt_always_sync = True
+        elif x == '-o':
+            opt_sync_once = True
+        elif x == '-s':
+            MAX_PAYLOAD = 256
+        elif x == '-u':
+            MAX_PAYLOAD = 1455
+        elif x == '-r':
+            opt_pack = False
+        elif x == '-f':
+            opt_delta = False
+        elif x == '-v':
+            opt_verbose = True
+        elif x == '-m':
+            opt_metrics = True
+        elif x == '-t':
+            opt_adaptive = True
+        else:
+            print(f"Unknown parameter: {x}")
+            print(
+            """
         Run without parameters for normal action. See nextsync.txt for details.
         
         Optional parameters:
@@ -287,8 +616,16 @@ for x in sys.argv[1:]:
         -c - Prefix filenames with c: (i.e, /dot/foo becomes c:/dot/foo)
         -d - Prefix filenames with d: (i.e, /dot/foo becomes d:/dot/foo)
         -e - Prefix filenames wieh e: (i.e, /dot/foo becomes e:/dot/foo)
+        -r - Send files raw, don't pack them even if the next can unpack
+        -f - Send whole files, never just the changed blocks
+        -v - Verbose, log every packet
+        -m - Append metrics to syncmetrics.jsonl: a JSON line every second
+             and one per sync with round trip times, retries per payload
+             size and a rolling kBps
+        -t - Tune the payload size between 256 and 1455 bytes as retries
+             come and go, starting from the -s/-u/default size
         """)
-        quit()
+            quit()
         
-main()
+    main()
         
\ No newline at end of file
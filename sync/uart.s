@@ -1,6 +1,8 @@
 	.module uart
 	.globl _checksum
+	.globl _checksumrun
 	.globl _receive
+	.globl _receiveupto
 	.area _CODE
 
 ;extern unsigned short receive(char *b)
@@ -33,6 +35,47 @@ done:
     ret        ; hl = count
 
 
+;extern unsigned short receiveupto(char *b, unsigned short max)
+; Like receive, but stops after max bytes so the next +IPD header
+; stays in the uart
+_receiveupto::
+    ld hl, #2
+    add hl, sp
+    ld e, (hl)
+    inc hl
+    ld d, (hl)   ; de = char *b
+    inc hl
+    ld a, (hl)
+    inc hl
+    ld h, (hl)
+    ld l, a      ; hl = max
+    push de      ; start of buffer
+    ld bc, #0x133b   ; uart tx
+nextbyte_upto:
+    ld a, h
+    or a, l
+    jr z, done_upto ; got max bytes
+    in a, (c)
+    and a, #0x01
+    jr z, done_upto ; nothing incoming, done
+    inc b        ; to uart rx
+    in a, (c)
+    ld (de), a   ; store to buffer
+    and a, #0x07
+    out (254), a ; blinky
+    inc de       ; inc buffer idx
+    dec hl       ; dec bytes left
+    dec b        ; back to tx
+    jp nextbyte_upto
+done_upto:
+    xor a
+    out (254), a ; blinky
+    pop hl       ; start of buffer
+    ex de, hl
+    sbc hl, de   ; carry is clear from xor
+    ret          ; hl = count
+
+
 ;extern char checksum(char *dp, unsigned short len)
 _checksum::
     pop de ; return address
@@ -42,12 +85,43 @@ _checksum::
     push hl
     push de
     
+    ld      de,#0       ; clear checksum
+    call    checksum_block
+
+    ld c, (hl)      ; Load the checksums from after the data
+    inc hl
+    ld b, (hl)
+    ld h, b
+    ld l, c
+    or a
+    sbc hl, de
+    ld a, h
+    or l
+    ld l, a
+    
+    ret    
+
+;extern unsigned short checksumrun(char *dp, unsigned short len, unsigned short sum)
+; The same checksum carried on over more data, d << 8 | e as it was
+; after the data before; 0 to start
+_checksumrun::
+    pop iy ; return address
+    pop hl ; datapointer
+    pop bc ; len
+    pop de ; sum so far
+    push de ; restore stack
+    push bc
+    push hl
+    call    checksum_block
+    ex      de, hl
+    jp      (iy)
+
 ; Optimized inner loop snippet from Ped7g from SpectrumNext discord    
 ;; IN: HL = memory buffer, BC = size (0..1024) (65535 is real max)
+;;     DE = checksum so far
 ;; OUT: E = xor[buffer], D = sum{intermmediate xors}
 ;;     HL = HL + size, BC = 0
 checksum_block:
-    ld      de,#0       ; clear checksum
     ; check size > 0 and swap B<->C
     ld      a,b
     ld      b,c
@@ -68,18 +142,6 @@ loop_entry:
     dec     c
     jr      nz, loop
 ; /snippet
-
-    ld c, (hl)      ; Load the checksums from after the data
-    inc hl
-    ld b, (hl)
-    ld h, b
-    ld l, c
-    or a
-    sbc hl, de
-    ld a, h
-    or l
-    ld l, a
-    
-    ret    
+    ret
 	
 _endof_uart:
\ No newline at end of file
@@ -20,7 +20,7 @@
 ;
 ; generated by sdcc:
 ; -3, -4 = temp for unpackoffset?
-; -5, -6 = len masked with 1024?
+; -5, -6 = unused (was len masked with 1024)
 ; -7, -8 = copy of len ?
 ; 
 
@@ -42,16 +42,19 @@ _zunpack::
 	ld	-8 (ix), a
 	ld	a, 5 (ix)
 	ld	-7 (ix), a
-	ld	-6 (ix), #0x00
-	ld	a, -7 (ix)
-	and	a, #0x04
-	ld	-5 (ix), a
 mainloop:
 	ld	a, c
 	sub	a, -8 (ix)
 	ld	a, b
 	sbc	a, -7 (ix)
-	jp	NC, done
+	jr	C, dispatch
+; Out of input, but a match being copied needs none: finish it, so a
+; call with len 0 drains the last one at the end of the file
+	ld	a, (_unpackstate)
+	sub	a, #0x03
+	jp	NZ, done
+	jp	copy_history
+dispatch:
 ;nextsync.c:466: switch (unpackstate)
 	ld	iy, #_unpackstate
 	ld	a, 0 (iy)
@@ -260,18 +263,13 @@ done_copy_history:
 	ld	(hl), #0x00
 ;nextsync.c:513: }
 check_write_out:
-;nextsync.c:515: if (unpackd & 1024 || (!(len & 1024) && p == len))
+;nextsync.c:515: if (unpackd & 1024)
+; Only full blocks are written, so packets can be any size; once the
+; whole file is in, the caller drains with len 0 and writes the last
+; unpackd bytes
 	ld	hl, (_unpackd)
 	bit	2, h
-	jr	NZ,do_write_out
-	ld	a, -5 (ix)
-	or	a, -6 (ix)
-	jp	NZ, mainloop
-	pop	hl
-	push	hl
-	cp	a, a
-	sbc	hl, bc
-	jp	NZ,mainloop
+	jp	Z, mainloop
 do_write_out:
 ;nextsync.c:517: fwrite(filehandle, scratch, unpackd);
 	push	bc
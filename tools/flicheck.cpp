@@ -0,0 +1,145 @@
+/*
+ * Part of Jari Komppa's zx spectrum next suite
+ * https://github.com/jarikomppa/specnext
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
+ */
+
+// Checks that sol_fliflc's memset / memcpy chunk decoders give the same
+// pictures as the byte-at-a-time SOL_FLIFLC_SCALAR ones.
+//
+// Both versions are built into this program, each in its own namespace.
+// Every frame of every file given is rendered with both, and the
+// framebuffers and palettes are compared. Each file is also played
+// through the streaming reader, and a few frames are gone back to with
+// fli_seek, with and without snapshots. Returns non-zero if anything
+// differs.
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define SOL_FLIFLC_IMPLEMENTATION
+#define SOL_FLIFLC_NO_EXTERN_C
+
+namespace fast
+{
+#include "../common/sol_fliflc.h"
+}
+
+#undef SOL_FLIFLC_H
+#define SOL_FLIFLC_SCALAR
+
+namespace scalar
+{
+#include "../common/sol_fliflc.h"
+}
+
+#define SEEKS 5
+
+// Renders the whole file once so that it's indexed, then seeks back to
+// each of aTarget and compares to aExpect. Returns the number that differ.
+static int checkseeks(char *aFilename, int aSnapshots, const int *aTarget, const std::vector<unsigned char> *aExpect)
+{
+    fast::FLI *fli = fast::fli_open_stream(aFilename);
+    if (!fli)
+        return SEEKS;
+    if (aSnapshots)
+        fast::fli_snapshots(fli);
+    int size = fli->mXSize * fli->mYSize;
+    for (int i = 0; i < fli->mMaxframe; i++)
+        fast::fli_render(fli);
+    int bad = 0;
+    for (int i = 0; i < SEEKS; i++)
+    {
+        fast::fli_seek(fli, aTarget[i]);
+        fast::fli_render(fli);
+        if (memcmp(fli->mFramebuffer, aExpect[i].data(), size) != 0 ||
+            memcmp(fli->mPalette, aExpect[i].data() + size, 768) != 0)
+        {
+            if (!bad)
+                printf("%s: seek to frame %d%s differs\n", aFilename, aTarget[i], aSnapshots ? " with snapshots" : "");
+            bad++;
+        }
+    }
+    fast::fli_free(fli);
+    return bad;
+}
+
+// Returns the number of frames that differ, or -1 if the file can't be read
+static int checkfile(char *aFilename)
+{
+    scalar::FLI *ref = scalar::fli_open(aFilename);
+    fast::FLI *mem = fast::fli_open(aFilename);
+    fast::FLI *stream = fast::fli_open_stream(aFilename);
+    if (!ref || !mem || !stream)
+    {
+        printf("%s: unable to open as FLI/FLC\n", aFilename);
+        if (ref)
+            scalar::fli_free(ref);
+        if (mem)
+            fast::fli_free(mem);
+        if (stream)
+            fast::fli_free(stream);
+        return -1;
+    }
+    int size = ref->mXSize * ref->mYSize;
+    int frames = ref->mMaxframe;
+    int bad = 0;
+    // backwards, so that each one is a seek back
+    int target[SEEKS] = { frames - 1, frames / 2, frames / 3 + 1, 1, 0 };
+    std::vector<unsigned char> expect[SEEKS];
+    for (int i = 0; i < frames; i++)
+    {
+        scalar::fli_render(ref);
+        for (int j = 0; j < SEEKS; j++)
+            if (target[j] == i)
+            {
+                expect[j].assign(ref->mFramebuffer, ref->mFramebuffer + size);
+                expect[j].insert(expect[j].end(), ref->mPalette, ref->mPalette + 768);
+            }
+        fast::fli_render(mem);
+        fast::fli_render(stream);
+        const char *what = 0;
+        if (memcmp(ref->mFramebuffer, mem->mFramebuffer, size) != 0)
+            what = "framebuffer";
+        else
+        if (memcmp(ref->mPalette, mem->mPalette, 768) != 0)
+            what = "palette";
+        else
+        if (memcmp(ref->mFramebuffer, stream->mFramebuffer, size) != 0 ||
+            memcmp(ref->mPalette, stream->mPalette, 768) != 0)
+            what = "streamed frame";
+        if (what)
+        {
+            if (!bad)
+                printf("%s: frame %d: %s differs\n", aFilename, i, what);
+            bad++;
+        }
+    }
+    bad += checkseeks(aFilename, 0, target, expect);
+    bad += checkseeks(aFilename, 1, target, expect);
+    printf("%s: %dx%d, %d frames, %s\n", aFilename, ref->mXSize, ref->mYSize, frames, bad ? "MISMATCH" : "ok");
+    scalar::fli_free(ref);
+    fast::fli_free(mem);
+    fast::fli_free(stream);
+    return bad;
+}
+
+int main(int parc, char ** pars)
+{
+    if (parc < 2)
+    {
+        printf("Usage: file.fli|file.flc [..]\n");
+        return 1;
+    }
+    int fails = 0;
+    for (int i = 1; i < parc; i++)
+        if (checkfile(pars[i]) != 0)
+            fails++;
+    if (parc > 2)
+        printf("%d of %d files passed\n", parc - 1 - fails, parc - 1);
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+/*
+ * Part of Jari Komppa's zx spectrum next suite
+ * https://github.com/jarikomppa/specnext
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
+ */
+
+// FLX reference player and decoder benchmark.
+//
+// Replays a .flx through the same decoders flxenc verifies its chunks
+// with, checks every frame against the checksum the encoder stored, and
+// reports per chunk type what the ops were (how many of each kind, how
+// long they were on average, literal bytes, bytes per op), the host time
+// per chunk and the decode time the encoder's cycle model gives for the
+// Next. Useful for seeing where a clip spends its time before trying it
+// on the hardware, and for checking cost model changes against
+// playflx's PERF_GRIND profile. Returns non-zero if the file is bad or
+// any frame doesn't match.
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "../common/flxformat.h"
+
+struct TypeStats
+{
+    long long mChunks;
+    long long mBytes;  // chunk data, without type, size and checksum
+    long long mNanos;
+    FlxOpStats mOps;
+};
+
+static const char *gKindNames[5] = { "rle", "lit", "prev", "cur", "near" };
+
+static int readword(const unsigned char *aData)
+{
+    return aData[0] | (aData[1] << 8);
+}
+
+// Decodes one picture chunk over aCur. Returns 0 if the data was bad.
+static int decodechunk(int aType, const unsigned char *aData, int aLen, const unsigned char *aPrev, unsigned char *aCur, FlxOpStats *aStats)
+{
+    switch (aType)
+    {
+        case SAMEFRAME:
+            memcpy(aCur, aPrev, FRAMESIZE);
+            if (aStats)
+                aStats->mCycles += fullscreencycles(aType);
+            return aLen == 0;
+        case BLACKFRAME:
+            memset(aCur, 0, FRAMESIZE);
+            if (aStats)
+                aStats->mCycles += fullscreencycles(aType);
+            return aLen == 0;
+        case ONECOLOR:
+            if (aLen != 1)
+                return 0;
+            memset(aCur, aData[0], FRAMESIZE);
+            if (aStats)
+                aStats->mCycles += fullscreencycles(aType);
+            return 1;
+        case TILES:
+            return tiledecode(aData, aLen, aPrev, aCur, aStats) == 0;
+    }
+    for (int i = 0; i < FORMATS; i++)
+        if (gFormats[i].mType == aType)
+            return lzdecode(gFormats[i], aData, aLen, aPrev, aCur, aStats) == 0;
+    return 0;
+}
+
+int main(int parc, char ** pars)
+{
+    int repeats = 1;
+    const char *infile = 0, *dumpfile = 0;
+    for (int i = 1; i < parc; i++)
+    {
+        if (strcmp(pars[i], "-n") == 0 && i + 1 < parc)
+            repeats = atoi(pars[++i]);
+        else
+        if (strcmp(pars[i], "-dump") == 0 && i + 1 < parc)
+            dumpfile = pars[++i];
+        else
+        if (strcmp(pars[i], "-costs") == 0 && i + 1 < parc)
+        {
+            if (!loadcosts(pars[++i]))
+            {
+                printf("Unable to read \"%s\"\n", pars[i]);
+                return 1;
+            }
+        }
+        else
+        if (!infile)
+            infile = pars[i];
+        else
+        {
+            infile = 0;
+            break;
+        }
+    }
+    if (!infile)
+    {
+        printf(
+            "Usage: [options] input.flx\n"
+            "Options:\n"
+            "  -n repeats   decode every chunk this many times for the timings (default: 1)\n"
+            "  -dump file   write the decoded frames, 256x192 bytes each\n"
+            "  -costs file  decode cycle model, as in flxenc\n");
+        return 1;
+    }
+    if (repeats < 1)
+        repeats = 1;
+
+    FILE *f = fopen(infile, "rb");
+    if (!f)
+    {
+        printf("Unable to open %s\n", infile);
+        return 1;
+    }
+    std::vector<unsigned char> file;
+    unsigned char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        file.insert(file.end(), buf, buf + n);
+    fclose(f);
+    if (file.size() < HEADERSIZE || memcmp(file.data(), "FLX!", 4) != 0)
+    {
+        printf("%s is not a FLX file\n", infile);
+        return 1;
+    }
+    int frames = readword(&file[4]);
+    int speed = readword(&file[6]);
+    int config = readword(&file[8]);
+    if (config != 0)
+    {
+        // SUBFRAME streams decode 320x256 in parts straight to Layer 2
+        printf("%s: config %d is not supported, only 256x192\n", infile, config);
+        return 1;
+    }
+
+    FILE *dump = 0;
+    if (dumpfile)
+    {
+        dump = fopen(dumpfile, "wb");
+        if (!dump)
+        {
+            printf("Unable to open %s\n", dumpfile);
+            return 1;
+        }
+    }
+
+    TypeStats stats[64];
+    memset(stats, 0, sizeof(stats));
+    std::vector<unsigned char> prev(FRAMESIZE, 0), cur(FRAMESIZE, 0);
+    size_t pos = HEADERSIZE;
+    int frame = 0, bad = 0, palettes = 0, palframe = -1;
+    long long frametotal = 0, framemax = 0, framecycles = 0;
+    while (frame < frames)
+    {
+        if (pos >= file.size())
+        {
+            printf("Frame %d: file ends\n", frame);
+            break;
+        }
+        int type = file[pos];
+        if (type == NEXTFRAME)
+        {
+            pos++;
+            if (dump)
+                fwrite(cur.data(), 1, FRAMESIZE, dump);
+            prev.swap(cur);
+            frametotal += framecycles;
+            if (framemax < framecycles)
+                framemax = framecycles;
+            framecycles = 0;
+            frame++;
+            continue;
+        }
+        if (type == PALETTE)
+        {
+            if (pos + 3 > file.size())
+            {
+                printf("Frame %d: file ends\n", frame);
+                break;
+            }
+            if (palframe == frame)
+            {
+                // playflx fails on these
+                printf("Frame %d: second PALETTE chunk\n", frame);
+                break;
+            }
+            palframe = frame;
+            int count = file[pos + 2] ? file[pos + 2] : 256;
+            pos += 3 + count * 2;
+            palettes++;
+            continue;
+        }
+        if (type == SUBFRAME || type >= 64 || chunkname(type)[0] == '?')
+        {
+            printf("Frame %d: unknown chunk type %d at %d\n", frame, type, (int)pos);
+            break;
+        }
+        if (pos + 5 > file.size() || pos + 5 + readword(&file[pos + 1]) > file.size())
+        {
+            printf("Frame %d: file ends\n", frame);
+            break;
+        }
+        int len = readword(&file[pos + 1]);
+        const unsigned char *data = &file[pos + 3];
+        FlxOpStats ops;
+        memset(&ops, 0, sizeof(ops));
+        auto start = std::chrono::steady_clock::now();
+        int ok = decodechunk(type, data, len, prev.data(), cur.data(), &ops);
+        for (int i = 1; i < repeats && ok; i++)
+            decodechunk(type, data, len, prev.data(), cur.data(), 0);
+        auto end = std::chrono::steady_clock::now();
+        if (!ok)
+        {
+            printf("Frame %d: bad %s data\n", frame, chunkname(type));
+            break;
+        }
+        if (checksum(cur.data()) != readword(data + len))
+        {
+            if (!bad)
+                printf("Frame %d: %s checksum mismatch\n", frame, chunkname(type));
+            bad++;
+        }
+        TypeStats &s = stats[type];
+        s.mChunks++;
+        s.mBytes += len;
+        s.mNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / repeats;
+        for (int i = 0; i < 5; i++)
+        {
+            s.mOps.mOps[i] += ops.mOps[i];
+            s.mOps.mPixels[i] += ops.mPixels[i];
+        }
+        s.mOps.mLong += ops.mLong;
+        s.mOps.mCycles += ops.mCycles;
+        framecycles += ops.mCycles;
+        pos += 5 + len;
+    }
+    if (dump)
+        fclose(dump);
+
+    printf("%s: %d of %d frames, speed %d, %d bytes, %d palette changes\n", infile, frame, frames, speed, (int)file.size(), palettes);
+    if (bad)
+        printf("%d frames did not match the encoder's checksum\n", bad);
+    else
+    if (frame == frames)
+        printf("All frames match the encoder's checksums\n");
+    printf("%-10s %7s %9s %8s %9s %9s %10s\n", "chunk", "count", "bytes", "ops", "bytes/op", "host us", "cycles");
+    for (int t = 0; t < 64; t++)
+    {
+        TypeStats &s = stats[t];
+        if (!s.mChunks)
+            continue;
+        long long ops = 0;
+        for (int i = 0; i < 5; i++)
+            ops += s.mOps.mOps[i];
+        printf("%-10s %7lld %9lld %8lld %9.2f %9.1f %10lld\n", chunkname(t), s.mChunks, s.mBytes, ops,
+            ops ? (double)s.mBytes / ops : 0.0, s.mNanos / 1000.0 / s.mChunks, s.mOps.mCycles / s.mChunks);
+        if (!ops)
+            continue;
+        // Average span per op kind, literal bytes, and long ops
+        printf("          ");
+        for (int i = 0; i < 5; i++)
+            if (s.mOps.mOps[i])
+                printf(" %s %lld x %.1f", gKindNames[i], s.mOps.mOps[i], (double)s.mOps.mPixels[i] / s.mOps.mOps[i]);
+        printf(", %lld literal bytes", s.mOps.mPixels[OP_LIT]);
+        if (s.mOps.mLong)
+            printf(", %lld long", s.mOps.mLong);
+        printf("\n");
+    }
+    if (frame)
+        printf("Decode cycles per frame: %lld average, %lld max\n", frametotal / frame, framemax);
+    return (bad || frame != frames) ? 1 : 0;
+}
@@ -0,0 +1,1176 @@
+/*
+ * Part of Jari Komppa's zx spectrum next suite
+ * https://github.com/jarikomppa/specnext
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
+ */
+
+// FLX encoder for playflx.
+//
+// Reads a FLI/FLC through sol_fliflc or a sequence of images through
+// stb_image, and for every frame tries all chunk types playflx knows,
+// keeping the smallest. LZ chunks are parsed optimally (for the matches
+// found) with a backwards dynamic programming pass over the frame.
+// Every frame only depends on itself and the frame before it, so frames
+// are encoded on a thread pool.
+//
+// FLI/FLC palette changes become PALETTE chunks. Image sequences with
+// more than 256 colors also try a palette per scene, and keep those
+// scenes where it makes the file smaller.
+//
+// File layout, all words little endian:
+//   "FLX!", frames, speed, config, drawoffset, loopoffset
+//   512 byte 9-bit palette (RRRGGGBB, 0000000B per entry)
+//   chunks: [type] - NEXTFRAME and SUBFRAME are just the type byte,
+//           PALETTE is [type][start][count, 0 = 256][count * 2 bytes],
+//           others are [type][word size][size bytes][word checksum]
+// TILES starts from the previous frame and replaces 8x8 tiles, numbered
+// 32 per row: [skip][count][count * 64 bytes, row by row], repeated.
+// A frame has at most one PALETTE chunk, before its picture; it takes
+// effect when that frame is shown. playflx queues a few of these ahead
+// of the screen and rejects a second one in a frame.
+// See playflx/decoders.asm for the op formats of the LZ chunks.
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#define STB_IMAGE_IMPLEMENTATION
+#include "../common/stb_image.h"
+#define SOL_FLIFLC_IMPLEMENTATION
+#include "../common/sol_fliflc.h"
+#define SOL_QMEDIAN_IMPLEMENTATION
+#include "../common/sol_qmedian.h"
+#include "../common/flxformat.h"
+
+static int maxshort(const OpSpec &aOp)
+{
+    if (aOp.mNegative)
+        return aOp.mLong ? 127 : 128;
+    return aOp.mLong ? 126 : 127;
+}
+
+static int needsprev(const LzFormat &aFormat)
+{
+    for (int s = 0; s < 2; s++)
+        for (int i = 0; i < 2; i++)
+            if (aFormat.mOp[s][i].mKind == OP_PREV || aFormat.mOp[s][i].mKind == OP_NEAR)
+                return 1;
+    return 0;
+}
+
+// Longest matches at every screen offset
+struct Matches
+{
+    int mRun[FRAMESIZE];      // same byte repeated
+    int mPrevLen[FRAMESIZE];  // anywhere in the previous frame
+    int mPrevOfs[FRAMESIZE];
+    int mNearLen[FRAMESIZE];  // previous frame, within -128..127 of the offset
+    int mNearOfs[FRAMESIZE];
+    int mCurLen[FRAMESIZE];   // earlier in this frame, not overlapping
+    int mCurOfs[FRAMESIZE];
+};
+
+#define HASHBITS 16
+#define CHAINDEPTH 32
+// Inside a match at least this long, just follow it instead of searching
+#define INHERITLEN 16
+
+static unsigned int hash3(const unsigned char *p)
+{
+    return ((p[0] | (p[1] << 8) | (p[2] << 16)) * 0x9e3779b1u) >> (32 - HASHBITS);
+}
+
+static int matchlen(const unsigned char *a, const unsigned char *b, int aMax)
+{
+    int i = 0;
+    while (i < aMax && a[i] == b[i])
+        i++;
+    return i;
+}
+
+static void findmatches(const unsigned char *aCur, const unsigned char *aPrev, Matches &m)
+{
+    std::vector<int> head(1 << HASHBITS, -1);
+    std::vector<int> chain(FRAMESIZE, -1);
+
+    m.mRun[FRAMESIZE - 1] = 1;
+    for (int p = FRAMESIZE - 2; p >= 0; p--)
+        m.mRun[p] = aCur[p] == aCur[p + 1] ? m.mRun[p + 1] + 1 : 1;
+
+    // Non-overlapping copies from the part of this frame already decoded
+    for (int p = 0; p < FRAMESIZE; p++)
+    {
+        int bestlen = 0, bestofs = 0;
+        if (p > 0 && m.mCurLen[p - 1] > INHERITLEN)
+        {
+            bestlen = m.mCurLen[p - 1] - 1;
+            bestofs = m.mCurOfs[p - 1] + 1;
+        }
+        else
+        if (p + 3 <= FRAMESIZE)
+        {
+            int q = head[hash3(aCur + p)];
+            for (int d = 0; d < CHAINDEPTH && q >= 0; d++, q = chain[q])
+            {
+                int max = FRAMESIZE - p;
+                if (max > p - q)
+                    max = p - q;
+                if (max <= bestlen)
+                    continue;
+                int len = matchlen(aCur + p, aCur + q, max);
+                if (len > bestlen)
+                {
+                    bestlen = len;
+                    bestofs = q;
+                }
+            }
+        }
+        m.mCurLen[p] = bestlen;
+        m.mCurOfs[p] = bestofs;
+        if (p + 3 <= FRAMESIZE)
+        {
+            unsigned int h = hash3(aCur + p);
+            chain[p] = head[h];
+            head[h] = p;
+        }
+    }
+
+    if (!aPrev)
+    {
+        memset(m.mPrevLen, 0, sizeof(m.mPrevLen));
+        memset(m.mNearLen, 0, sizeof(m.mNearLen));
+        return;
+    }
+
+    // Near: every offset within reach, run lengths built back to front
+    int eq[256];
+    for (int d = 0; d < 256; d++)
+        eq[d] = 0;
+    for (int p = FRAMESIZE - 1; p >= 0; p--)
+    {
+        int bestlen = 0, bestofs = p;
+        for (int d = 0; d < 256; d++)
+        {
+            int q = p + ((d + 128) & 255) - 128; // d == 0 first, so ties stay in place
+            if (q >= 0 && q < FRAMESIZE && aCur[p] == aPrev[q])
+            {
+                eq[d]++;
+                if (eq[d] > bestlen)
+                {
+                    bestlen = eq[d];
+                    bestofs = q;
+                }
+            }
+            else
+            {
+                eq[d] = 0;
+            }
+        }
+        m.mNearLen[p] = bestlen;
+        m.mNearOfs[p] = bestofs;
+    }
+
+    // Far: hash chains over the whole previous frame
+    for (int i = 0; i < (1 << HASHBITS); i++)
+        head[i] = -1;
+    for (int q = 0; q + 3 <= FRAMESIZE; q++)
+    {
+        unsigned int h = hash3(aPrev + q);
+        chain[q] = head[h];
+        head[h] = q;
+    }
+    for (int p = 0; p < FRAMESIZE; p++)
+    {
+        int bestlen = m.mNearLen[p], bestofs = m.mNearOfs[p];
+        if (p > 0 && m.mPrevLen[p - 1] - 1 > bestlen && m.mPrevLen[p - 1] > INHERITLEN)
+        {
+            bestlen = m.mPrevLen[p - 1] - 1;
+            bestofs = m.mPrevOfs[p - 1] + 1;
+        }
+        else
+        if (p + 3 <= FRAMESIZE && bestlen <= INHERITLEN)
+        {
+            int q = head[hash3(aCur + p)];
+            for (int d = 0; d < CHAINDEPTH && q >= 0; d++, q = chain[q])
+            {
+                int max = FRAMESIZE - (p > q ? p : q);
+                if (max <= bestlen)
+                    continue;
+                int len = matchlen(aCur + p, aPrev + q, max);
+                if (len > bestlen)
+                {
+                    bestlen = len;
+                    bestofs = q;
+                }
+            }
+        }
+        m.mPrevLen[p] = bestlen;
+        m.mPrevOfs[p] = bestofs;
+    }
+}
+
+struct Step
+{
+    int mLen;
+    int mSlot;
+};
+
+// Optimal parse of aCur in aFormat for the given matches, minimizing
+// bytes + aLambda * cycles. Returns the block size, or -1 if it doesn't
+// fit a block; aCycles gets the decode cycles of the whole chunk.
+static int lzencode(const LzFormat &aFormat, const unsigned char *aCur, const Matches &m, double aLambda, std::vector<unsigned char> &aOut, int &aCycles)
+{
+    std::vector<double> best[2], sufmin[2];
+    std::vector<int> sufarg[2];
+    std::vector<Step> step[2];
+    // long literals are linear in length past the ldir range:
+    // const + w * len, with w the cost of one more byte
+    double w = 1 + aLambda * (gCost.mDmaByte + gCost.mStreamByte);
+    for (int s = 0; s < 2; s++)
+    {
+        best[s].resize(FRAMESIZE + 1);
+        sufmin[s].resize(FRAMESIZE + 2);
+        sufarg[s].resize(FRAMESIZE + 2);
+        step[s].resize(FRAMESIZE);
+        best[s][FRAMESIZE] = 0;
+        sufmin[s][FRAMESIZE + 1] = 1e30;
+        sufmin[s][FRAMESIZE] = w * FRAMESIZE;
+        sufarg[s][FRAMESIZE] = FRAMESIZE;
+    }
+
+    for (int p = FRAMESIZE - 1; p >= 0; p--)
+    {
+        double cost[2];
+        for (int s = 0; s < 2; s++)
+        {
+            const std::vector<double> &next = best[s ^ 1];
+            double c = 1e30;
+            Step st = { 0, 0 };
+            for (int slot = 0; slot < 2; slot++)
+            {
+                const OpSpec &op = aFormat.mOp[s][slot];
+                int avail;
+                switch (op.mKind)
+                {
+                    case OP_RLE: avail = m.mRun[p]; break;
+                    case OP_LIT: avail = FRAMESIZE - p; break;
+                    case OP_PREV: avail = m.mPrevLen[p]; break;
+                    case OP_NEAR: avail = m.mNearLen[p]; break;
+                    default: avail = m.mCurLen[p]; break;
+                }
+                if (avail == 0)
+                    continue;
+                int base = opbytes(op.mKind);
+                int lit = op.mKind == OP_LIT;
+                int max = maxshort(op);
+                int n = avail < max ? avail : max;
+                for (int l = 1; l <= n; l++)
+                {
+                    double v = base + (lit ? l : 0) + next[p + l];
+                    if (aLambda)
+                        v += aLambda * opcycles(op.mKind, l, 0);
+                    if (v < c)
+                    {
+                        c = v;
+                        st.mLen = l;
+                        st.mSlot = slot;
+                    }
+                }
+                if (op.mLong && avail > max)
+                {
+                    if (lit)
+                    {
+                        // cheapest literal longer than a short one
+                        double v = 3 - w * p + sufmin[s ^ 1][p + max + 1];
+                        if (aLambda)
+                            v += aLambda * (gCost.mOp + gCost.mReadWord + gCost.mFileCopy + gCost.mDmaBase + 3 * gCost.mStreamByte);
+                        if (v < c)
+                        {
+                            c = v;
+                            st.mLen = sufarg[s ^ 1][p + max + 1] - p;
+                            st.mSlot = slot;
+                        }
+                    }
+                    else
+                    {
+                        double v = base + 2 + next[p + avail];
+                        if (aLambda)
+                            v += aLambda * opcycles(op.mKind, avail, 1);
+                        if (v < c)
+                        {
+                            c = v;
+                            st.mLen = avail;
+                            st.mSlot = slot;
+                        }
+                    }
+                }
+            }
+            cost[s] = c;
+            step[s][p] = st;
+        }
+        // Zero length ops switch state without moving
+        int z0 = zeroslot(aFormat, 0), z1 = zeroslot(aFormat, 1);
+        int k0 = aFormat.mOp[0][z0].mKind, k1 = aFormat.mOp[1][z1].mKind;
+        double c0 = opbytes(k0) + aLambda * opcycles(k0, 0, 0) + cost[1];
+        double c1 = opbytes(k1) + aLambda * opcycles(k1, 0, 0) + cost[0];
+        best[0][p] = cost[0];
+        best[1][p] = cost[1];
+        if (c0 < cost[0])
+        {
+            best[0][p] = c0;
+            step[0][p].mLen = 0;
+            step[0][p].mSlot = z0;
+        }
+        if (c1 < cost[1])
+        {
+            best[1][p] = c1;
+            step[1][p].mLen = 0;
+            step[1][p].mSlot = z1;
+        }
+        for (int s = 0; s < 2; s++)
+        {
+            double v = w * p + best[s][p];
+            if (v <= sufmin[s][p + 1])
+            {
+                sufmin[s][p] = v;
+                sufarg[s][p] = p;
+            }
+            else
+            {
+                sufmin[s][p] = sufmin[s][p + 1];
+                sufarg[s][p] = sufarg[s][p + 1];
+            }
+        }
+    }
+
+    aOut.clear();
+    aCycles = gCost.mChunk + 5 * gCost.mStreamByte;
+    int p = 0, s = 0;
+    while (p < FRAMESIZE)
+    {
+        const Step &st = step[s][p];
+        const OpSpec &op = aFormat.mOp[s][st.mSlot];
+        int l = st.mLen;
+        int islong = l > maxshort(op);
+        if (islong)
+        {
+            aOut.push_back(op.mNegative ? 0x80 : 0x7f);
+            aOut.push_back(l & 0xff);
+            aOut.push_back(l >> 8);
+        }
+        else
+        {
+            aOut.push_back((unsigned char)(op.mNegative ? -l : l));
+        }
+        switch (op.mKind)
+        {
+            case OP_RLE:
+                aOut.push_back(aCur[p]);
+                break;
+            case OP_LIT:
+                aOut.insert(aOut.end(), aCur + p, aCur + p + l);
+                break;
+            case OP_PREV:
+                aOut.push_back(m.mPrevOfs[p] & 0xff);
+                aOut.push_back(m.mPrevOfs[p] >> 8);
+                break;
+            case OP_CUR:
+                aOut.push_back(m.mCurOfs[p] & 0xff);
+                aOut.push_back(m.mCurOfs[p] >> 8);
+                break;
+            case OP_NEAR:
+                aOut.push_back((unsigned char)(m.mNearOfs[p] - p));
+                break;
+        }
+        aCycles += opcycles(op.mKind, l, islong);
+        p += l;
+        s ^= 1;
+    }
+    if (aOut.size() > 0xffff)
+        return -1;
+    return (int)aOut.size();
+}
+
+// Not an LZ format, but goes through the same candidate selection
+static const LzFormat gTileFormat = { TILES, "TILES", {} };
+
+static int tilechanged(const unsigned char *aCur, const unsigned char *aPrev, int aTile)
+{
+    int ofs = (aTile / TILECOLS) * 8 * FLX_WIDTH + (aTile % TILECOLS) * 8;
+    for (int y = 0; y < 8; y++, ofs += FLX_WIDTH)
+        if (memcmp(aCur + ofs, aPrev + ofs, 8))
+            return 1;
+    return 0;
+}
+
+// TILES block with the tiles that differ from aPrev
+static void tileencode(const unsigned char *aCur, const unsigned char *aPrev, std::vector<unsigned char> &aOut, int &aCycles)
+{
+    aOut.clear();
+    aCycles = fullscreencycles(SAMEFRAME);
+    int t = 0, skip = 0;
+    while (t < TILECOUNT)
+    {
+        if (!tilechanged(aCur, aPrev, t))
+        {
+            skip++;
+            t++;
+            continue;
+        }
+        int count = 0;
+        while (t + count < TILECOUNT && count < 255 && tilechanged(aCur, aPrev, t + count))
+            count++;
+        while (skip > 255)
+        {
+            aOut.push_back(255);
+            aOut.push_back(0);
+            aCycles += tileruncycles();
+            skip -= 255;
+        }
+        aOut.push_back(skip);
+        aOut.push_back(count);
+        aCycles += tileruncycles();
+        for (int i = 0; i < count; i++, t++)
+        {
+            int ofs = (t / TILECOLS) * 8 * FLX_WIDTH + (t % TILECOLS) * 8;
+            for (int y = 0; y < 8; y++, ofs += FLX_WIDTH)
+                aOut.insert(aOut.end(), aCur + ofs, aCur + ofs + 8);
+            aCycles += tilecycles();
+        }
+        skip = 0;
+    }
+}
+
+struct Frame
+{
+    unsigned char *mPixels;
+    std::vector<unsigned char> mChunk; // type, size, data, checksum
+    int mType;
+    int mCycles;
+    int mPalette; // index to the palettes
+    const char *mError;
+};
+
+struct Palette
+{
+    unsigned char mColor[512]; // 9-bit, as in the file header
+};
+
+// Decode cycles allowed per frame, 0 = just make the smallest file
+static int gBudget = 0;
+
+static void makechunk(Frame &aFrame, int aType, const unsigned char *aData, int aLen)
+{
+    std::vector<unsigned char> &c = aFrame.mChunk;
+    unsigned short sum = checksum(aFrame.mPixels);
+    c.clear();
+    c.push_back(aType);
+    c.push_back(aLen & 0xff);
+    c.push_back(aLen >> 8);
+    c.insert(c.end(), aData, aData + aLen);
+    c.push_back(sum & 0xff);
+    c.push_back(sum >> 8);
+    aFrame.mType = aType;
+}
+
+struct Candidate
+{
+    const LzFormat *mFormat;
+    std::vector<unsigned char> mBlock;
+    int mCycles;
+};
+
+// Keeps the smallest candidate within budget in aBest, and the one with
+// the fewest cycles in aFastest in case nothing fits.
+static void consider(Candidate &aCand, Candidate &aBest, Candidate &aFastest)
+{
+    if ((!gBudget || aCand.mCycles <= gBudget) &&
+        (!aBest.mFormat || aCand.mBlock.size() < aBest.mBlock.size()))
+    {
+        aBest.mFormat = aCand.mFormat;
+        aBest.mBlock = aCand.mBlock;
+        aBest.mCycles = aCand.mCycles;
+    }
+    if (!aFastest.mFormat || aCand.mCycles < aFastest.mCycles)
+    {
+        aFastest.mFormat = aCand.mFormat;
+        aFastest.mBlock = aCand.mBlock;
+        aFastest.mCycles = aCand.mCycles;
+    }
+}
+
+// aPrev is NULL for the first frame: its framebuffer is also the
+// "previous" one, so only chunks that don't read it can be used.
+static void encodeframe(Frame &aFrame, const unsigned char *aPrev)
+{
+    const unsigned char *cur = aFrame.mPixels;
+    if (aPrev && memcmp(cur, aPrev, FRAMESIZE) == 0)
+    {
+        makechunk(aFrame, SAMEFRAME, 0, 0);
+        aFrame.mCycles = fullscreencycles(SAMEFRAME);
+        return;
+    }
+    int i = 1;
+    while (i < FRAMESIZE && cur[i] == cur[0])
+        i++;
+    if (i == FRAMESIZE)
+    {
+        if (cur[0] == 0)
+            makechunk(aFrame, BLACKFRAME, 0, 0);
+        else
+            makechunk(aFrame, ONECOLOR, cur, 1);
+        aFrame.mCycles = fullscreencycles(aFrame.mType);
+        return;
+    }
+
+    Matches *m = new Matches;
+    findmatches(cur, aPrev, *m);
+    Candidate cand, best, fastest;
+    best.mFormat = 0;
+    fastest.mFormat = 0;
+    for (int i = 0; i < FORMATS; i++)
+    {
+        if (!aPrev && needsprev(gFormats[i]))
+            continue;
+        cand.mFormat = &gFormats[i];
+        if (lzencode(gFormats[i], cur, *m, 0, cand.mBlock, cand.mCycles) >= 0)
+            consider(cand, best, fastest);
+    }
+    if (gBudget && (!best.mFormat || best.mCycles > gBudget))
+    {
+        // Trade bytes for cycles: find the smallest weight on cycles
+        // that brings each format under budget.
+        for (int i = 0; i < FORMATS; i++)
+        {
+            if (!aPrev && needsprev(gFormats[i]))
+                continue;
+            cand.mFormat = &gFormats[i];
+            // Heaviest weight first; if even that doesn't fit, it's as
+            // fast as this format gets.
+            double lo = 1.0 / 65536, hi = 16;
+            if (lzencode(gFormats[i], cur, *m, hi, cand.mBlock, cand.mCycles) < 0)
+                continue;
+            consider(cand, best, fastest);
+            if (cand.mCycles > gBudget)
+                continue;
+            // Bisect in log space
+            for (int j = 0; j < 6; j++)
+            {
+                double mid = sqrt(lo * hi);
+                // A weight it can't encode at counts as too slow;
+                // cand.mCycles would be left over from the last try.
+                if (lzencode(gFormats[i], cur, *m, mid, cand.mBlock, cand.mCycles) < 0)
+                {
+                    lo = mid;
+                    continue;
+                }
+                consider(cand, best, fastest);
+                if (cand.mCycles <= gBudget)
+                    hi = mid;
+                else
+                    lo = mid;
+            }
+        }
+    }
+    delete m;
+
+    if (aPrev)
+    {
+        cand.mFormat = &gTileFormat;
+        tileencode(cur, aPrev, cand.mBlock, cand.mCycles);
+        consider(cand, best, fastest);
+    }
+
+    Candidate &c = best.mFormat ? best : fastest;
+    if (!c.mFormat)
+    {
+        aFrame.mError = "No chunk type fits";
+        return;
+    }
+    // Catch encoder bugs here rather than on the Next
+    std::vector<unsigned char> check(FRAMESIZE);
+    int bad = c.mFormat == &gTileFormat ?
+        tiledecode(c.mBlock.data(), (int)c.mBlock.size(), aPrev, check.data()) :
+        lzdecode(*c.mFormat, c.mBlock.data(), (int)c.mBlock.size(), aPrev, check.data());
+    if (bad || memcmp(check.data(), cur, FRAMESIZE) != 0)
+    {
+        aFrame.mError = "Encoded frame does not decode back";
+        return;
+    }
+    makechunk(aFrame, c.mFormat->mType, c.mBlock.data(), (int)c.mBlock.size());
+    aFrame.mCycles = c.mCycles;
+}
+
+// Centers aSrc (aWidth x aHeight) on the FLX frame, cropping or padding
+// with color 0.
+static void blitframe(const unsigned char *aSrc, int aWidth, int aHeight, int aStride, unsigned char *aDst)
+{
+    memset(aDst, 0, FRAMESIZE);
+    int sx = aWidth > FLX_WIDTH ? (aWidth - FLX_WIDTH) / 2 : 0;
+    int sy = aHeight > FLX_HEIGHT ? (aHeight - FLX_HEIGHT) / 2 : 0;
+    int dx = aWidth < FLX_WIDTH ? (FLX_WIDTH - aWidth) / 2 : 0;
+    int dy = aHeight < FLX_HEIGHT ? (FLX_HEIGHT - aHeight) / 2 : 0;
+    int w = aWidth < FLX_WIDTH ? aWidth : FLX_WIDTH;
+    int h = aHeight < FLX_HEIGHT ? aHeight : FLX_HEIGHT;
+    for (int y = 0; y < h; y++)
+        memcpy(aDst + (dy + y) * FLX_WIDTH + dx, aSrc + (sy + y) * aStride + sx, w);
+}
+
+// 8 bit component to the 3 bits the Next palette has
+static int to3(int aValue)
+{
+    return (aValue * 7 + 127) / 255;
+}
+
+static void nextcolor(int r, int g, int b, unsigned char *aOut)
+{
+    int c = (r << 6) | (g << 3) | b;
+    aOut[0] = c >> 1;
+    aOut[1] = c & 1;
+}
+
+static int hasext(const char *aName, const char *aExt)
+{
+    int l = (int)strlen(aName), e = (int)strlen(aExt);
+    if (l < e)
+        return 0;
+    for (int i = 0; i < e; i++)
+        if ((aName[l - e + i] | 0x20) != aExt[i])
+            return 0;
+    return 1;
+}
+
+template <typename T>
+static void runpool(size_t aCount, int aThreads, T aFunc)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < aThreads; i++)
+    {
+        pool.emplace_back([&]() {
+            size_t n;
+            while ((n = next++) < aCount)
+                aFunc(n);
+        });
+    }
+    for (auto &t : pool)
+        t.join();
+}
+
+static void newframe(Frame &aFrame, int aPalette)
+{
+    aFrame.mPixels = (unsigned char *)malloc(FRAMESIZE);
+    aFrame.mType = -1;
+    aFrame.mCycles = 0;
+    aFrame.mPalette = aPalette;
+    aFrame.mError = 0;
+}
+
+// Span of entries that differ between two palettes; returns the count
+static int palettedelta(const Palette &aFrom, const Palette &aTo, int &aFirst)
+{
+    int first = 0, last = 255;
+    while (first < 256 && memcmp(aFrom.mColor + first * 2, aTo.mColor + first * 2, 2) == 0)
+        first++;
+    if (first == 256)
+        return 0;
+    while (memcmp(aFrom.mColor + last * 2, aTo.mColor + last * 2, 2) == 0)
+        last--;
+    aFirst = first;
+    return last - first + 1;
+}
+
+// Bytes a PALETTE chunk from aFrom to aTo takes, 0 if none is needed
+static int palettebytes(const Palette &aFrom, const Palette &aTo)
+{
+    int first, count = palettedelta(aFrom, aTo, first);
+    return count ? 3 + count * 2 : 0;
+}
+
+static int loadfli(const char *aFilename, std::vector<Frame> &aFrames, std::vector<Palette> &aPalettes, int &aSpeed)
+{
+    FLI *fli = fli_open_stream((char *)aFilename);
+    if (!fli)
+    {
+        printf("Unable to open \"%s\" as FLI/FLC\n", aFilename);
+        return 0;
+    }
+    // Frame delay: FLC in milliseconds, FLI in 1/70 seconds
+    FILE *f = fopen(aFilename, "rb");
+    unsigned char hdr[20];
+    if (aSpeed == 0 && fread(hdr, 1, 20, f) == 20)
+    {
+        int delay = hdr[16] | (hdr[17] << 8);
+        aSpeed = (hdr[4] == 0x11) ? (delay * 50 + 35) / 70 : (delay * 50 + 500) / 1000;
+    }
+    fclose(f);
+
+    printf("%s: %dx%d, %d frames\n", aFilename, fli->mXSize, fli->mYSize, fli->mMaxframe);
+    // Each frame is a delta on the last, so this stays one pass front to
+    // back; the frames are encoded on the pool once they're all here.
+    int frames = fli->mMaxframe;
+    for (int i = 0; i < frames; i++)
+    {
+        fli->mPaletteChange = 0;
+        fli_render(fli);
+        if (i == 0 || fli->mPaletteChange)
+        {
+            Palette pal;
+            for (int j = 0; j < 256; j++)
+                nextcolor(to3(fli->mPalette[j * 3 + 0]), to3(fli->mPalette[j * 3 + 1]), to3(fli->mPalette[j * 3 + 2]), pal.mColor + j * 2);
+            // Changes the Next can't see don't need a chunk
+            if (i == 0 || memcmp(pal.mColor, aPalettes.back().mColor, 512) != 0)
+                aPalettes.push_back(pal);
+        }
+        Frame fr;
+        newframe(fr, (int)aPalettes.size() - 1);
+        blitframe(fli->mFramebuffer, fli->mXSize, fli->mYSize, fli->mXSize, fr.mPixels);
+        aFrames.push_back(fr);
+    }
+    fli_free(fli);
+    if (aPalettes.size() > 1)
+        printf("%d palette changes\n", (int)aPalettes.size() - 1);
+    return 1;
+}
+
+// Median cut of a 9-bit color histogram to 256 entries; aMap gets the
+// index for every 9-bit color.
+static int quantize(const int *aCounts, unsigned char *aMap, Palette &aPalette)
+{
+    int entry[512];
+    unsigned char histcolor[512 * 3];
+    int histcount[512];
+    int unique = 0;
+    for (int i = 0; i < 512; i++)
+    {
+        entry[i] = unique;
+        if (aCounts[i])
+        {
+            histcolor[unique * 3 + 0] = i >> 6;
+            histcolor[unique * 3 + 1] = (i >> 3) & 7;
+            histcolor[unique * 3 + 2] = i & 7;
+            histcount[unique] = aCounts[i];
+            unique++;
+        }
+    }
+    unsigned char *idx, *pal;
+    int palcount = sq_reduce_histogram(histcolor, histcount, unique, 3, &idx, &pal, 256);
+    for (int i = 0; i < 256; i++)
+        nextcolor(pal[i * 3 + 0], pal[i * 3 + 1], pal[i * 3 + 2], aPalette.mColor + i * 2);
+    for (int i = 0; i < 512; i++)
+        aMap[i] = aCounts[i] ? idx[entry[i]] : 0;
+    free(idx);
+    free(pal);
+    return palcount;
+}
+
+// Padding uses index 0, whatever color that is
+static void mapframe(const unsigned short *aColors, const unsigned char *aMap, unsigned char *aOut)
+{
+    for (int j = 0; j < FRAMESIZE; j++)
+        aOut[j] = aColors[j] == 0xffff ? 0 : aMap[aColors[j]];
+}
+
+// Images are reduced to 9 bits, one palette is made for all of them and
+// every pixel maps exactly to one of its (at most 512) colors.
+//
+// If that takes more than 256 colors, the images are also split into
+// scenes where the colors change a lot, each with a palette of its own,
+// put in aAlt (palette 1 + scene number). aScenes gets the first frame
+// of each scene.
+static int loadimages(char **aFilenames, int aCount, std::vector<Frame> &aFrames, std::vector<Frame> &aAlt, std::vector<int> &aScenes, std::vector<Palette> &aPalettes)
+{
+    std::vector<unsigned short *> colors;
+    std::vector<int> imagecounts(512 * aCount, 0);
+    int counts[512];
+    for (int i = 0; i < 512; i++)
+        counts[i] = 0;
+    for (int i = 0; i < aCount; i++)
+    {
+        int x, y, n;
+        unsigned char *data = stbi_load(aFilenames[i], &x, &y, &n, 4);
+        if (!data)
+        {
+            printf("Unable to read \"%s\"\n", aFilenames[i]);
+            return 0;
+        }
+        unsigned short *c = (unsigned short *)malloc(sizeof(unsigned short) * x * y);
+        for (int j = 0; j < x * y; j++)
+        {
+            c[j] = (to3(data[j * 4 + 0]) << 6) | (to3(data[j * 4 + 1]) << 3) | to3(data[j * 4 + 2]);
+        }
+        stbi_image_free(data);
+        // crop while still 16 bit, then squash to indices below
+        unsigned short *framec = (unsigned short *)malloc(sizeof(unsigned short) * FRAMESIZE);
+        for (int j = 0; j < FRAMESIZE; j++)
+            framec[j] = 0xffff;
+        int sx = x > FLX_WIDTH ? (x - FLX_WIDTH) / 2 : 0;
+        int sy = y > FLX_HEIGHT ? (y - FLX_HEIGHT) / 2 : 0;
+        int dx = x < FLX_WIDTH ? (FLX_WIDTH - x) / 2 : 0;
+        int dy = y < FLX_HEIGHT ? (FLX_HEIGHT - y) / 2 : 0;
+        for (int yy = 0; yy < (y < FLX_HEIGHT ? y : FLX_HEIGHT); yy++)
+            for (int xx = 0; xx < (x < FLX_WIDTH ? x : FLX_WIDTH); xx++)
+            {
+                unsigned short v = c[(sy + yy) * x + sx + xx];
+                framec[(dy + yy) * FLX_WIDTH + dx + xx] = v;
+                counts[v]++;
+                imagecounts[i * 512 + v]++;
+            }
+        free(c);
+        colors.push_back(framec);
+    }
+
+    int unique = 0;
+    for (int i = 0; i < 512; i++)
+        if (counts[i])
+            unique++;
+    unsigned char map[512];
+    Palette global;
+    int palcount = quantize(counts, map, global);
+    aPalettes.push_back(global);
+    printf("%d images, %d unique colors, %d in palette\n", aCount, unique, palcount);
+    for (size_t i = 0; i < colors.size(); i++)
+    {
+        Frame fr;
+        newframe(fr, 0);
+        mapframe(colors[i], map, fr.mPixels);
+        aFrames.push_back(fr);
+    }
+
+    if (unique > 256)
+    {
+        // A cut is where over half of the pixels changed color
+        aScenes.push_back(0);
+        for (int i = 1; i < aCount; i++)
+        {
+            int diff = 0;
+            for (int j = 0; j < 512; j++)
+                diff += abs(imagecounts[i * 512 + j] - imagecounts[(i - 1) * 512 + j]);
+            if (diff > FRAMESIZE)
+                aScenes.push_back(i);
+        }
+        if (aScenes.size() > 1)
+        {
+            for (size_t s = 0; s < aScenes.size(); s++)
+            {
+                int end = s + 1 < aScenes.size() ? aScenes[s + 1] : aCount;
+                for (int i = 0; i < 512; i++)
+                    counts[i] = 0;
+                for (int i = aScenes[s]; i < end; i++)
+                    for (int j = 0; j < 512; j++)
+                        counts[j] += imagecounts[i * 512 + j];
+                Palette pal;
+                quantize(counts, map, pal);
+                aPalettes.push_back(pal);
+                for (int i = aScenes[s]; i < end; i++)
+                {
+                    Frame fr;
+                    newframe(fr, (int)aPalettes.size() - 1);
+                    mapframe(colors[i], map, fr.mPixels);
+                    aAlt.push_back(fr);
+                }
+            }
+            printf("%d scenes\n", (int)aScenes.size());
+        }
+        else
+            aScenes.clear();
+    }
+    for (size_t i = 0; i < colors.size(); i++)
+        free(colors[i]);
+    return 1;
+}
+
+// Encodes the frames both with the single palette and with scene
+// palettes, then keeps whichever is smaller for every scene, counting
+// the PALETTE chunks the switches take.
+static void choosescenes(std::vector<Frame> &aFrames, std::vector<Frame> &aAlt, const std::vector<int> &aScenes, const std::vector<Palette> &aPalettes, int aThreads)
+{
+    std::vector<char> first(aFrames.size(), 0);
+    for (int f : aScenes)
+        first[f] = 1;
+    runpool(aFrames.size(), aThreads, [&](size_t n) {
+        encodeframe(aFrames[n], n ? aFrames[n - 1].mPixels : 0);
+    });
+    // Scene palettes start off after the single palette frame before
+    runpool(aAlt.size(), aThreads, [&](size_t n) {
+        encodeframe(aAlt[n], n ? (first[n] ? aFrames[n - 1].mPixels : aAlt[n - 1].mPixels) : 0);
+    });
+
+    for (size_t i = 0; i < aFrames.size(); i++)
+        if (aAlt[i].mError && !aFrames[i].mError)
+            aFrames[i].mError = aAlt[i].mError;
+    for (auto &fr : aFrames)
+        if (fr.mError)
+            return; // reported by the caller
+
+    // Shortest path over the scenes, the state being whether the scene
+    // uses its own palette. Switching palettes costs a chunk, and so does
+    // going from the last scene's palette back to the first's on loop.
+    int scenes = (int)aScenes.size();
+    std::vector<long> size[2];
+    for (int c = 0; c < 2; c++)
+    {
+        size[c].resize(scenes, 0);
+        for (int s = 0; s < scenes; s++)
+        {
+            int end = s + 1 < scenes ? aScenes[s + 1] : (int)aFrames.size();
+            for (int i = aScenes[s]; i < end; i++)
+                size[c][s] += (long)(c ? aAlt[i] : aFrames[i]).mChunk.size();
+        }
+    }
+    auto pal = [&](int s, int c) -> const Palette & { return aPalettes[c ? 1 + s : 0]; };
+    std::vector<char> own(scenes, 0);
+    long best = -1;
+    for (int c0 = 0; c0 < 2; c0++)
+    {
+        std::vector<long> cost(2 * scenes);
+        std::vector<char> from(2 * scenes, 0);
+        cost[0 + c0] = size[c0][0];
+        cost[0 + (c0 ^ 1)] = -1;
+        for (int s = 1; s < scenes; s++)
+            for (int c = 0; c < 2; c++)
+            {
+                cost[s * 2 + c] = -1;
+                for (int p = 0; p < 2; p++)
+                {
+                    if (cost[(s - 1) * 2 + p] < 0)
+                        continue;
+                    long v = cost[(s - 1) * 2 + p] + size[c][s] + palettebytes(pal(s - 1, p), pal(s, c));
+                    if (cost[s * 2 + c] < 0 || v < cost[s * 2 + c])
+                    {
+                        cost[s * 2 + c] = v;
+                        from[s * 2 + c] = (char)p;
+                    }
+                }
+            }
+        for (int c = 0; c < 2; c++)
+        {
+            long v = cost[(scenes - 1) * 2 + c];
+            if (v < 0)
+                continue;
+            v += palettebytes(pal(scenes - 1, c), pal(0, c0));
+            if (best < 0 || v < best)
+            {
+                best = v;
+                int k = c;
+                for (int s = scenes - 1; s >= 0; s--)
+                {
+                    own[s] = (char)k;
+                    k = from[s * 2 + k];
+                }
+            }
+        }
+    }
+    int kept = 0;
+    for (int s = 0; s < scenes; s++)
+    {
+        int end = s + 1 < scenes ? aScenes[s + 1] : (int)aFrames.size();
+        kept += own[s];
+        if (own[s])
+            for (int i = aScenes[s]; i < end; i++)
+                std::swap(aFrames[i], aAlt[i]);
+    }
+    for (auto &fr : aAlt)
+        free(fr.mPixels);
+    aAlt.clear();
+    printf("%d of %d scenes use their own palette\n", kept, (int)aScenes.size());
+
+    // A scene's first frame was encoded after a single palette frame
+    std::vector<int> redo;
+    for (size_t s = 1; s < aScenes.size(); s++)
+        if (own[s - 1])
+            redo.push_back(aScenes[s]);
+    runpool(redo.size(), aThreads, [&](size_t n) {
+        encodeframe(aFrames[redo[n]], aFrames[redo[n] - 1].mPixels);
+    });
+}
+
+static void writeword(FILE *f, int aValue)
+{
+    fputc(aValue & 0xff, f);
+    fputc((aValue >> 8) & 0xff, f);
+}
+
+int main(int parc, char ** pars)
+{
+    int threads = (int)std::thread::hardware_concurrency();
+    int speed = 0;
+    int maxframes = 0;
+    int budget = 0;
+    int first = 0;
+    for (int i = 1; i < parc && !first; i++)
+    {
+        if (strcmp(pars[i], "-j") == 0 && i + 1 < parc)
+            threads = atoi(pars[++i]);
+        else
+        if (strcmp(pars[i], "-speed") == 0 && i + 1 < parc)
+            speed = atoi(pars[++i]);
+        else
+        if (strcmp(pars[i], "-frames") == 0 && i + 1 < parc)
+            maxframes = atoi(pars[++i]);
+        else
+        if (strcmp(pars[i], "-budget") == 0 && i + 1 < parc)
+            budget = atoi(pars[++i]);
+        else
+        if (strcmp(pars[i], "-costs") == 0 && i + 1 < parc)
+        {
+            if (!loadcosts(pars[++i]))
+            {
+                printf("Unable to read \"%s\"\n", pars[i]);
+                return 1;
+            }
+        }
+        else
+        if (pars[i][0] == '-')
+        {
+            printf("Unknown option \"%s\"\n", pars[i]);
+            return 1;
+        }
+        else
+            first = i;
+    }
+    if (!first || first + 1 >= parc)
+    {
+        printf(
+            "Usage: [options] output.flx input.fli|input.flc\n"
+            "   or: [options] output.flx image [image..]\n"
+            "       Frames are centered on 256x192, cropping or padding as needed.\n"
+            "Options:\n"
+            "  -j threads   encoder threads (default: all cores)\n"
+            "  -speed n     50Hz frames per animation frame (default: from FLI/FLC, 2 for images)\n"
+            "  -frames n    only encode the first n frames\n"
+            "  -budget pct  keep decoding within pct%% of the frame time given by speed,\n"
+            "               growing the file where needed (default: smallest file)\n"
+            "  -costs file  decode cycle model, \"name value\" lines (see gCostNames)\n");
+        return 1;
+    }
+    const char *outfile = pars[first];
+    std::vector<Frame> frames, alt;
+    std::vector<int> scenes;
+    std::vector<Palette> palettes;
+    if (first + 2 == parc && (hasext(pars[first + 1], ".fli") || hasext(pars[first + 1], ".flc")))
+    {
+        if (!loadfli(pars[first + 1], frames, palettes, speed))
+            return 1;
+    }
+    else
+    {
+        if (!loadimages(pars + first + 1, parc - first - 1, frames, alt, scenes, palettes))
+            return 1;
+        if (speed == 0)
+            speed = 2;
+    }
+    if (speed < 1)
+        speed = 1;
+    if (maxframes > 0 && maxframes < (int)frames.size())
+    {
+        for (size_t i = maxframes; i < frames.size(); i++)
+            free(frames[i].mPixels);
+        frames.resize(maxframes);
+        if (!alt.empty())
+        {
+            for (size_t i = maxframes; i < alt.size(); i++)
+                free(alt[i].mPixels);
+            alt.resize(maxframes);
+        }
+        while (!scenes.empty() && scenes.back() >= maxframes)
+            scenes.pop_back();
+    }
+    if (frames.empty() || frames.size() > 0xffff)
+    {
+        printf("Bad frame count %d\n", (int)frames.size());
+        return 1;
+    }
+    // 28MHz, 50Hz
+    if (budget > 0)
+        gBudget = (int)((long long)speed * 560000 * budget / 100);
+    if (threads < 1)
+        threads = 1;
+    if (threads > (int)frames.size())
+        threads = (int)frames.size();
+
+    // Frames only depend on their predecessor's pixels, which are known
+    // up front, so hand them out one at a time.
+    if (scenes.size() > 1)
+        choosescenes(frames, alt, scenes, palettes, threads);
+    else
+        runpool(frames.size(), threads, [&](size_t n) {
+            encodeframe(frames[n], n ? frames[n - 1].mPixels : 0);
+        });
+    for (auto &fr : alt)
+        free(fr.mPixels);
+
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        if (frames[i].mError)
+        {
+            printf("Frame %d: %s\n", (int)i, frames[i].mError);
+            return 1;
+        }
+    }
+
+    FILE *f = fopen(outfile, "wb");
+    if (!f)
+    {
+        printf("Unable to open %s\n", outfile);
+        return 1;
+    }
+    fwrite("FLX!", 1, 4, f);
+    writeword(f, (int)frames.size());
+    writeword(f, speed);
+    writeword(f, 0); // config: 256x192
+    writeword(f, 0); // drawoffset
+    writeword(f, HEADERSIZE); // loop from the first frame, which doesn't use the previous one
+    fwrite(palettes[frames[0].mPalette].mColor, 1, 512, f);
+    int counts[64];
+    memset(counts, 0, sizeof(counts));
+    long total = HEADERSIZE;
+    long long cycles = 0;
+    int maxcycles = 0, over = 0;
+    // The first frame sets the palette back for looping; the first time
+    // through it's the one from the header already.
+    int current = frames.back().mPalette;
+    for (auto &fr : frames)
+    {
+        if (fr.mPalette != current)
+        {
+            int pfirst, pcount = palettedelta(palettes[current], palettes[fr.mPalette], pfirst);
+            if (pcount)
+            {
+                fputc(PALETTE, f);
+                fputc(pfirst, f);
+                fputc(pcount & 0xff, f);
+                fwrite(palettes[fr.mPalette].mColor + pfirst * 2, 1, pcount * 2, f);
+                total += 3 + pcount * 2;
+                counts[PALETTE]++;
+            }
+            current = fr.mPalette;
+        }
+        fwrite(fr.mChunk.data(), 1, fr.mChunk.size(), f);
+        fputc(NEXTFRAME, f);
+        total += (long)fr.mChunk.size() + 1;
+        counts[fr.mType]++;
+        cycles += fr.mCycles;
+        if (maxcycles < fr.mCycles)
+            maxcycles = fr.mCycles;
+        if (gBudget && fr.mCycles > gBudget)
+            over++;
+        free(fr.mPixels);
+    }
+    fclose(f);
+
+    printf("%s: %d frames, speed %d, %ld bytes (%ld per frame)\n", outfile, (int)frames.size(), speed, total, (total - HEADERSIZE) / (long)frames.size());
+    for (int i = 0; i < 64; i++)
+        if (counts[i])
+            printf("  %-10s %d\n", chunkname(i), counts[i]);
+    printf("Decode cycles per frame: %lld average, %d max", cycles / (long long)frames.size(), maxcycles);
+    if (gBudget)
+        printf(", budget %d, %d frames over", gBudget, over);
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,331 @@
+/*
+ * Part of Jari Komppa's zx spectrum next suite
+ * https://github.com/jarikomppa/specnext
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
+ */
+
+// Lookup table generator for vortex / tunnel effects.
+//
+// Every entry maps a screen position to a texture coordinate. Each
+// vortex contributes k / distance to its center as u and the angle
+// around it as v; the contributions are summed by weight, scaled,
+// wrapped to the given number of bits and stored as u | v << bits.
+// One vortex in the middle is the classic tunnel.
+//
+// Rows are evaluated on a thread pool, a row at a time with the math
+// laid out over arrays so the compiler can vectorize the parts libm
+// allows. With no options this gives nextest/vortex.h, byte for byte.
+//
+// Output is C (one "n," per entry, a row per line, for #including in an
+// array) for .h/.c/.inc files and raw bytes otherwise. Entries are packed
+// a byte each, a word each (little endian) or two per byte (low nibble
+// first). -pages splits the output into 8K files that each hold whole
+// rows, padded with zeros, ready to be loaded into a MMU page.
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#define PAGESIZE 8192
+#define MAXVORTICES 16
+
+enum Packing
+{
+    PACK_NIBBLE,
+    PACK_BYTE,
+    PACK_WORD
+};
+
+struct Vortex
+{
+    float mX, mY;  // center, from the middle, in 256ths of the table
+    float mWeight;
+};
+
+static int gWidth = 128;
+static int gHeight = 96;
+static int gBits = 4;
+static double gDist = 0.2;   // u = dist / distance to center
+static float gScale = 32.0f; // texels per unit of u and v
+static int gVortices = 0;
+static Vortex gVortex[MAXVORTICES];
+
+// The angle goes to -0.5..0.5 per turn. pi is 355/113 as it was in
+// genvortex, so that the tables already built come out the same.
+static const float gInvPi2 = (float)(1.0 / (355.0 / 113.0));
+
+static void evalrow(int aRow, int *aOut)
+{
+    std::vector<float> x(gWidth), u(gWidth, 0.0f), v(gWidth, 0.0f), cx(gWidth), dist(gWidth), angle(gWidth);
+    float y = aRow / (float)gHeight;
+    for (int i = 0; i < gWidth; i++)
+        x[i] = i / (float)gWidth;
+    for (int n = 0; n < gVortices; n++)
+    {
+        const Vortex &vx = gVortex[n];
+        float cy = (float)(y - vx.mY / 256.0) - 0.5f;
+        for (int i = 0; i < gWidth; i++)
+            cx[i] = (float)(x[i] - vx.mX / 256.0) - 0.5f;
+        for (int i = 0; i < gWidth; i++)
+            dist[i] = (float)(gDist / sqrt((double)(cx[i] * cx[i] + cy * cy)));
+        for (int i = 0; i < gWidth; i++)
+            angle[i] = (float)(atan2((double)cx[i], (double)cy) * gInvPi2);
+        for (int i = 0; i < gWidth; i++)
+        {
+            u[i] += vx.mWeight * dist[i];
+            v[i] += vx.mWeight * angle[i];
+        }
+    }
+    int mask = (1 << gBits) - 1;
+    for (int i = 0; i < gWidth; i++)
+    {
+        // 8192 keeps the floor positive for any sane table
+        int tu = (int)floorf(8192 + u[i] * gScale) & mask;
+        int tv = (int)floorf(8192 + v[i] * gScale) & mask;
+        aOut[i] = tu | (tv << gBits);
+    }
+}
+
+template <typename T>
+static void runpool(size_t aCount, int aThreads, T aFunc)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < aThreads; i++)
+    {
+        pool.emplace_back([&]() {
+            size_t n;
+            while ((n = next++) < aCount)
+                aFunc(n);
+        });
+    }
+    for (auto &t : pool)
+        t.join();
+}
+
+static int hasext(const char *aName, const char *aExt)
+{
+    int l = (int)strlen(aName), e = (int)strlen(aExt);
+    if (l < e)
+        return 0;
+    for (int i = 0; i < e; i++)
+        if ((aName[l - e + i] | 0x20) != aExt[i])
+            return 0;
+    return 1;
+}
+
+static void pack(const int *aEntries, int aCount, int aPacking, std::vector<unsigned char> &aOut)
+{
+    for (int i = 0; i < aCount; i++)
+    {
+        switch (aPacking)
+        {
+            case PACK_NIBBLE:
+                if (i & 1)
+                    aOut.back() |= aEntries[i] << 4;
+                else
+                    aOut.push_back(aEntries[i]);
+                break;
+            case PACK_BYTE:
+                aOut.push_back(aEntries[i]);
+                break;
+            case PACK_WORD:
+                aOut.push_back(aEntries[i] & 0xff);
+                aOut.push_back(aEntries[i] >> 8);
+                break;
+        }
+    }
+}
+
+static int writefile(const char *aFilename, const unsigned char *aData, int aLen, int aRowBytes, int aText)
+{
+    FILE *f = fopen(aFilename, aText ? "w" : "wb");
+    if (!f)
+    {
+        printf("Unable to open %s\n", aFilename);
+        return 0;
+    }
+    if (aText)
+    {
+        for (int i = 0; i < aLen; i++)
+        {
+            fprintf(f, "%d,", aData[i]);
+            if ((i + 1) % aRowBytes == 0 || i + 1 == aLen)
+                fprintf(f, "\n");
+        }
+    }
+    else
+    {
+        fwrite(aData, 1, aLen, f);
+    }
+    fclose(f);
+    return 1;
+}
+
+int main(int parc, char ** pars)
+{
+    int threads = (int)std::thread::hardware_concurrency();
+    int packing = -1;
+    int pages = 0;
+    int first = 0;
+    for (int i = 1; i < parc && !first; i++)
+    {
+        if (strcmp(pars[i], "-j") == 0 && i + 1 < parc)
+            threads = atoi(pars[++i]);
+        else
+        if (strcmp(pars[i], "-size") == 0 && i + 1 < parc)
+        {
+            if (sscanf(pars[++i], "%dx%d", &gWidth, &gHeight) != 2)
+                gWidth = 0;
+        }
+        else
+        if (strcmp(pars[i], "-vortex") == 0 && i + 1 < parc)
+        {
+            Vortex vx = { 0, 0, 1 };
+            if (gVortices == MAXVORTICES || sscanf(pars[++i], "%f,%f,%f", &vx.mX, &vx.mY, &vx.mWeight) < 2)
+            {
+                printf("Bad or too many vortices at \"%s\"\n", pars[i]);
+                return 1;
+            }
+            gVortex[gVortices++] = vx;
+        }
+        else
+        if (strcmp(pars[i], "-dist") == 0 && i + 1 < parc)
+            gDist = atof(pars[++i]);
+        else
+        if (strcmp(pars[i], "-scale") == 0 && i + 1 < parc)
+            gScale = (float)atof(pars[++i]);
+        else
+        if (strcmp(pars[i], "-bits") == 0 && i + 1 < parc)
+            gBits = atoi(pars[++i]);
+        else
+        if (strcmp(pars[i], "-pack") == 0 && i + 1 < parc)
+        {
+            i++;
+            if (strcmp(pars[i], "nibble") == 0)
+                packing = PACK_NIBBLE;
+            else
+            if (strcmp(pars[i], "byte") == 0)
+                packing = PACK_BYTE;
+            else
+            if (strcmp(pars[i], "word") == 0)
+                packing = PACK_WORD;
+            else
+            {
+                printf("Unknown packing \"%s\"\n", pars[i]);
+                return 1;
+            }
+        }
+        else
+        if (strcmp(pars[i], "-pages") == 0)
+            pages = 1;
+        else
+        if (pars[i][0] == '-')
+        {
+            fprintf(stderr, "Unknown option \"%s\"\n", pars[i]);
+            first = -1;
+        }
+        else
+            first = i;
+    }
+    if (first <= 0 || first + 1 != parc)
+    {
+        fprintf(stderr,
+            "Usage: [options] output\n"
+            "       Writes C (\"n,\" per entry, a row per line) for .h, .c and .inc, raw bytes otherwise.\n"
+            "Options:\n"
+            "  -j threads      threads (default: all cores)\n"
+            "  -size WxH       table size (default: 128x96)\n"
+            "  -vortex x,y[,w] add a vortex, centered x,y 256ths of the table from the middle,\n"
+            "                  with weight w (default: 1). Default: -20,80 + 60,-40,-1 + 0,0\n"
+            "  -dist k         u is k / distance from the center (default: 0.2)\n"
+            "  -scale s        texels per unit of u and v, v being one turn (default: 32)\n"
+            "  -bits n         bits of u and of v, entries are u | v << n (default: 4)\n"
+            "  -pack p         nibble, byte or word per entry (default: smallest that fits)\n"
+            "  -pages          split into 8K files of whole rows, output_0.ext, output_1.ext..\n");
+        return 1;
+    }
+    const char *outfile = pars[first];
+    if (gVortices == 0)
+    {
+        // nextest's vortex
+        gVortex[0] = { -20, 80, 1 };
+        gVortex[1] = { 60, -40, -1 };
+        gVortex[2] = { 0, 0, 1 };
+        gVortices = 3;
+    }
+    if (gWidth < 1 || gHeight < 1 || gWidth > 4096 || gHeight > 4096)
+    {
+        printf("Bad table size\n");
+        return 1;
+    }
+    if (gBits < 1 || gBits > 8)
+    {
+        printf("Bits must be 1..8\n");
+        return 1;
+    }
+    if (packing < 0)
+        packing = (gBits <= 2) ? PACK_NIBBLE : (gBits <= 4) ? PACK_BYTE : PACK_WORD;
+    if (gBits * 2 > (4 << packing))
+    {
+        printf("%d bit entries don't fit the packing\n", gBits * 2);
+        return 1;
+    }
+    if (packing == PACK_NIBBLE && (gWidth & 1))
+    {
+        printf("Nibble packed rows must be of even width\n");
+        return 1;
+    }
+    int rowbytes = (gWidth << packing) / 2;
+    if (pages && rowbytes > PAGESIZE)
+    {
+        printf("Rows of %d bytes don't fit a page\n", rowbytes);
+        return 1;
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > gHeight)
+        threads = gHeight;
+
+    std::vector<int> entries((size_t)gWidth * gHeight);
+    runpool(gHeight, threads, [&](size_t n) {
+        evalrow((int)n, entries.data() + n * gWidth);
+    });
+    std::vector<unsigned char> data;
+    pack(entries.data(), (int)entries.size(), packing, data);
+
+    int text = hasext(outfile, ".h") || hasext(outfile, ".c") || hasext(outfile, ".inc");
+    if (!pages)
+    {
+        if (!writefile(outfile, data.data(), (int)data.size(), rowbytes, text))
+            return 1;
+        printf("%s: %dx%d, %d bytes\n", outfile, gWidth, gHeight, (int)data.size());
+        return 0;
+    }
+    // name_0.ext, name_1.ext..
+    const char *ext = strrchr(outfile, '.');
+    if (!ext || strchr(ext, '/') || strchr(ext, '\\'))
+        ext = outfile + strlen(outfile);
+    int rows = PAGESIZE / rowbytes;
+    int count = (gHeight + rows - 1) / rows;
+    for (int p = 0; p < count; p++)
+    {
+        std::vector<unsigned char> page(PAGESIZE, 0);
+        int len = rows * rowbytes;
+        if ((size_t)(p * len + len) > data.size())
+            len = (int)data.size() - p * len;
+        memcpy(page.data(), data.data() + (size_t)p * rows * rowbytes, len);
+        char name[1024];
+        snprintf(name, sizeof(name), "%.*s_%d%s", (int)(ext - outfile), outfile, p, ext);
+        if (!writefile(name, page.data(), PAGESIZE, rowbytes, text))
+            return 1;
+    }
+    printf("%s: %dx%d, %d pages of %d rows\n", outfile, gWidth, gHeight, count, rows);
+    return 0;
+}
@@ -7,7 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include "../common/decode_ihx.h"
+#include "../common/decode_ihx.c"
 
 
 int main(int parc, char ** pars)
@@ -15,15 +15,15 @@ int main(int parc, char ** pars)
     if (parc < 3)
     {
         printf("Usage: input.ihx output.raw\n");
-        return 0;
+        return 1;
     }
     
     unsigned char *data = new unsigned char[0x10000];
     FILE * f = fopen(pars[1], "rb");
     if (!f)
     {
-        printf("File not found");
-        return 0;
+        printf("File not found: \"%s\"\n", pars[1]);
+        return 1;
     }
     fseek(f,0,SEEK_END);
     int len = ftell(f);
@@ -34,7 +34,14 @@ int main(int parc, char ** pars)
     src[len] = 0;
     int start, end;
     len = decode_ihx(src, len, data, start, end);
+    if (len < 0)
+        return 1;
     f = fopen(pars[2], "wb");
+    if (!f)
+    {
+        printf("Unable to open %s\n", pars[2]);
+        return 1;
+    }
     fwrite(data + start, 1, len, f);
     fclose(f);
     printf("%d bytes written\n", len);
@@ -1,52 +1,57 @@
 /*
- * Part of Jari Komppa's zx spectrum next suite 
+ * Part of Jari Komppa's zx spectrum next suite
  * https://github.com/jarikomppa/specnext
- * released under the unlicense, see http://unlicense.org 
- * (practically public domain) 
+ * released under the unlicense, see http://unlicense.org
+ * (practically public domain)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../common/decode_ihx.c"
+#include "../common/crc32c.c"
 
+typedef struct {
+    unsigned char Next[4];			//"Next"
+    unsigned char VersionNumber[4];	//"V1.1" = Gold distro. V1.2 allows entering with PC in a 16K bank >= 8.
+    unsigned char RAM_Required;		//0=768K, 1=1792K
+    unsigned char NumBanksToLoad;	//0-112 x 16K banks
+    unsigned char LoadingScreen;	//1 = layer2 at 16K page 9, 2=ULA loading, 4=LORES, 8=HiRes, 16=HIColour, +128 = don't load palette.
+    unsigned char BorderColour;		//0-7 ld a,BorderColour:out(254),a
+    unsigned short SP;				//Stack Pointer
+    unsigned short PC;				//Code Entry Point : $0000 = Don't run just load.
+    unsigned short NumExtraFiles;	//NumExtraFiles
+    unsigned char Banks[64 + 48];	//Which 16K Banks load.	: Bank 5 = $0000-$3fff, Bank 2 = $4000-$7fff, Bank 0 = $c000-$ffff
+    unsigned char loadingBar;		//Loading bar off=0/on=1
+    unsigned char loadingColour;	//Loading bar Layer2 index colour
+    unsigned char loadingBankDelay;	//Delay after each bank
+    unsigned char loadedDelay;		//Delay (frames) after loading before running
+    unsigned char dontResetRegs;	//Don't reset the registers
+    unsigned char CoreRequired[3];	//CoreRequired byte per value, decimal, not string. ordering... Major, Minor, Subminor
+    unsigned char HiResColours;		//to be anded with three, and shifted left three times, and add the mode number for hires and out (255),a
+    unsigned char EntryBank;		//V1.2: 0-112, this 16K bank will be paged in at $C000 before jumping to PC. The default is 0, which is the default upper 16K bank anyway.
+    unsigned short FileHandleAddress;
+    unsigned char ExpansionBusEnable;
+    unsigned char HasChecksum;
+    unsigned int  FirstBankOffset;
+    unsigned short CLIBufferAddress;
+    unsigned short CLIBufferSize;
+    unsigned char LoadingScreen2;
+    unsigned char HasCopperBlock;
+    unsigned char Tilemode[4];
+    unsigned char LoadingBarYPos;
+    unsigned char RestOf512Bytes[512 - (4 + 4 + 1 + 1 + 1 + 1 + 2 + 2 + 2 + 64 + 48 + 1 + 1 + 1 + 1 + 1 + 3 + 1 + 1 + 2 + 1 + 1 + 4 + 2 + 2 + 1 + 1 + 1 + 4 + 4)];
+    unsigned int  CRC;
+} NEXHEADER;
 
-void writehdr(int aRam, FILE * aF)
-{
-    struct {
-        unsigned char Next[4];			//"Next"
-        unsigned char VersionNumber[4];	//"V1.1" = Gold distro. V1.2 allows entering with PC in a 16K bank >= 8.
-        unsigned char RAM_Required;		//0=768K, 1=1792K
-        unsigned char NumBanksToLoad;	//0-112 x 16K banks
-        unsigned char LoadingScreen;	//1 = layer2 at 16K page 9, 2=ULA loading, 4=LORES, 8=HiRes, 16=HIColour, +128 = don't load palette.
-        unsigned char BorderColour;		//0-7 ld a,BorderColour:out(254),a
-        unsigned short SP;				//Stack Pointer
-        unsigned short PC;				//Code Entry Point : $0000 = Don't run just load.
-        unsigned short NumExtraFiles;	//NumExtraFiles
-        unsigned char Banks[64 + 48];	//Which 16K Banks load.	: Bank 5 = $0000-$3fff, Bank 2 = $4000-$7fff, Bank 0 = $c000-$ffff
-        unsigned char loadingBar;		//Loading bar off=0/on=1
-        unsigned char loadingColour;	//Loading bar Layer2 index colour
-        unsigned char loadingBankDelay;	//Delay after each bank
-        unsigned char loadedDelay;		//Delay (frames) after loading before running
-        unsigned char dontResetRegs;	//Don't reset the registers
-        unsigned char CoreRequired[3];	//CoreRequired byte per value, decimal, not string. ordering... Major, Minor, Subminor
-        unsigned char HiResColours;		//to be anded with three, and shifted left three times, and add the mode number for hires and out (255),a
-        unsigned char EntryBank;		//V1.2: 0-112, this 16K bank will be paged in at $C000 before jumping to PC. The default is 0, which is the default upper 16K bank anyway.
-        unsigned short FileHandleAddress;
-        unsigned char ExpansionBusEnable;
-        unsigned char HasChecksum;
-        unsigned int  FirstBankOffset;
-        unsigned short CLIBufferAddress;
-        unsigned short CLIBufferSize;
-        unsigned char LoadingScreen2;
-        unsigned char HasCopperBlock;
-        unsigned char Tilemode[4];
-        unsigned char LoadingBarYPos; 
-        unsigned char RestOf512Bytes[512 - (4 + 4 + 1 + 1 + 1 + 1 + 2 + 2 + 2 + 64 + 48 + 1 + 1 + 1 + 1 + 1 + 3 + 1 + 1 + 2 + 1 + 1 + 4 + 2 + 2 + 1 + 1 + 1 + 4 + 4)];
-        unsigned int  CRC;
-    } h;
+#define MAX_BANKS (64 + 48)
+#define BANK_SIZE 0x4000
+#define MAX_INPUTS 256
+
+void inithdr(NEXHEADER &h)
+{
     memset(&h, 0, sizeof(h));
-    
+
     h.Next[0] = 'N';
     h.Next[1] = 'e';
     h.Next[2] = 'x';
@@ -55,19 +60,49 @@ void writehdr(int aRam, FILE * aF)
     h.VersionNumber[1] = '1';
     h.VersionNumber[2] = '.';
     h.VersionNumber[3] = '1';
-    h.RAM_Required = aRam;
-    h.NumBanksToLoad = 1;
     h.SP = 0xffff;
     h.PC = 0xc000;
+}
+
+void writehdr(NEXHEADER &h, int aRam, FILE * aF)
+{
+    inithdr(h);
+    h.RAM_Required = aRam;
+    h.NumBanksToLoad = 1;
     h.Banks[0] = 1;
     //memcpy(&h.Banks[16], "Made with nexer  http://iki.fi/sol", 17 + 17);
-    
+
+    fwrite(&h, 1, sizeof(h), aF);
+}
+
+// Everything after the header goes through here so the checksum can be
+// calculated while the file is being written.
+unsigned int gCrc = 0;
+
+void crcwrite(const unsigned char * aData, int aLen, FILE * aF)
+{
+    gCrc = crc32c_update(gCrc, aData, aLen);
+    fwrite(aData, 1, aLen, aF);
+}
+
+// Finish the checksum with the header bytes and rewrite the header.
+void finishhdr(NEXHEADER &h, int aChecksum, FILE * aF)
+{
+    if (aChecksum)
+    {
+        // HasChecksum is a V1.3 field
+        h.VersionNumber[3] = '3';
+        h.HasChecksum = 1;
+        h.CRC = crc32c_update(gCrc, (const unsigned char *)&h, 508);
+        printf("crc   : %08x\n", h.CRC);
+    }
+    fseek(aF, 0, SEEK_SET);
     fwrite(&h, 1, sizeof(h), aF);
 }
 
 
 unsigned char * readfile(char * aFn, int &aLen)
-{    
+{
     FILE * f = fopen(aFn, "rb");
     if (!f)
     {
@@ -85,36 +120,423 @@ unsigned char * readfile(char * aFn, int &aLen)
     return src;
 }
 
-void writecode(char * aIhx, FILE *aF)
+// Returns 0 on failure.
+int writecode(char * aIhx, FILE *aF)
 {
-    unsigned char *data = new unsigned char[0x10000];
     int len;
     unsigned char *src = readfile(aIhx, len);
     if (src == 0)
-        exit(0);
+        return 0;
+    unsigned char *data = new unsigned char[0x10000];
     int start, end;
     len = decode_ihx(src, len, data, start, end);
-    if (start != 0xc000)
+    delete[] src;
+    if (len >= 0 && start != 0xc000)
+    {
+        printf("Start address is not 0xc000\n");
+        len = -1;
+    }
+    if (len >= 0)
+        crcwrite(data + start, len, aF);
+    delete[] data;
+    return len >= 0;
+}
+
+/*
+ * Linker mode: several ihx/raw inputs, each placed at a 16K bank.
+ *
+ * An ihx input bank:file.ihx is placed so that its lowest address lands
+ * at (address & 0x3fff) inside the given bank; anything past the end of
+ * the bank continues in the following bank numbers. A raw input
+ * bank:file.bin starts at offset 0 of the bank and continues likewise.
+ *
+ * All inputs go into one image of the banks, which are then written in
+ * the order the .nex loader expects (5, 2, 0, 1, 3, 4, 6..). Inputs may
+ * share a bank but not bytes. An ihx input is scanned for its extents
+ * first, as where its bytes land depends on its lowest address and they
+ * can't go into the image before they're known not to overlap another
+ * input; the second pass decodes straight into the image. Raw inputs
+ * are read into it as they are.
+ */
+
+struct Input
+{
+    char * mFilename;
+    int mBank;          // first bank
+    int mIhx;           // 1 = ihx, 0 = raw
+    int mBase;          // ihx: address that lands at the start of mBank
+    int mStart;         // ihx: lowest address; raw: 0
+    int mEnd;           // ihx: highest address; raw: size - 1
+};
+
+Input gInput[MAX_INPUTS];
+int gInputs = 0;
+unsigned char * gImage = 0; // all banks, MAX_BANKS * BANK_SIZE
+
+int nexbank(int aIndex)
+{
+    // .nex file stores banks 5, 2, 0, 1, 3, 4, 6, 7, 8..
+    static const int first[6] = { 5, 2, 0, 1, 3, 4 };
+    if (aIndex < 6)
+        return first[aIndex];
+    return aIndex;
+}
+
+int isihx(char * aFn)
+{
+    int l = (int)strlen(aFn);
+    if (l < 4)
+        return 0;
+    char * ext = aFn + l - 4;
+    return ext[0] == '.' &&
+        (ext[1] | 0x20) == 'i' &&
+        (ext[2] | 0x20) == 'h' &&
+        (ext[3] | 0x20) == 'x';
+}
+
+int parsenum(char * aStr)
+{
+    return (int)strtol(aStr, 0, 0);
+}
+
+// Where an address of an input lands, counting from the start of bank 0
+int inputpos(const Input &aIn, int aAddress)
+{
+    return aIn.mBank * BANK_SIZE + aAddress - aIn.mBase;
+}
+
+int addinput(char * aArg)
+{
+    char * colon = strchr(aArg, ':');
+    // bank number is before the first ':', so "5:c:\foo.ihx" works too
+    if (colon == 0 || colon == aArg)
+    {
+        printf("Input \"%s\" is not in bank:file format\n", aArg);
+        return 0;
+    }
+    if (gInputs == MAX_INPUTS)
+    {
+        printf("Too many inputs\n");
+        return 0;
+    }
+    *colon = 0;
+    Input &in = gInput[gInputs];
+    in.mBank = parsenum(aArg);
+    in.mFilename = colon + 1;
+    in.mIhx = isihx(in.mFilename);
+    if (in.mBank < 0 || in.mBank >= MAX_BANKS)
+    {
+        printf("Bank %d out of range for \"%s\"\n", in.mBank, in.mFilename);
+        return 0;
+    }
+    int srclen = 0;
+    unsigned char * src = 0;
+    if (in.mIhx)
+    {
+        src = readfile(in.mFilename, srclen);
+        if (src == 0)
+            return 0;
+        ihx_result r;
+        // empty window: validate and find extents only
+        if (decode_ihx_window(src, srclen, 0, 0, 0, r) != IHX_OK)
+        {
+            printf("%s: %s near line %d, column %d\n", in.mFilename, ihx_error_string(r.error), r.line, r.column);
+            delete[] src;
+            return 0;
+        }
+        in.mStart = r.start;
+        in.mEnd = r.end;
+        in.mBase = in.mStart & ~(BANK_SIZE - 1);
+    }
+    else
+    {
+        FILE * f = fopen(in.mFilename, "rb");
+        if (!f)
+        {
+            printf("File not found:\"%s\"\n", in.mFilename);
+            return 0;
+        }
+        fseek(f, 0, SEEK_END);
+        in.mStart = 0;
+        in.mEnd = ftell(f) - 1;
+        in.mBase = 0;
+        fclose(f);
+    }
+    int lastbank = in.mBank + (in.mEnd - in.mBase) / BANK_SIZE;
+    if (in.mEnd < in.mStart || lastbank >= MAX_BANKS)
+    {
+        if (in.mEnd < in.mStart)
+            printf("\"%s\" is empty\n", in.mFilename);
+        else
+            printf("\"%s\" doesn't fit, would end at bank %d\n", in.mFilename, lastbank);
+        delete[] src;
+        return 0;
+    }
+    for (int i = 0; i < gInputs; i++)
+    {
+        Input &o = gInput[i];
+        if (inputpos(o, o.mStart) <= inputpos(in, in.mEnd) && inputpos(in, in.mStart) <= inputpos(o, o.mEnd))
+        {
+            printf("\"%s\" overlaps \"%s\"\n", in.mFilename, o.mFilename);
+            delete[] src;
+            return 0;
+        }
+    }
+    if (gImage == 0)
+        gImage = (unsigned char *)calloc(MAX_BANKS, BANK_SIZE);
+    unsigned char * dst = gImage + in.mBank * BANK_SIZE;
+    if (in.mIhx)
+    {
+        // nothing else is within the extents, so whole banks can be given
+        ihx_result r;
+        decode_ihx_window(src, srclen, dst, in.mBase, in.mBase + (lastbank - in.mBank + 1) * BANK_SIZE, r);
+        delete[] src;
+    }
+    else
+    {
+        FILE * f = fopen(in.mFilename, "rb");
+        if (!f || (int)fread(dst, 1, in.mEnd + 1, f) != in.mEnd + 1)
+        {
+            printf("Unable to read \"%s\"\n", in.mFilename);
+            if (f)
+                fclose(f);
+            return 0;
+        }
+        fclose(f);
+    }
+    printf("input : %s -> bank %d", in.mFilename, in.mBank);
+    if (lastbank != in.mBank)
+        printf("..%d", lastbank);
+    printf(" (%d bytes)\n", in.mEnd - in.mStart + 1);
+    gInputs++;
+    return 1;
+}
+
+// Copy an optional block (palette, loading screen) of exactly aSize bytes.
+int writeblock(char * aFn, int aSize, FILE * aF)
+{
+    int len;
+    unsigned char * data = readfile(aFn, len);
+    if (data == 0)
+        return 0;
+    if (len != aSize)
     {
-        printf("Start address is not 0xc000");
-        exit(0);
+        printf("\"%s\" is %d bytes, expected %d\n", aFn, len, aSize);
+        delete[] data;
+        return 0;
     }
-    fwrite(data + start, 1, len, aF);
+    crcwrite(data, len, aF);
     delete[] data;
+    return 1;
+}
+
+long filesize(char * aFn)
+{
+    FILE * f = fopen(aFn, "rb");
+    if (!f)
+        return -1;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fclose(f);
+    return len;
+}
+
+// Everything after the header. Returns 0 on failure.
+int writebody(NEXHEADER &h, char * aScreen, int aScreenSize, char * aPalette, FILE * aF)
+{
+    if (aScreen)
+    {
+        if ((h.LoadingScreen & 129) == 1)
+        {
+            if (!writeblock(aPalette, 512, aF))
+                return 0;
+        }
+        if (!writeblock(aScreen, aScreenSize, aF))
+            return 0;
+    }
+
+    for (int i = 0; i < MAX_BANKS; i++)
+    {
+        int b = nexbank(i);
+        if (h.Banks[b])
+            crcwrite(gImage + b * BANK_SIZE, BANK_SIZE, aF);
+    }
+    return 1;
+}
+
+int linker(int parc, char ** pars)
+{
+    NEXHEADER h;
+    inithdr(h);
+    char * outfile = 0;
+    char * screen = 0;
+    char * palette = 0;
+    int screensize = 0;
+    int checksum = 1;
+    int entrybank = 0;
+
+    for (int i = 1; i < parc; i++)
+    {
+        char * a = pars[i];
+        int more = i + 1 < parc;
+        if (a[0] != '-')
+        {
+            if (!addinput(a))
+                return 1;
+        }
+        else
+        if (strcmp(a, "-o") == 0 && more) outfile = pars[++i]; else
+        if (strcmp(a, "-pc") == 0 && more) h.PC = parsenum(pars[++i]); else
+        if (strcmp(a, "-sp") == 0 && more) h.SP = parsenum(pars[++i]); else
+        if (strcmp(a, "-entrybank") == 0 && more) entrybank = parsenum(pars[++i]); else
+        if (strcmp(a, "-ram") == 0 && more) h.RAM_Required = parsenum(pars[++i]); else
+        if (strcmp(a, "-border") == 0 && more) h.BorderColour = parsenum(pars[++i]) & 7; else
+        if (strcmp(a, "-screen") == 0 && more) screen = pars[++i]; else
+        if (strcmp(a, "-palette") == 0 && more) palette = pars[++i]; else
+        if (strcmp(a, "-nocrc") == 0) checksum = 0; else
+        if (strcmp(a, "-bar") == 0 && more) { h.loadingBar = 1; h.loadingColour = parsenum(pars[++i]); } else
+        if (strcmp(a, "-core") == 0 && more)
+        {
+            int ma = 0, mi = 0, sub = 0;
+            sscanf(pars[++i], "%d.%d.%d", &ma, &mi, &sub);
+            h.CoreRequired[0] = ma;
+            h.CoreRequired[1] = mi;
+            h.CoreRequired[2] = sub;
+        }
+        else
+        {
+            printf("Unknown or incomplete option \"%s\"\n", a);
+            return 1;
+        }
+    }
+    if (outfile == 0 || gInputs == 0)
+    {
+        printf("Need -o output.nex and at least one bank:file input\n");
+        return 1;
+    }
+
+    for (int i = 0; i < gInputs; i++)
+    {
+        Input &in = gInput[i];
+        int lastbank = in.mBank + (in.mEnd - in.mBase) / BANK_SIZE;
+        for (int j = in.mBank; j <= lastbank; j++)
+            h.Banks[j] = 1;
+    }
+    int banks = 0;
+    int highbank = 0;
+    for (int i = 0; i < MAX_BANKS; i++)
+    {
+        if (h.Banks[i])
+        {
+            banks++;
+            highbank = i;
+        }
+    }
+    h.NumBanksToLoad = banks;
+    // banks above 47 need the 2MB machine
+    if (highbank >= 48)
+        h.RAM_Required = 1;
+    if (entrybank < 0 || entrybank >= MAX_BANKS)
+    {
+        printf("Entry bank %d out of range\n", entrybank);
+        return 1;
+    }
+    // EntryBank is a V1.2 field, older loaders would run PC in bank 0
+    h.EntryBank = entrybank;
+    if (h.EntryBank)
+        h.VersionNumber[3] = '2';
+
+    if (screen)
+    {
+        screensize = (int)filesize(screen);
+        if (screensize == 256 * 192)
+            h.LoadingScreen = 1; // layer 2
+        else
+        if (screensize == 6912)
+            h.LoadingScreen = 2; // ULA
+        else
+        {
+            printf("Loading screen \"%s\" is %d bytes; expected 49152 (layer 2) or 6912 (ULA)\n", screen, screensize);
+            return 1;
+        }
+        // palette block goes with a layer 2 screen; without one, use the default
+        if (h.LoadingScreen == 1 && palette == 0)
+            h.LoadingScreen |= 128;
+    }
+    if (palette && h.LoadingScreen != 1)
+    {
+        printf("-palette needs a layer 2 -screen\n");
+        return 1;
+    }
+
+    FILE * f = fopen(outfile, "wb");
+    if (!f)
+    {
+        printf("Unable to open %s\n", outfile);
+        return 1;
+    }
+    printf("output: %s, %d banks\n", outfile, banks);
+    h.FirstBankOffset = sizeof(h);
+    if ((h.LoadingScreen & 129) == 1)
+        h.FirstBankOffset += 512;
+    if (screen)
+        h.FirstBankOffset += screensize;
+    // rewritten with the checksum once the banks are out
+    fwrite(&h, 1, sizeof(h), f);
+    if (!writebody(h, screen, screensize, palette, f))
+    {
+        // don't leave a broken .nex for the next build step to pick up
+        fclose(f);
+        remove(outfile);
+        return 1;
+    }
+    finishhdr(h, checksum, f);
+    fclose(f);
+    return 0;
 }
 
 int main(int parc, char ** pars)
 {
     if (parc < 3)
     {
-        printf("Usage: input.ihx output.nex\n");
-        return 0;
+        printf(
+            "Usage: input.ihx output.nex\n"
+            "   or: -o output.nex [options] bank:file [bank:file..]\n"
+            "       file is .ihx (placed by its address within the bank) or raw (from bank offset 0),\n"
+            "       data past the end of a bank continues in the next bank number.\n"
+            "Options:\n"
+            "  -pc addr       entry point (default 0xc000, 0 = load only)\n"
+            "  -sp addr       stack pointer (default 0xffff)\n"
+            "  -entrybank n   16K bank paged to 0xc000 before jumping to pc\n"
+            "  -ram n         0 = 768K, 1 = 1792K (set automatically for banks >= 48)\n"
+            "  -core x.y.z    minimum core version\n"
+            "  -screen file   loading screen, 49152 byte layer 2 or 6912 byte ULA\n"
+            "  -palette file  512 byte 9-bit palette for the layer 2 loading screen\n"
+            "  -border n      border colour 0-7\n"
+            "  -bar n         show loading bar using layer 2 colour n\n"
+            "  -nocrc         don't store a CRC-32C checksum (stored by default)\n");
+        return 1;
     }
+    if (pars[1][0] == '-')
+        return linker(parc, pars);
     printf("input : %s\noutput: %s\n", pars[1], pars[2]);
     FILE * f;
+    NEXHEADER h;
     f = fopen(pars[2], "wb");
-    writehdr(0, f);
-    writecode(pars[1], f);
+    if (!f)
+    {
+        printf("Unable to open %s\n", pars[2]);
+        return 1;
+    }
+    writehdr(h, 0, f);
+    if (!writecode(pars[1], f))
+    {
+        fclose(f);
+        remove(pars[2]);
+        return 1;
+    }
+    h.FirstBankOffset = sizeof(h);
+    finishhdr(h, 1, f);
     fclose(f);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
+#include "../common/crc32c.c"
 
 typedef struct {
     unsigned char Next[4];			//"Next"
@@ -36,14 +51,343 @@ typedef struct {
 }HEADER;
 HEADER h;
 
+// Map the whole file read-only. Returns 0 on failure.
+const unsigned char * mapfile(const char * aFn, size_t &aLen)
+{
+#ifdef _WIN32
+    HANDLE f = CreateFileA(aFn, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (f == INVALID_HANDLE_VALUE)
+        return 0;
+    LARGE_INTEGER size;
+    GetFileSizeEx(f, &size);
+    aLen = (size_t)size.QuadPart;
+    HANDLE m = aLen ? CreateFileMappingA(f, 0, PAGE_READONLY, 0, 0, 0) : 0;
+    CloseHandle(f);
+    if (m == 0)
+        return 0;
+    const unsigned char * p = (const unsigned char *)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(m);
+    return p;
+#else
+    int fd = open(aFn, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    fstat(fd, &st);
+    aLen = (size_t)st.st_size;
+    void * p = aLen ? mmap(0, aLen, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+        return 0;
+    return (const unsigned char *)p;
+#endif
+}
+
+void unmapfile(const unsigned char * aData, size_t aLen)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(aData);
+#else
+    munmap((void *)aData, aLen);
+#endif
+}
+
+// Recompute the CRC-32C: file from offset 512 to end, then header bytes 0..507.
+// Returns 0 if it matches the stored value.
+int verify(const char * aFn)
+{
+    size_t len;
+    const unsigned char * data = mapfile(aFn, len);
+    if (data == 0)
+    {
+        printf("Unable to map %s\n", aFn);
+        return 1;
+    }
+    int ret = 1;
+    if (len < 512 || memcmp(data, "Next", 4) != 0)
+    {
+        printf("%s: Not a specnext .nex header\n", aFn);
+    }
+    else
+    if (((const HEADER *)data)->HasChecksum == 0)
+    {
+        printf("%s: No checksum stored\n", aFn);
+    }
+    else
+    {
+        unsigned int stored = data[508] | (data[509] << 8) | (data[510] << 16) | ((unsigned int)data[511] << 24);
+        unsigned int crc = crc32c_update(0, data + 512, len - 512);
+        crc = crc32c_update(crc, data, 508);
+        if (crc == stored)
+        {
+            printf("%s: CRC ok (%08x)\n", aFn, crc);
+            ret = 0;
+        }
+        else
+        {
+            printf("%s: CRC mismatch, stored %08x, computed %08x\n", aFn, stored, crc);
+        }
+    }
+    unmapfile(data, len);
+    return ret;
+}
+
+/*
+ * Batch mode: --json or --csv followed by files and/or directories
+ * (searched recursively for .nex). Only the 512 byte header of each file
+ * is read, on several threads, and one row per file is printed in input
+ * order. Exit code is 1 if any file couldn't be read or isn't a .nex.
+ */
+
+struct Row
+{
+    std::string mFile;
+    const char * mError; // 0 if the header was read fine
+    HEADER mH;
+};
+
+int isnex(const std::filesystem::path &aPath)
+{
+    std::string ext = aPath.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".nex";
+}
+
+void gatherfiles(const char * aArg, std::vector<Row> &aRows)
+{
+    std::error_code ec;
+    if (std::filesystem::is_directory(aArg, ec))
+    {
+        std::vector<std::string> found;
+        for (auto &e : std::filesystem::recursive_directory_iterator(aArg, ec))
+        {
+            if (e.is_regular_file(ec) && isnex(e.path()))
+                found.push_back(e.path().string());
+        }
+        std::sort(found.begin(), found.end());
+        for (auto &x : found)
+        {
+            Row r;
+            r.mFile = x;
+            aRows.push_back(r);
+        }
+    }
+    else
+    {
+        Row r;
+        r.mFile = aArg;
+        aRows.push_back(r);
+    }
+}
+
+void readrow(Row &aRow)
+{
+    FILE * f = fopen(aRow.mFile.c_str(), "rb");
+    if (!f)
+    {
+        aRow.mError = "open failed";
+        return;
+    }
+    size_t n = fread(&aRow.mH, 1, 512, f);
+    fclose(f);
+    if (n != 512)
+        aRow.mError = "short file";
+    else
+    if (memcmp(aRow.mH.Next, "Next", 4) != 0)
+        aRow.mError = "not a nex file";
+    else
+        aRow.mError = 0;
+}
+
+// Loading screen flag names, space separated
+std::string screenflags(const HEADER &aH)
+{
+    static const char * name[8] = { "layer2", "ula", "lores", "hires", "hicolour", "", "flags2", "nopalette" };
+    std::string s;
+    for (int i = 0; i < 8; i++)
+    {
+        if ((aH.LoadingScreen & (1 << i)) && name[i][0])
+        {
+            if (!s.empty())
+                s += " ";
+            s += name[i];
+        }
+    }
+    if (aH.LoadingScreen & 64)
+    {
+        static const char * name2[4] = { "", "layer2_320", "layer2_640", "tilemap" };
+        if (aH.LoadingScreen2 > 0 && aH.LoadingScreen2 < 4)
+        {
+            s += " ";
+            s += name2[aH.LoadingScreen2];
+        }
+    }
+    return s;
+}
+
+std::string banklist(const HEADER &aH)
+{
+    std::string s;
+    char tmp[8];
+    for (int i = 0; i < 64 + 48; i++)
+    {
+        if (aH.Banks[i])
+        {
+            sprintf(tmp, s.empty() ? "%d" : " %d", i);
+            s += tmp;
+        }
+    }
+    return s;
+}
+
+std::string jsonstr(const std::string &aS)
+{
+    std::string s = "\"";
+    for (char c : aS)
+    {
+        if (c == '"' || c == '\\')
+        {
+            s += '\\';
+            s += c;
+        }
+        else
+        if ((unsigned char)c < 32)
+        {
+            char tmp[8];
+            sprintf(tmp, "\\u%04x", c);
+            s += tmp;
+        }
+        else
+        {
+            s += c;
+        }
+    }
+    return s + "\"";
+}
+
+std::string csvstr(const std::string &aS)
+{
+    if (aS.find_first_of(",\"\r\n") == std::string::npos)
+        return aS;
+    std::string s = "\"";
+    for (char c : aS)
+    {
+        if (c == '"')
+            s += '"';
+        s += c;
+    }
+    return s + "\"";
+}
+
+void printrow(const Row &aRow, int aJson)
+{
+    const HEADER &h = aRow.mH;
+    if (aRow.mError)
+    {
+        if (aJson)
+            printf("{\"file\":%s,\"error\":\"%s\"}\n", jsonstr(aRow.mFile).c_str(), aRow.mError);
+        else
+            printf("%s,%s,,,,,,,,,,,,\n", csvstr(aRow.mFile).c_str(), aRow.mError);
+        return;
+    }
+    char version[5] = { (char)h.VersionNumber[0], (char)h.VersionNumber[1], (char)h.VersionNumber[2], (char)h.VersionNumber[3], 0 };
+    std::string banks = banklist(h);
+    std::string screen = screenflags(h);
+    if (aJson)
+    {
+        std::string b = banks;
+        std::replace(b.begin(), b.end(), ' ', ',');
+        std::string sc = "[";
+        size_t start = 0;
+        while (start < screen.size())
+        {
+            size_t end = screen.find(' ', start);
+            if (end == std::string::npos)
+                end = screen.size();
+            if (sc.size() > 1)
+                sc += ",";
+            sc += jsonstr(screen.substr(start, end - start));
+            start = end + 1;
+        }
+        sc += "]";
+        printf("{\"file\":%s,\"version\":%s,\"ram_k\":%d,\"num_banks\":%d,\"banks\":[%s],"
+            "\"loading_screen\":%d,\"loading_screen_flags\":%s,\"core\":\"%d.%d.%d\","
+            "\"pc\":%d,\"sp\":%d,\"entry_bank\":%d,\"has_checksum\":%d,\"crc\":\"%08x\"}\n",
+            jsonstr(aRow.mFile).c_str(), jsonstr(version).c_str(), h.RAM_Required ? 1792 : 768, h.NumBanksToLoad, b.c_str(),
+            h.LoadingScreen, sc.c_str(), h.CoreRequired[0], h.CoreRequired[1], h.CoreRequired[2],
+            h.PC, h.SP, h.EntryBank, h.HasChecksum, h.CRC);
+    }
+    else
+    {
+        printf("%s,,%s,%d,%d,%s,%d,%s,%d.%d.%d,%d,%d,%d,%d,%08x\n",
+            csvstr(aRow.mFile).c_str(), csvstr(version).c_str(), h.RAM_Required ? 1792 : 768, h.NumBanksToLoad, banks.c_str(),
+            h.LoadingScreen, screen.c_str(), h.CoreRequired[0], h.CoreRequired[1], h.CoreRequired[2],
+            h.PC, h.SP, h.EntryBank, h.HasChecksum, h.CRC);
+    }
+}
+
+int batch(int parc, char ** pars)
+{
+    int json = strcmp(pars[1], "--json") == 0;
+    int threads = (int)std::thread::hardware_concurrency();
+    std::vector<Row> rows;
+    for (int i = 2; i < parc; i++)
+    {
+        if (strcmp(pars[i], "-j") == 0 && i + 1 < parc)
+            threads = atoi(pars[++i]);
+        else
+            gatherfiles(pars[i], rows);
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > (int)rows.size())
+        threads = (int)rows.size();
+
+    // Hand out files one at a time; header reads are tiny so the cost is
+    // all in open/seek latency, which is what the threads overlap.
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < threads; i++)
+    {
+        pool.emplace_back([&]() {
+            size_t n;
+            while ((n = next++) < rows.size())
+                readrow(rows[n]);
+        });
+    }
+    for (auto &t : pool)
+        t.join();
+
+    if (!json)
+        printf("file,error,version,ram_k,num_banks,banks,loading_screen,loading_screen_flags,core,pc,sp,entry_bank,has_checksum,crc\n");
+    int fails = 0;
+    for (auto &r : rows)
+    {
+        printrow(r, json);
+        if (r.mError)
+            fails++;
+    }
+    return fails ? 1 : 0;
+}
 
 int main(int parc, char ** pars)
 {
     if (parc < 2)
     {
         printf("Usage: %s nex file\n", pars[0]);
+        printf("   or: %s --verify nex file [nex file..]\n", pars[0]);
+        printf("   or: %s --json|--csv [-j threads] file|dir [file|dir..]\n", pars[0]);
         return 0;
     }
+    if (strcmp(pars[1], "--json") == 0 || strcmp(pars[1], "--csv") == 0)
+        return batch(parc, pars);
+    if (strcmp(pars[1], "--verify") == 0)
+    {
+        int fails = 0;
+        for (int i = 2; i < parc; i++)
+            fails += verify(pars[i]);
+        return fails ? 1 : 0;
+    }
     FILE * f = fopen(pars[1], "rb");
     if (!f)
     {
@@ -13,7 +13,7 @@
 
 ; extern unsigned char* dzx7_mega(unsigned char *src) __z88dk_fastcall;
 _dzx7_mega::
-        ld      de, #0xe800 ; zakplay buffer_b, fastcall puts src to hl
+        ld      de, (0xe217) ; zakplay decodedst, fastcall puts src to hl
 dzx7_mega:
         ld      a, #0x80
 dzx7m_copy_byte_loop_ev:
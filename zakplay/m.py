@@ -38,6 +38,7 @@ src = [
 	"ay.s",
 	"isr.s",
 	"dzx7_mega.s",
+	"../common/dma.s",
 	"zakplay.c"
 	]
 
@@ -7,16 +7,16 @@
  
  
  /*
+ Buffers A and B are the two halves of a 2K ring; the ISR plays through
+ the ring and the app decodes the next kblock into the half just played.
+ 
  State machine:
- 0 - ISR playing from buffer A, app should just wait. ISR 0->1
+ 0 - ISR playing, app should just wait.               ISR 0->1
  0 - ISR notices the song ends                        ISR 0->4
- 0 - ISR notices the song ends and wants to loop      ISR 0->5
- 1 - ISR moved to buffer B, app should copy B to A.   App 1->2
- 2 - App copied B to A, ISR should move to A.         ISR 2->3
- 3 - ISR moved to A, app should fill buffer B.        App 3->0
+ 1 - ISR moved to the other half, app should decode
+     the next kblock into the one it left.            App 1->0
  4 - Shutdown and quit                                n/a
- 5 - App copies loop point to buffers a and b         App 5->6
- 6 - ISR moved to A/B                                 ISR 6->0 or 6->1 
+ (looping is still todo)
  */
 
 
@@ -48,7 +48,7 @@ extern void freepage(unsigned char page);
 extern void setaychip(unsigned char val);
 extern void aywrite(unsigned char reg, unsigned char val);
 
-extern unsigned short framecounter;
+extern volatile unsigned short framecounter; // bumped by the isr
 extern char *cmdline;
 extern void setupisr7();
 extern void closeisr7();
@@ -56,6 +56,8 @@ extern void setupisr0();
 extern void di();
 extern void ei();
 extern unsigned char* dzx7_mega(unsigned char *src)  __z88dk_fastcall;         
+extern void dma_init();
+extern void dma_memset(char *dest, const short value, unsigned short count);
 
 void printnum(unsigned char v, unsigned char x, unsigned char y)
 {
@@ -90,18 +92,26 @@ __at (0xe100) unsigned char pages[100];
 __at (0xe200) unsigned char activepage;
 __at (0xe201) unsigned short ofs;
 __at (0xe203) unsigned char framedelay;
-__at (0xe204) unsigned char state;
+__at (0xe204) volatile unsigned char state;
 __at (0xe205) unsigned short srcofs;
 __at (0xe207) unsigned short kblock;
 __at (0xe209) unsigned short maxscan;
 __at (0xe20b) unsigned short scanlineskip;
 __at (0xe20d) unsigned char frameskip;
 __at (0xe20e) unsigned short nextscanline;
+__at (0xe210) unsigned char loadpage;
+__at (0xe211) unsigned short loadpos;
+__at (0xe213) unsigned char loadeof;
+__at (0xe214) unsigned char songfile;
+__at (0xe215) unsigned short lastframe;
+__at (0xe217) unsigned short decodedst; // used by dzx7_mega
+__at (0xe219) unsigned short playblock;
 __at (0xe250) unsigned char debugvalue;
 
 __at (0xe300) unsigned char ayregs[48];
 __at (0xe400) unsigned char buffer_a[1024];
 __at (0xe800) unsigned char buffer_b[1024];
+__at (0xe400) unsigned char ringbuf[2048];
 __at (0xf000) unsigned char zakheader[100];
 __at (0xf000+10) unsigned char zak_chiptype;
 __at (0xf000+11) unsigned char zak_flags;
@@ -124,26 +134,6 @@ char memcmp(char *a, char *b, unsigned short l)
     return 0;
 }
 
-void memset(char *a, char b, unsigned short l)
-{
-    unsigned short i = 0;
-    while (i < l)
-    {
-        a[i] = b;
-        i++;
-    }
-}
-
-void memcpy(char *a, char * b, unsigned short l)
-{
-    unsigned short i = 0;
-    while (i < l)
-    {
-        a[i] = b[i];
-        i++;
-    }
-}
-
 void bytetohex(unsigned char v, char *p)
 {
     char hex[17] = "0123456789ABCDEF";
@@ -166,22 +156,84 @@ void printshort(unsigned short v, unsigned char x, unsigned char y)
     drawstringz(temp, x, y);    
 }
 
-// really good candidate for optimization (both size and speed wise)
-void copybufbtoa()
+// The song is streamed through a ring of RINGPAGES pages: loadpage/loadpos
+// is how far the file has been read, activepage/srcofs how far it has been
+// decoded. The ring is topped up from the main loop, so memory use doesn't
+// depend on song length.
+#define RINGPAGES 4
+// more than one compressed kblock can take
+#define BLOCKMAX 2048
+// one read per isr tick; divides the page size
+#define STREAMPIECE 256
+
+// Read the next bytes of the song into the ring. Must not cross a page.
+void streamread(unsigned short bytes)
+{
+    unsigned short b;
+    writenextreg(0x56, pages[2 + (loadpage & (RINGPAGES - 1))]);
+    b = fread(songfile, (unsigned char*)0xc000 + loadpos, bytes);
+    loadpos += b;
+    if (b != bytes)
+        loadeof = 1;
+    if (loadpos == 8192)
+    {
+        loadpos = 0;
+        loadpage++;
+    }
+}
+
+// Bytes loaded but not decoded yet
+unsigned short buffered()
+{
+    return ((unsigned short)(unsigned char)(loadpage - activepage) << 13) + loadpos - (srcofs - 0xa000);
+}
+
+// The isr lives in dot memory which esxdos pages out, so reads happen with
+// interrupts off, and a line interrupt that comes during one is lost. So
+// every read is one STREAMPIECE, started right after a tick. A piece
+// crosses at most one 512 byte sector, so the worst case is one card
+// read plus a cluster lookup, a couple of ms, against a tick period of
+// 1 / (replay rate rounded up to >= 70Hz): 14ms at most, 5ms for a 200Hz
+// song. A piece per tick is more than the songs use; a whole kblock of
+// register writes lasts over ten ticks.
+void streampiece()
 {
-    memcpy(buffer_a, buffer_b, 1024);
+    while (lastframe == framecounter)
+        ;
+    lastframe = framecounter;
+    di();
+    streamread(STREAMPIECE);
+    ei();
+}
+
+// Top up the ring, a piece per tick, from the main loop
+void streamahead()
+{
+    if (lastframe == framecounter)
+        return;
+    if (loadeof || kblock == zak_kblocks || (unsigned char)(loadpage - activepage) >= RINGPAGES)
+        return;
+    streampiece();
 }
 
-void fillbufb()
+// Decode the next kblock; odd ones go to A, even ones to B.
+void fillbuf()
 {
+    unsigned char *dst = (kblock & 1) ? buffer_b : buffer_a;
     if (kblock == zak_kblocks)
     {
-        memset(buffer_b, 0, 1024);
+        dma_memset(dst, 0, 1024);
         return;
     }
     kblock++;
-    writenextreg(0x55, pages[2 + activepage]);
-    writenextreg(0x56, pages[2 + activepage + 1]);
+    decodedst = (unsigned short)dst;
+    // underrun; only happens after the isr is up (the initial fill covers
+    // the first blocks), and still a piece per tick, as the ticks keep
+    // playing from the other buffer meanwhile
+    while (!loadeof && buffered() < BLOCKMAX)
+        streampiece();
+    writenextreg(0x55, pages[2 + (activepage & (RINGPAGES - 1))]);
+    writenextreg(0x56, pages[2 + ((activepage + 1) & (RINGPAGES - 1))]);
     //memcpy(buffer_b, (unsigned char*)srcofs, 1024);    
     srcofs = (unsigned short)dzx7_mega((unsigned char*)srcofs) - 2;
     //printshort(debugvalue, 0, 7);
@@ -219,11 +271,8 @@ void isr()
     writenextreg(0x22, 2 + 4 + (nextscanline >> 8));
     writenextreg(0x23, nextscanline & 0xff);
     
-    if (state == 2)
-    {
-        ofs -= 1024;
-        state = 3;
-    }
+    if (state == 4)
+        return;
     //gPort254 = 0;
 
     if (framedelay)
@@ -235,11 +284,11 @@ void isr()
     //gPort254 = 2;
     do
     {
-        val = buffer_a[ofs]; ofs++;
-        reg = buffer_a[ofs]; ofs++;
-        if (kblock == zak_kblocks)
+        val = ringbuf[ofs]; ofs++;
+        reg = ringbuf[ofs]; ofs++;
+        if (playblock == zak_kblocks)
         {
-            if (ofs >= 1024 + zak_lastblock)
+            if ((ofs & 1023) >= zak_lastblock || (ofs & 1023) == 0)
             {
                 // todo: handle looping
                 state = 4;
@@ -247,8 +296,10 @@ void isr()
         }
         else
         {
-            if (ofs == 1024)
+            if ((ofs & 1023) == 0)
             {
+                ofs &= 2047;
+                playblock++;
                 state = 1;
             }
         }
@@ -349,18 +400,22 @@ char checkhdr(char f)
     return 0;
 }
 
-// Allocate pages and load the whole file while there's data to be read..
-void readsongdata(char f)
+// Allocate the ring and load the first two pages, the rest streams
+// during playback
+void startstream(char f)
 {
-    unsigned short b;
-    do
+    unsigned char i;
+    for (i = 0; i < RINGPAGES; i++)
     {
         pages[0]++;
         pages[pages[0]] = allocpage();
-        writenextreg(0x56, pages[pages[0]]);
-        b = fread(f, (unsigned char*)0xc000, 8192);
     }
-    while (b == 8192);
+    songfile = f;
+    loadpage = 0;
+    loadpos = 0;
+    loadeof = 0;
+    while (!loadeof && loadpage < 2)
+        streamread(8192);
 }
 
 void vis()
@@ -398,7 +453,7 @@ void vis()
         *((unsigned char *)yofs[23] + i + 512) = (i >= prog) ? 0 : 0xff;
     }
 
-    prog = ofs >> 5;
+    prog = (ofs & 1023) >> 5;
     
     for (i = 0; i < 32; i++)
     {
@@ -462,15 +517,17 @@ void main()
     char f;
     char r;
     char r7;
+    char refill;
     char vidmode;
     unsigned long templong;
     unsigned long templong2;
     unsigned short i;
     r7 = readnextreg(0x07); // turbo
     writenextreg(0x07, 3); // set speed to 28MHz
+    dma_init();
     
-    memset((unsigned char*)yofs[0],0,192*32);
-    memset((unsigned char*)yofs[0]+192*32,7,24*32);
+    dma_memset((unsigned char*)yofs[0],0,192*32);
+    dma_memset((unsigned char*)yofs[0]+192*32,7,24*32);
     gPort254 = 0;
     drawlogo();
     vidmode = (readnextreg(0x11) & 7) | ((readnextreg(0x5) & 4)?8:0);
@@ -503,8 +560,7 @@ void main()
     }
     else
     {        
-        readsongdata(f);
-        fclose(f); // avoid disk issues if we crash after this
+        startstream(f);
         templong = 0;
         maxscan = findmaxscan();
 
@@ -529,8 +585,8 @@ void main()
         }       
         scanlineskip >>= 4; // div by 16, and we have our scanlineskip value
                 
-        memset(ayregs, 0, 3*16);
-        drawstringz("ZAK player 0.2 by Jari Komppa", 0, 0);
+        dma_memset(ayregs, 0, 3*16);
+        drawstringz("ZAK player 0.3 by Jari Komppa", 0, 0);
         drawstringz("http://iki.fi/sol", 0, 1);        
                
         debugvalue = 0;
@@ -540,11 +596,12 @@ void main()
         framedelay = 0;
         state = 0;
         kblock = 0;
+        playblock = 1;
 
-        fillbufb();
-        copybufbtoa();
-        fillbufb();
+        fillbuf();
+        fillbuf();
 
+        lastframe = framecounter;
         setupisr7();
         readkeyboard();
         writenextreg(0x22, 2+4); // enable line interrupt, disable ula interript
@@ -555,19 +612,23 @@ void main()
         {
             readkeyboard();
             vis(); 
+            streamahead();
             if (state == 1)
             {
-                copybufbtoa();
-                state = 2;
-            }
-            if (state == 3)
-            {
-                fillbufb();
-                state = 0;
+                // The isr can set 4 (end of song) between the test and
+                // the store, so clear only the 1 we saw, without it.
+                di();
+                refill = state == 1;
+                if (refill)
+                    state = 0;
+                ei();
+                if (refill)
+                    fillbuf();
             }
         }    
         di();    
         closeisr7();
+        fclose(f);
     }
     zeroay(); // silence, please
     writenextreg(0x22, nextregbackup[0x22]);